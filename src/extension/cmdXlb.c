@@ -9,6 +9,7 @@
 #include <cmd.h>
 #include <die.h>
 #include <maglevdyn.h>
+#include <hash.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -31,10 +32,10 @@ static struct MagDataDyn magd;
 #define Dx(x)
 #endif
 
-#define FW(table) *table.lookup < 0 ? -1 : table.active[table.lookup[hash % table.M]]
+#define FW(table) magDataDyn_lookup(&table, hash)
 
 static int packetHandleFn(
-	unsigned short proto, void* data, unsigned len)
+	unsigned short proto, void* data, unsigned len, unsigned origlen)
 {
 	struct ctKey key;
 	uint64_t fragid;
@@ -42,7 +43,7 @@ static int packetHandleFn(
 	if (rc < 0)
 		return -1;
 	unsigned hash = hashKeyAddresses(&key);
-	Dx(printf("Packet; len=%u, fw=%d\n", len, FW(magd)));
+	Dx(printf("Packet; len=%u, fw=%d\n", origlen, FW(magd)));
 	return FW(magd);
 }
 
@@ -67,7 +68,8 @@ static int cmdXlb(int argc, char **argv)
 		{0, 0, 0, 0}
 	};
 	(void)parseOptionsOrDie(argc, argv, options);
-	st = mapSharedDataOrDie(targetShm, O_RDONLY);
+	st = mapTargetShmOrDie(targetShm, O_RDONLY);
+	hashSetFunction(st->hashFn, st->hashSeed);
 	magDataDyn_map(&magd, st->mem);
 
 
@@ -0,0 +1,86 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+#include "affinity.h"
+#include "threadstats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MS 1000000				/* One milli second in nanos */
+
+/*
+  The fwmark and tag are stored in the ct data pointer. The top bit is
+  set so the data is never NULL.
+ */
+_Static_assert(sizeof(void*) == sizeof(uint64_t), "64-bit pointers required");
+#define ENTRY_VALID (1ULL << 63)
+
+struct Affinity {
+	struct ct* ct;
+	struct ctStats* stats;
+};
+
+struct Affinity* affinityCreate(
+	unsigned size, unsigned ttlMillis, unsigned nThreads)
+{
+	struct Affinity* a = calloc(1, sizeof(*a));
+	if (a == NULL)
+		return NULL;
+	a->ct = ctCreate(
+		size + size / 2, (uint64_t)ttlMillis * MS, NULL, NULL, NULL, NULL, NULL);
+	if (a->ct == NULL) {
+		free(a);
+		return NULL;
+	}
+	if (nThreads > 1) {
+		a->stats = aligned_alloc(STATS_ALIGN, nThreads * sizeof(struct ctStats));
+		if (a->stats == NULL) {
+			affinityDestroy(a);
+			return NULL;
+		}
+		ctUseThreadStats(a->ct, a->stats, nThreads, sizeof(struct ctStats));
+	}
+	return a;
+}
+
+int affinityLookup(
+	struct Affinity* a, struct timespec* now, struct ctKey const* key,
+	unsigned* tag)
+{
+	uint64_t v = (uintptr_t)ctLookup(a->ct, now, key);
+	if (v == 0)
+		return -1;
+	*tag = (v >> 32) & 0x7fffffff;
+	return (int)(uint32_t)v;
+}
+
+int affinityInsert(
+	struct Affinity* a, struct timespec* now, struct ctKey const* key,
+	int fw, unsigned tag)
+{
+	uint64_t v = ENTRY_VALID | ((uint64_t)(tag & 0x7fffffff) << 32) | (uint32_t)fw;
+	return ctInsert(a->ct, now, key, (void*)(uintptr_t)v);
+}
+
+void affinityRemove(
+	struct Affinity* a, struct timespec* now, struct ctKey const* key)
+{
+	ctRemove(a->ct, now, key);
+}
+
+struct ctStats const* affinityStats(struct Affinity* a, struct timespec* now)
+{
+	return ctStats(a->ct, now);
+}
+
+void affinityDestroy(struct Affinity* a)
+{
+	if (a == NULL)
+		return;
+	ctDestroy(a->ct);
+	free(a->stats);
+	free(a);
+}
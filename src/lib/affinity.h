@@ -0,0 +1,53 @@
+#pragma once
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+#include "conntrack.h"
+
+/*
+  Connection affinity
+
+  Remembers the fwmark chosen for a connection (the 5-tuple), as the
+  connection tracking in section 3.3 in the Maglev paper. A hit skips
+  the flow classification and the hash lookup, and keeps the
+  connection on its target when targets are added. An entry times out
+  when the connection has been idle for "ttl".
+
+  A "tag" (31 bits) is stored with the fwmark. The caller uses it to
+  validate a hit, e.g. the index of the target in the active table or
+  a configuration generation. An invalid entry should be removed with
+  affinityRemove() before a new fwmark is inserted.
+
+  The table is an open addressing ct (see conntrack.h), so lookups are
+  lock-free. Inserts may fail when the table is full, the packet is
+  then load-balanced without affinity.
+ */
+
+struct Affinity;
+
+/*
+  size - Max connections. The ct size is ~1.5 times larger
+  ttlMillis - Idle timeout
+  nThreads - Per-thread stats blocks (see threadstats.h)
+ */
+struct Affinity* affinityCreate(
+	unsigned size, unsigned ttlMillis, unsigned nThreads);
+
+// Returns the fwmark and sets "tag", or -1 if not found
+int affinityLookup(
+	struct Affinity* a, struct timespec* now, struct ctKey const* key,
+	unsigned* tag);
+
+// Returns 0 on success (see ctInsert)
+int affinityInsert(
+	struct Affinity* a, struct timespec* now, struct ctKey const* key,
+	int fw, unsigned tag);
+
+void affinityRemove(
+	struct Affinity* a, struct timespec* now, struct ctKey const* key);
+
+struct ctStats const* affinityStats(struct Affinity* a, struct timespec* now);
+
+void affinityDestroy(struct Affinity* a);
@@ -0,0 +1,41 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+#include "backend.h"
+#include "tpacket.h"
+#include <die.h>
+#include <string.h>
+
+static struct Backend const backends[] = {
+	{"nfqueue", nfqueueInit, nfqueueUseStats, nfqueueRun},
+	{"tpacket", tpacketInit, tpacketUseStats, tpacketRun},
+	{NULL, NULL, NULL, NULL}
+};
+
+#define MAX_BACKENDS 8
+static struct Backend const* added[MAX_BACKENDS + 1] = {NULL};
+
+void addBackend(struct Backend const* backend)
+{
+	struct Backend const** b = added;
+	while (*b != NULL) b++;
+	if (b - added >= MAX_BACKENDS)
+		die("Too many backends\n");
+	*b = backend;
+}
+
+struct Backend const* backendGetOrDie(char const* name)
+{
+	struct Backend const* b;
+	for (b = backends; b->name != NULL; b++) {
+		if (strcmp(b->name, name) == 0)
+			return b;
+	}
+	for (struct Backend const** a = added; *a != NULL; a++) {
+		if (strcmp((*a)->name, name) == 0)
+			return *a;
+	}
+	die("Unknown backend [%s]\n", name);
+}
@@ -0,0 +1,34 @@
+#pragma once
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+#include <nfqueue.h>
+
+/*
+  Packet I/O backends. The packet handling is done in a
+  packetHandleFn_t which is backend agnostic. The backend receives
+  packets, calls the packet handler and applies the returned fwmark.
+
+  nfqueue (default) - NFQUEUE, the fwmark is set in the verdict
+  tpacket - AF_PACKET TPACKET_V3 rx ring, packets are steered to an
+            interface per fwmark (see tpacket.h)
+
+  The "queue" passed to run() is a NF-queue for nfqueue and a thread
+  index for other backends.
+ */
+struct Backend {
+	char const* name;
+	void (*init)(
+		packetHandleFn_t packetHandleFn, unsigned queue_length, unsigned mtu);
+	void (*useStats)(
+		struct nfqueueStats* stats, unsigned firstQueue, unsigned nQueues);
+	int (*run)(unsigned int queue); /* Normally will not return */
+};
+
+// Get a backend by name. die() if not found
+struct Backend const* backendGetOrDie(char const* name);
+
+// Add a backend, e.g. from a command. The backend must be static
+void addBackend(struct Backend const* backend);
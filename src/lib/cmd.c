@@ -8,10 +8,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <getopt.h>
 
+_Static_assert(MAX_OPTIONS < sizeof(uint64_t) * 8, "Option mask too small");
+_Static_assert(MAX_OPTIONS < '?', "Option index can be a getopt error");
+
 #ifndef MAX_COMMANDS
-#define MAX_COMMANDS 20
+#define MAX_COMMANDS 32
 #endif
 
 struct Cmd {
@@ -51,13 +55,14 @@ int handleCmd(int argc, char *argv[])
 }
 
 static int verifyRequiredOptions(
-	struct option const* long_options, unsigned required, unsigned got)
+	struct option const* long_options, uint64_t required, uint64_t got)
 {
 	got = got & required;
 	if (required == got) return 0;
-	unsigned i, m;
-	for (i = 0; i < 32; i++) {
-		m = (1 << i);
+	unsigned i;
+	uint64_t m;
+	for (i = 0; i < MAX_OPTIONS; i++) {
+		m = (1ull << i);
 		if ((required & m) != (got & m)) {
 			char const* opt = "(unknown)";
 			struct option const* o;
@@ -93,13 +98,13 @@ static void printUsage(struct Option const* options)
 
 int parseOptions(int argc, char* argv[], struct Option const* options)
 {
-	unsigned required = 0;
+	uint64_t required = 0;
 	int i, len = 0;
 	struct Option const* o;
 	for (o = options; o->name != NULL; o++)
 		len++;
-	if (len >= 32)
-		die("Too many options %d (max 31)\n", len);
+	if (len > MAX_OPTIONS)
+		die("Too many options %d (max %d)\n", len, MAX_OPTIONS);
 	struct option long_options[len+1];
 	memset(long_options, 0, sizeof(long_options));
 	for (i = 0; i < len; i++) {
@@ -112,16 +117,16 @@ int parseOptions(int argc, char* argv[], struct Option const* options)
 				lo->has_arg = required_argument;
 		lo->val = i;
 		if (o->flags & REQUIRED)
-			required |= (1 << i);
+			required |= (1ull << i);
 	}
 
 	int option_index = 0;
-	unsigned got = 0;
+	uint64_t got = 0;
 	i = getopt_long_only(argc, argv, "", long_options, &option_index);
 	while (i >= 0) {
-		if (i >= 32)
+		if (i >= len)
 			return -1;
-		got |= (1 << i);
+		got |= (1ull << i);
 		o = options + i;
 		if (strcmp(o->name, "help") == 0) {
 			printUsage(options);
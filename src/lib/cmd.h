@@ -26,6 +26,16 @@ int handleCmd(int argc, char *argv[]);
 	argv += nopt;
  */
 
+/*
+  Max options in an array (excluding the {0} terminator). The options
+  are tracked in a 64-bit mask, and getopt returns '?' (63) on error.
+  Callers with many options may check the size at compile time with
+  OPTIONS_CHECK(options).
+ */
+#define MAX_OPTIONS 62
+#define OPTIONS_CHECK(o) _Static_assert(								\
+		sizeof(o) / sizeof((o)[0]) <= MAX_OPTIONS + 1, "Too many options")
+
 struct Option {
 	char const* name;
 	char const** arg;
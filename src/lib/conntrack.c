@@ -4,31 +4,96 @@
 */
 
 #include "conntrack.h"
+#include "threadstats.h"
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+  Concurrency
+
+  Each hash bucket has a sequence counter (seqlock) which is also a
+  spinlock for writers; an odd value means that a writer holds the
+  bucket. ctLookup() reads the bucket and it's collision chain
+  without locking and re-reads if the sequence has changed. The
+  bucket is locked only when there are stale entries to GC.
 
+  A "lockDataFn" is called for a hit without locking. The data may
+  have been removed, freed and even re-used after it was read, so the
+  lockDataFn only takes a reference if the data is not being freed
+  (e.g. the reference counter is not 0). The sequence is then checked
+  again, and if it has changed the reference is released with
+  "freeDataFn" and the lookup is retried.
+
+  Removed collision buckets may still be read by a lookup in
+  progress. That is detected by the sequence but the memory must stay
+  readable, so "freeBucketFn" must not return it to the OS.
+
+  While resizing (see below) a key is in the old table until it's
+  bucket is migrated, and then in the new table. The old bucket is
+  flagged as migrated, and a lookup that finds a migrated bucket
+  looks in the new table. A lookup may still read the old table after
+  the resize is done, so tables are never freed (until ctDestroy) but
+  kept and re-used on resize to the same size. A generation counter,
+  incremented on resize, is checked to detect that a table has been
+  re-used during an operation.
+
+  With open addressing (see below) each group has a sequence counter
+  instead. Writers lock the "home" group of the key, which serializes
+  updates of the same key, and the group they modify if it's another.
+ */
 #ifdef SINGLE_THREAD
 #warning SINGLE_THREAD
-#define MUTEX(x)
-#define LOCK(x)
-#define UNLOCK(x)
-#define MUTEX_INIT(x)
-#define MUTEX_DESTROY(x)
+#define LOCK(b)
+#define UNLOCK(b)
+#define READ_BEGIN(b) 0
+#define READ_RETRY(b,s) 0
+#define LOAD(x) (x)
+#define STORE(x,v) (x) = (v)
 #define ATOMIC_INC(x) ++(x)
+#define ATOMIC_DEC(x) --(x)
+#define CNT_ADD(ct,x,v) (ct)->stats->x += (v)
 #else
-#include <pthread.h>
-#define MUTEX(x) pthread_mutex_t x
-#define LOCK(x) pthread_mutex_lock(x)
-#define UNLOCK(x) pthread_mutex_unlock(x)
-#define MUTEX_INIT(x) pthread_mutex_init(x,NULL)
-#define MUTEX_DESTROY(x) pthread_mutex_destroy(x)
+#define LOCK(b) seqLock(&(b)->seq)
+#define UNLOCK(b) __atomic_store_n(&(b)->seq, (b)->seq + 1, __ATOMIC_RELEASE)
+#define READ_BEGIN(b) readBegin(&(b)->seq)
+#define READ_RETRY(b,s) readRetry(&(b)->seq,s)
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x,v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
 #define ATOMIC_INC(x) __atomic_add_fetch(&(x),1,__ATOMIC_RELAXED)
+#define ATOMIC_DEC(x) __atomic_sub_fetch(&(x),1,__ATOMIC_RELAXED)
+// Update a counter in the stats block of the calling thread
+#define CNT_ADD(ct,x,v) do {											\
+		unsigned _i = threadStatsBlock((ct)->nStats);					\
+		STATS_ADD(_i, STATS_BLOCK(ct, _i)->x, v);						\
+	} while (0)
+#endif
+#define CNT_INC(ct,x) CNT_ADD(ct,x,1)
+#define CNT_DEC(ct,x) CNT_ADD(ct,x,-1)
+#define STATS_BLOCK(ct,i) \
+	((struct ctStats*)((char*)(ct)->stats + (i) * (ct)->statsStride))
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_PAUSE() __builtin_ia32_pause()
+#else
+#define CPU_PAUSE() __asm__ __volatile__("" ::: "memory")
 #endif
+// Yield if the writer seem to be preempted (more threads than CPUs)
+#define CPU_RELAX(spins) if (++(spins) % 256 == 0) sched_yield(); else CPU_PAUSE()
 #define CALLOC(n,s) calloc(n,s)
 #define FREE(m) free(m)
 
-extern uint32_t djb2_hash(uint8_t const* c, uint32_t len);
-#define HASH djb2_hash
+/*
+  The table is local, so the fast hash is always used. The seed is
+  per table and fixed in ctCreate(). It must not follow the
+  load-balancing hash (hashSetFunction()) which may be set after
+  entries are inserted.
+ */
+#define CT_SEED 0
+#define HASH(d,l) wy_hash(d, l, ct->seed)
+#include "hash.h"
 
 struct ctBucket {
 	struct ctBucket* next;
@@ -36,30 +101,118 @@ struct ctBucket {
 	struct ctKey key;
 	void* data;
 	uint64_t refered;			/* Last time refered in nanoS */
-	MUTEX(mutex);
+	uint32_t seq;				/* Odd - locked. Only used in the main bucket */
+	uint32_t chain;				/* Collision buckets. Only in the main bucket */
+};
+#define CHAIN_MIGRATED 0x80000000	/* Moved to a new table on resize */
+#define CT_MIGRATE 8				/* Buckets migrated per operation */
+
+/*
+  Resize
+
+  A new table is allocated when the load gets > 75% or an insert is
+  rejected (grow x2), or when the load gets < 12.5% (shrink /2). The
+  old buckets are migrated CT_MIGRATE at the time on inserts, removes
+  and ctExpire() while both tables are in use. If a collision bucket
+  can't be allocated the old bucket is left as is and migrated later.
+ */
+struct ctTable {
+	struct ctBucket* bucket;
+	ctCounter size;
+	struct ctTable* old;		/* Migrating from this table if != NULL */
+	unsigned migratePos;		/* Next bucket in "old" to migrate */
+	unsigned migrated;
+	struct ctTable* next;		/* In the spare list */
 };
 struct ct {
 	uint64_t ttl;
+	uint64_t seed;				/* For keyHash() */
 	ctFree freefn;
 	ctLock lockfn;
 	ctAllocBucket allocBucket;
 	ctFree freeBucket;
 	struct ctStats* stats;
 	struct ctStats _stats;
-	struct ctBucket* bucket;
+	unsigned nStats;			/* Per-thread stats blocks */
+	size_t statsStride;
+	struct ctStats sum;			/* Sum of the stats blocks */
+	struct ctTable* table;
 	void* user_ref;
+	struct ctGroup* group;		/* Open addressing if != NULL */
+	struct ctEntry* entry;
+	unsigned ngroups;
+	unsigned expirePos;
+	ctCounter minSize, maxSize;	/* maxSize=0 - no resize */
+	ctCounter rejectedSeen;
+	int resizeLock;
+	unsigned generation;		/* Incremented on resize */
+	struct ctTable* spare;		/* Old tables, may still be read by lookups */
 };
 
 size_t const sizeof_bucket = sizeof(struct ctBucket);
 
-static int keyEqual(struct ctKey const* key1, struct ctKey const* key2)
+#ifndef SINGLE_THREAD
+static inline void seqLock(uint32_t* s)
 {
-	return memcmp(key1, key2, sizeof(struct ctKey));
+	unsigned spins = 0;
+	for (;;) {
+		uint32_t seq = __atomic_load_n(s, __ATOMIC_RELAXED);
+		if ((seq & 1) == 0 && __atomic_compare_exchange_n(
+				s, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		CPU_RELAX(spins);
+	}
+	// The odd sequence must be seen before any update
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+static inline uint32_t readBegin(uint32_t const* s)
+{
+	uint32_t seq;
+	unsigned spins = 0;
+	while ((seq = __atomic_load_n(s, __ATOMIC_ACQUIRE)) & 1)
+		CPU_RELAX(spins);
+	return seq;
+}
+static inline int readRetry(uint32_t const* s, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(s, __ATOMIC_RELAXED) != seq;
+}
+#endif
+
+// Returns 0 if equal (as memcmp). Compares the key as 5 words
+_Static_assert(sizeof(struct ctKey) == 40, "keyEqual() assumes a 40 byte ctKey");
+static inline int keyEqual(struct ctKey const* key1, struct ctKey const* key2)
+{
+	uint64_t const* w1 = (uint64_t const*)key1;
+	uint64_t const* w2 = (uint64_t const*)key2;
+	return ((w1[0] ^ w2[0]) | (w1[1] ^ w2[1]) | (w1[2] ^ w2[2]) |
+			(w1[3] ^ w2[3]) | (w1[4] ^ w2[4])) != 0;
+}
+static inline uint32_t keyHash(struct ct const* ct, struct ctKey const* key)
+{
+	if (ctKeyIsIpv4(key)) {
+		struct ctKey4 key4;
+		ctKeyToIpv4(key, &key4);
+		return HASH((uint8_t const*)&key4, sizeof(key4));
+	}
+	return HASH((uint8_t const*)key, sizeof(*key));
 }
 static uint64_t toNanos(struct timespec* t)
 {
 	return t->tv_sec * 1000000000 + t->tv_nsec;
 }
+static inline unsigned histIndex(unsigned n)
+{
+	return n < CT_CHAIN_HIST ? n : CT_CHAIN_HIST - 1;
+}
+// Update the collision chain length of a (locked) main bucket
+static void chainAdd(struct ct* ct, struct ctBucket* b, int d)
+{
+	CNT_DEC(ct, chain[histIndex(b->chain)]);
+	b->chain += d;
+	CNT_INC(ct, chain[histIndex(b->chain)]);
+}
 
 // Remove stale entries. Returns number of active buckets
 // The bucket must be locked on call.
@@ -70,8 +223,9 @@ bucketGC(struct ct* ct, struct ctBucket* b, uint64_t nowNanos)
 	if (b->data != NULL && (nowNanos - b->refered) > b->ttl) {
 		if (ct->freefn != NULL)
 			ct->freefn(ct->user_ref, b->data);
-		b->data = NULL;
-		ATOMIC_INC(ct->stats->objGC);
+		STORE(b->data, NULL);
+		CNT_INC(ct, objGC);
+		CNT_DEC(ct, active);
 	}
 	if (b->data != NULL)
 		count++;
@@ -80,11 +234,14 @@ bucketGC(struct ct* ct, struct ctBucket* b, uint64_t nowNanos)
 	struct ctBucket* item = prev->next;
 	while (item != NULL) {
 		if ((nowNanos - item->refered) > item->ttl) {
-			prev->next = item->next;
+			STORE(prev->next, item->next);
 			if (item->data != NULL && ct->freefn != NULL)
 				ct->freefn(ct->user_ref, item->data);
 			ct->freeBucket(ct->user_ref, item);
-			ATOMIC_INC(ct->stats->objGC);
+			CNT_INC(ct, objGC);
+			CNT_DEC(ct, active);
+			CNT_DEC(ct, buckets);
+			chainAdd(ct, b, -1);
 		} else {
 			prev = item;
 			count++;
@@ -94,20 +251,46 @@ bucketGC(struct ct* ct, struct ctBucket* b, uint64_t nowNanos)
 	return count;
 }
 
-// The bucket is locked in the call.
-static struct ctBucket* ctLookupBucket(
-	struct ct* ct, uint64_t nowNanos, struct ctKey const* key)
+static inline struct ctTable* currentTable(struct ct* ct)
+{
+	return __atomic_load_n(&ct->table, __ATOMIC_ACQUIRE);
+}
+static inline struct ctTable* oldTable(struct ctTable* t)
+{
+	return __atomic_load_n(&t->old, __ATOMIC_ACQUIRE);
+}
+static inline unsigned generation(struct ct* ct)
+{
+	return __atomic_load_n(&ct->generation, __ATOMIC_ACQUIRE);
+}
+static inline int migrated(struct ctBucket const* b)
+{
+	return (LOAD(b->chain) & CHAIN_MIGRATED) != 0;
+}
+// The bucket in the old table, until it's migrated
+static inline struct ctBucket* homeBucket(struct ctTable* t, uint32_t hash)
+{
+	struct ctTable* o = oldTable(t);
+	if (o != NULL) {
+		struct ctBucket* b = o->bucket + hash % o->size;
+		if (!migrated(b))
+			return b;
+	}
+	return t->bucket + hash % t->size;
+}
+
+// Lock the bucket and GC stale entries
+static void lockBucketGC(struct ct* ct, struct ctBucket* b, uint64_t nowNanos)
 {
-	uint32_t hash = HASH((uint8_t const*)key, sizeof(*key));
-	struct ctBucket* b = ct->bucket + (hash % ct->stats->size);
-	LOCK(&b->mutex);
+	LOCK(b);
 
 	/* Is the main bucket stale? */
 	if (b->data != NULL && (nowNanos - b->refered) > b->ttl) {
 		if (ct->freefn != NULL)
 			ct->freefn(ct->user_ref, b->data);
-		b->data = NULL;
-		ATOMIC_INC(ct->stats->objGC);
+		STORE(b->data, NULL);
+		CNT_INC(ct, objGC);
+		CNT_DEC(ct, active);
 	}
 	if (b->next != NULL) {
 		/*
@@ -116,65 +299,799 @@ static struct ctBucket* ctLookupBucket(
 		 */
 		bucketGC(ct, b, nowNanos);
 	}
-	return b;
+}
+
+// The bucket is locked in the call.
+static struct ctBucket* ctLookupBucket(
+	struct ct* ct, uint64_t nowNanos, uint32_t hash)
+{
+	for (;;) {
+		unsigned gen = generation(ct);
+		struct ctBucket* b = homeBucket(currentTable(ct), hash);
+		lockBucketGC(ct, b, nowNanos);
+		if ((b->chain & CHAIN_MIGRATED) == 0 && generation(ct) == gen)
+			return b;
+		UNLOCK(b);				/* Migrated before we got the lock */
+	}
+}
+
+/*
+  Move an entry to a bucket in the new table. Returns -1 if a collision
+  bucket is needed for a main bucket entry but can't be allocated.
+  Nothing is changed then, and the entry stays in the old table.
+ */
+static int moveEntry(
+	struct ct* ct, struct ctTable* t, struct ctBucket* item, int isMain)
+{
+	struct ctBucket* nb = t->bucket + keyHash(ct, &item->key) % t->size;
+	int rc = 0;
+	LOCK(nb);
+	if (nb->data == NULL) {
+		nb->key = item->key;
+		STORE(nb->ttl, item->ttl);
+		STORE(nb->refered, item->refered);
+		STORE(nb->data, item->data);
+		if (!isMain) {
+			ct->freeBucket(ct->user_ref, item);
+			CNT_DEC(ct, buckets);
+		}
+	} else {
+		struct ctBucket* x = item;
+		if (isMain) {
+			x = ct->allocBucket(ct->user_ref);
+			if (x == NULL) {
+				rc = -1;
+				goto out;
+			}
+			x->key = item->key;
+			x->ttl = item->ttl;
+			x->refered = item->refered;
+			x->data = item->data;
+			CNT_INC(ct, buckets);
+		}
+		x->next = nb->next;
+		STORE(nb->next, x);
+		chainAdd(ct, nb, 1);
+	}
+out:
+	UNLOCK(nb);
+	return rc;
+}
+
+static void resizeDone(struct ct* ct, struct ctTable* t)
+{
+	unsigned spins = 0;
+	while (__atomic_exchange_n(&ct->resizeLock, 1, __ATOMIC_ACQUIRE) != 0)
+		CPU_RELAX(spins);
+	t->old->next = ct->spare;
+	ct->spare = t->old;
+	__atomic_store_n(&t->old, NULL, __ATOMIC_RELEASE);
+	CNT_INC(ct, resizes);
+	__atomic_store_n(&ct->resizeLock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+  Move all entries in a bucket in the old table to the new table.
+  The main entry is moved first since it may need a collision bucket.
+  Returns -1 if that fails, and the bucket is left un-migrated (the
+  chain items re-use their buckets and always succeed).
+ */
+static int migrateBucket(
+	struct ct* ct, struct ctTable* t, struct ctBucket* ob, uint64_t nowNanos)
+{
+	LOCK(ob);
+	if (ob->chain & CHAIN_MIGRATED) {
+		UNLOCK(ob);
+		return 0;
+	}
+	bucketGC(ct, ob, nowNanos);	/* Don't move stale entries */
+	if (ob->data != NULL) {
+		if (moveEntry(ct, t, ob, 1) != 0) {
+			UNLOCK(ob);
+			return -1;
+		}
+		STORE(ob->data, NULL);
+	}
+	struct ctBucket* item;
+	while ((item = ob->next) != NULL) {
+		STORE(ob->next, item->next);
+		chainAdd(ct, ob, -1);
+		moveEntry(ct, t, item, 0);
+	}
+	CNT_DEC(ct, chain[0]); /* The old bucket */
+	STORE(ob->chain, CHAIN_MIGRATED);
+	UNLOCK(ob);
+	if (__atomic_add_fetch(&t->migrated, 1, __ATOMIC_ACQ_REL) == t->old->size)
+		resizeDone(ct, t);
+	return 0;
+}
+
+// Migrate "n" buckets if a resize is in progress
+static void migrate(struct ct* ct, unsigned n, uint64_t nowNanos)
+{
+	struct ctTable* t = currentTable(ct);
+	struct ctTable* o = oldTable(t);
+	if (o == NULL)
+		return;
+	while (n-- > 0) {
+		unsigned i = __atomic_fetch_add(&t->migratePos, 1, __ATOMIC_RELAXED);
+		if (i >= o->size)
+			break;
+		if (migrateBucket(ct, t, o->bucket + i, nowNanos) != 0) {
+			// Retry from this bucket later. Migrated buckets are skipped
+			unsigned pos = __atomic_load_n(&t->migratePos, __ATOMIC_RELAXED);
+			while (pos > i && !__atomic_compare_exchange_n(
+					   &t->migratePos, &pos, i, 0,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+			break;
+		}
+	}
+}
+
+static void resizeStart(struct ct* ct, struct ctTable* t, ctCounter size)
+{
+	if (__atomic_exchange_n(&ct->resizeLock, 1, __ATOMIC_ACQUIRE) != 0)
+		return;					/* Someone else is resizing */
+	if (currentTable(ct) != t || t->old != NULL)
+		goto out;
+	__atomic_add_fetch(&ct->generation, 1, __ATOMIC_SEQ_CST);
+	struct ctTable* n;
+	struct ctTable** pp;
+	for (pp = &ct->spare; *pp != NULL; pp = &(*pp)->next) {
+		if ((*pp)->size == size)
+			break;
+	}
+	if (*pp != NULL) {
+		// All buckets in a spare table are migrated (empty)
+		n = *pp;
+		*pp = n->next;
+		for (unsigned i = 0; i < size; i++) {
+			struct ctBucket* b = n->bucket + i;
+			LOCK(b);
+			b->chain = 0;
+			UNLOCK(b);
+		}
+	} else {
+		n = CALLOC(1, sizeof(*n));
+		if (n == NULL)
+			goto out;
+		n->bucket = CALLOC(size, sizeof(struct ctBucket));
+		if (n->bucket == NULL) {
+			FREE(n);
+			goto out;
+		}
+		n->size = size;
+	}
+	n->migratePos = 0;
+	n->migrated = 0;
+	n->next = NULL;
+	n->old = t;
+	CNT_ADD(ct, chain[0], size);
+	STORE(ct->stats->size, size);
+	__atomic_store_n(&ct->table, n, __ATOMIC_RELEASE);
+out:
+	__atomic_store_n(&ct->resizeLock, 0, __ATOMIC_RELEASE);
+}
+
+static void sumStats(struct ct* ct, struct ctStats* sum)
+{
+	*sum = *ct->stats;
+	for (unsigned i = 1; i < ct->nStats; i++)
+		ctAddStats(sum, STATS_BLOCK(ct, i));
+}
+
+// Migrate, or start a resize if needed
+static void resizeCheck(struct ct* ct, uint64_t nowNanos)
+{
+	if (ct->maxSize == 0)
+		return;
+	struct ctTable* t = currentTable(ct);
+	if (oldTable(t) != NULL) {
+		migrate(ct, CT_MIGRATE, nowNanos);
+		return;
+	}
+	struct ctStats const* st = ct->stats;
+	struct ctStats sum;
+	if (ct->nStats > 1) {
+		// Summing the per-thread stats is not free. Check less often
+		static __thread unsigned tick;
+		if (++tick % 16 != 0)
+			return;
+		sumStats(ct, &sum);
+		st = &sum;
+	}
+	ctCounter active = LOAD(st->active);
+	ctCounter rejected = LOAD(st->rejectedInserts);
+	if (t->size < ct->maxSize &&
+		(active > t->size / 4 * 3 || rejected != LOAD(ct->rejectedSeen))) {
+		STORE(ct->rejectedSeen, rejected);
+		resizeStart(ct, t, t->size * 2 < ct->maxSize ? t->size * 2 : ct->maxSize);
+	} else if (t->size > ct->minSize && active < t->size / 8) {
+		resizeStart(ct, t, t->size / 2 > ct->minSize ? t->size / 2 : ct->minSize);
+	}
+}
+
+/*
+  Open addressing (Swiss table style)
+
+  Used if ctCreate() is called without bucket alloc/free functions.
+  Entries are stored in groups of GROUP_SIZE slots. A group has a tag
+  byte per slot, and a lookup compares the 16 tags with one SSE2
+  instruction. The key is only compared on a tag hit. An entry is a
+  cache line, so a lookup normally touches 2 cache lines; the group
+  and the entry. An insert prefers a slot given by the hash in the
+  home group, and a lookup prefetches that entry while the tags are
+  read, so a hit is usually not 2 serial cache misses.
+
+  Groups are probed linearly, but at most MAX_PROBE groups. An insert
+  fails (-1) if they are all full; the bounded probe replaces the
+  bucket allocation limit. There are MAX_PROBE-1 extra groups at the
+  end so the probe never wraps, and groups are always locked in
+  increasing order (no dead-locks). A probe stops at a group with an EMPTY
+  slot. A removed entry becomes DELETED if the group is full (a probe
+  may have passed it), else EMPTY. A group that has been full never
+  gets an EMPTY slot back that way, so the DELETED slots are reclaimed
+  by GC (oaReclaim) when no entry in a later group has probed past it.
+ */
+#define GROUP_SIZE 16
+#define MAX_PROBE 8
+#define TAG_EMPTY 0
+#define TAG_DELETED 1
+#define TAG_FULL 0x80			/* 0x80 | 7 hash bits */
+struct ctGroup {
+	uint8_t tag[GROUP_SIZE];
+	uint32_t seq;
+} __attribute__ ((aligned (32)));
+struct ctEntry {
+	struct ctKey key;
+	void* data;
+	uint64_t ttl;
+	uint64_t refered;
+} __attribute__ ((aligned (64)));
+
+// Returns a bit-mask with the slots that has the tag
+static inline unsigned groupMatch(struct ctGroup const* g, uint8_t tag)
+{
+#ifdef __SSE2__
+	__m128i t = _mm_load_si128((__m128i const*)g->tag);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_set1_epi8(tag)));
+#else
+	unsigned m = 0;
+	for (int i = 0; i < GROUP_SIZE; i++) {
+		if (LOAD(g->tag[i]) == tag)
+			m |= 1 << i;
+	}
+	return m;
+#endif
+}
+static inline unsigned groupFree(struct ctGroup const* g)
+{
+	return groupMatch(g, TAG_EMPTY) | groupMatch(g, TAG_DELETED);
+}
+static inline uint8_t hashTag(uint32_t hash)
+{
+	return TAG_FULL | (hash >> 25);
+}
+static inline unsigned hashSlot(uint32_t hash)
+{
+	return (hash >> 21) % GROUP_SIZE;
+}
+static inline int entryStale(struct ctEntry const* e, uint64_t nowNanos)
+{
+	return nowNanos - LOAD(e->refered) > LOAD(e->ttl);
+}
+
+// Free the entry. The group must be locked
+static void oaDelete(struct ct* ct, struct ctGroup* g, unsigned si)
+{
+	unsigned gi = g - ct->group;
+	struct ctEntry* e = ct->entry + gi * GROUP_SIZE + si;
+	if (e->data != NULL && ct->freefn != NULL)
+		ct->freefn(ct->user_ref, e->data);
+	STORE(e->data, NULL);
+	CNT_DEC(ct, active);
+	CNT_DEC(ct, chain[histIndex(gi - keyHash(ct, &e->key) % ct->ngroups)]);
+	STORE(g->tag[si], groupMatch(g, TAG_EMPTY) ? TAG_EMPTY : TAG_DELETED);
+}
+
+// GC stale entries in a group. Returns the number of active entries.
+// The group must be locked
+static ctCounter oaGroupGC(struct ct* ct, struct ctGroup* g, uint64_t nowNanos)
+{
+	ctCounter count = 0;
+	struct ctEntry* e = ct->entry + (g - ct->group) * GROUP_SIZE;
+	for (unsigned si = 0; si < GROUP_SIZE; si++) {
+		if (g->tag[si] < TAG_FULL)
+			continue;
+		if (entryStale(e + si, nowNanos)) {
+			oaDelete(ct, g, si);
+			CNT_INC(ct, objGC);
+		} else {
+			count++;
+		}
+	}
+	return count;
+}
+
+/*
+  Turn the DELETED slots in a group without EMPTY slots back into
+  EMPTY, unless an entry in a later group has a home group at or
+  before it (the probe for that entry must pass). The possible home
+  groups are locked so no such entry can be inserted meanwhile. Locks
+  are taken in increasing order as in oaInsert(). The group must NOT
+  be locked.
+ */
+static void oaReclaim(struct ct* ct, unsigned gi)
+{
+	struct ctGroup* G = ct->group + gi;
+	if (groupMatch(G, TAG_DELETED) == 0 || groupMatch(G, TAG_EMPTY) != 0)
+		return;
+	unsigned first = gi < MAX_PROBE ? 0 : gi - MAX_PROBE + 1;
+	unsigned last = ct->ngroups + MAX_PROBE - 1;
+	if (last > gi + MAX_PROBE)
+		last = gi + MAX_PROBE;
+	unsigned g, m;
+	for (g = first; g <= gi; g++)
+		LOCK(ct->group + g);
+	if (groupMatch(G, TAG_EMPTY) != 0)
+		goto out;
+	for (g = gi + 1; g < last; g++) {
+		struct ctEntry* E = ct->entry + g * GROUP_SIZE;
+		m = ~groupFree(ct->group + g) & ((1 << GROUP_SIZE) - 1);
+		while (m != 0) {
+			unsigned i = __builtin_ctz(m);
+			m &= m - 1;
+			if (keyHash(ct, &E[i].key) % ct->ngroups <= gi)
+				goto out;
+		}
+	}
+	m = groupMatch(G, TAG_DELETED);
+	while (m != 0) {
+		unsigned i = __builtin_ctz(m);
+		m &= m - 1;
+		STORE(G->tag[i], TAG_EMPTY);
+	}
+out:
+	for (g = first; g <= gi; g++)
+		UNLOCK(ct->group + g);
+}
+
+/*
+  Lookup without locking. Returns the data (or NULL) and the position
+  in "gi" and "si", and the sequence of the group in "seqp". "stale"
+  is set if the key is found but has timed out (the position is set
+  but NULL is returned).
+ */
+static void* oaFind(
+	struct ct* ct, uint64_t nowNanos, struct ctKey const* key, uint32_t hash,
+	unsigned* gi, unsigned* si, uint32_t* seqp, int* stale)
+{
+	uint8_t tag = hashTag(hash);
+	unsigned home = hash % ct->ngroups;
+	__builtin_prefetch(ct->entry + home * GROUP_SIZE + hashSlot(hash));
+	*stale = 0;
+	for (unsigned g = home; g < home + MAX_PROBE; g++) {
+		struct ctGroup* G = ct->group + g;
+		struct ctEntry* E = ct->entry + g * GROUP_SIZE;
+		uint32_t seq;
+		unsigned m, empty;
+		void* data;
+	retry:
+		seq = READ_BEGIN(G);
+		data = NULL;
+		m = groupMatch(G, tag);
+		while (m != 0) {
+			unsigned i = __builtin_ctz(m);
+			m &= m - 1;
+			void* d = LOAD(E[i].data);
+			if (d == NULL || keyEqual(key, &E[i].key) != 0)
+				continue;
+			*gi = g;
+			*si = i;
+			if (entryStale(E + i, nowNanos))
+				*stale = 1;
+			else
+				data = d;
+			break;
+		}
+		empty = groupMatch(G, TAG_EMPTY);
+		if (READ_RETRY(G, seq))
+			goto retry;
+		*seqp = seq;
+		if (data != NULL || *stale)
+			return data;
+		if (empty != 0)
+			break;
+	}
+	return NULL;
+}
+
+static void* oaLookup(struct ct* ct, uint64_t nowNanos, struct ctKey const* key)
+{
+	uint32_t hash = keyHash(ct, key);
+	unsigned gi, si;
+	uint32_t seq;
+	int stale;
+	void* data;
+retry:
+	data = oaFind(ct, nowNanos, key, hash, &gi, &si, &seq, &stale);
+	if (stale) {
+		struct ctGroup* g = ct->group + gi;
+		LOCK(g);
+		oaGroupGC(ct, g, nowNanos);
+		UNLOCK(g);
+		goto retry;
+	}
+	if (data == NULL)
+		return NULL;
+	struct ctGroup* g = ct->group + gi;
+	struct ctEntry* e = ct->entry + gi * GROUP_SIZE + si;
+	if (ct->lockfn != NULL) {
+		if (ct->lockfn(ct->user_ref, data) != 0)
+			goto retry;			/* Freed after oaFind */
+		if (READ_RETRY(g, seq)) {
+			ct->freefn(ct->user_ref, data);
+			goto retry;			/* Removed after oaFind */
+		}
+	}
+	STORE(e->refered, nowNanos);
+	return data;
+}
+
+static int oaInsert(
+	struct ct* ct, uint64_t nowNanos, struct ctKey const* key,
+	uint64_t ttl, void* data)
+{
+	uint32_t hash = keyHash(ct, key);
+	uint8_t tag = hashTag(hash);
+	unsigned home = hash % ct->ngroups;
+	struct ctGroup* H = ct->group + home;
+	LOCK(H);
+
+	// Check if the entry already exists and GC the probed groups
+	unsigned g, first = home + MAX_PROBE;
+	for (g = home; g < home + MAX_PROBE; g++) {
+		struct ctGroup* G = ct->group + g;
+		struct ctEntry* E = ct->entry + g * GROUP_SIZE;
+		if (G != H)
+			LOCK(G);
+		oaGroupGC(ct, G, nowNanos);
+		unsigned m = groupMatch(G, tag);
+		while (m != 0) {
+			unsigned i = __builtin_ctz(m);
+			m &= m - 1;
+			if (keyEqual(key, &E[i].key) == 0) {
+				STORE(E[i].refered, nowNanos);
+				if (G != H)
+					UNLOCK(G);
+				UNLOCK(H);
+				return 1;		/* item exists already */
+			}
+		}
+		if (first == home + MAX_PROBE && groupFree(G) != 0)
+			first = g;
+		unsigned empty = groupMatch(G, TAG_EMPTY);
+		if (G != H)
+			UNLOCK(G);
+		if (empty != 0)
+			break;
+	}
+
+	/*
+	  Insert in the first group with a free slot. Other keys may take
+	  free slots in other groups than "home" while we don't hold the
+	  lock, so re-check.
+	 */
+	for (g = first; g < home + MAX_PROBE; g++) {
+		struct ctGroup* G = ct->group + g;
+		if (G != H)
+			LOCK(G);
+		unsigned m = groupFree(G);
+		if (m != 0) {
+			unsigned i = __builtin_ctz(m);
+			if (G == H && (m & (1 << hashSlot(hash))) != 0)
+				i = hashSlot(hash);
+			struct ctEntry* e = ct->entry + g * GROUP_SIZE + i;
+			e->key = *key;
+			STORE(e->ttl, ttl);
+			STORE(e->refered, nowNanos);
+			STORE(e->data, data);
+			STORE(G->tag[i], tag);
+			CNT_INC(ct, active);
+			CNT_INC(ct, chain[histIndex(g - home)]);
+			if (G != H) {
+				CNT_INC(ct, collisions);
+				UNLOCK(G);
+			}
+			UNLOCK(H);
+			return 0;
+		}
+		if (G != H)
+			UNLOCK(G);
+	}
+	CNT_INC(ct, rejectedInserts);
+	UNLOCK(H);
+	return -1;
+}
+
+static void oaRemove(struct ct* ct, struct ctKey const* key)
+{
+	uint32_t hash = keyHash(ct, key);
+	uint8_t tag = hashTag(hash);
+	unsigned home = hash % ct->ngroups;
+	struct ctGroup* H = ct->group + home;
+	LOCK(H);
+	for (unsigned g = home; g < home + MAX_PROBE; g++) {
+		struct ctGroup* G = ct->group + g;
+		struct ctEntry* E = ct->entry + g * GROUP_SIZE;
+		if (G != H)
+			LOCK(G);
+		int found = 0;
+		unsigned m = groupMatch(G, tag);
+		while (m != 0) {
+			unsigned i = __builtin_ctz(m);
+			m &= m - 1;
+			if (keyEqual(key, &E[i].key) == 0) {
+				oaDelete(ct, G, i);
+				found = 1;
+				break;
+			}
+		}
+		unsigned empty = groupMatch(G, TAG_EMPTY);
+		if (G != H)
+			UNLOCK(G);
+		if (found || empty != 0)
+			break;
+	}
+	UNLOCK(H);
+}
+
+static void oaGC(struct ct* ct, uint64_t nowNanos)
+{
+	for (unsigned i = 0; i < ct->ngroups + MAX_PROBE - 1; i++) {
+		struct ctGroup* g = ct->group + i;
+		LOCK(g);
+		oaGroupGC(ct, g, nowNanos);
+		UNLOCK(g);
+		oaReclaim(ct, i);
+	}
+}
+
+static struct ct* oaCreate(struct ct* ct, ctCounter hsize)
+{
+	ct->ngroups = (hsize + GROUP_SIZE - 1) / GROUP_SIZE;
+	if (ct->ngroups == 0)
+		ct->ngroups = 1;
+	unsigned n = ct->ngroups + MAX_PROBE - 1;
+	ct->stats->size = n * GROUP_SIZE;
+	ct->group = aligned_alloc(
+		sizeof(struct ctGroup), n * sizeof(struct ctGroup));
+	ct->entry = aligned_alloc(
+		sizeof(struct ctEntry), ct->stats->size * sizeof(struct ctEntry));
+	if (ct->group == NULL || ct->entry == NULL) {
+		FREE(ct->group);
+		FREE(ct->entry);
+		FREE(ct);
+		return NULL;
+	}
+	memset(ct->group, 0, n * sizeof(struct ctGroup));
+	memset(ct->entry, 0, ct->stats->size * sizeof(struct ctEntry));
+	return ct;
 }
 
 struct ct* ctCreate(
 	ctCounter hsize, uint64_t ttlNanos, ctFree freefn, ctLock lockfn,
 	ctAllocBucket allocBucketFn, ctFree freeBucketFn, void* user_ref)
 {
-	if (allocBucketFn == NULL || freeBucketFn == NULL)
+	if ((allocBucketFn == NULL) != (freeBucketFn == NULL))
+		return NULL;
+	if (lockfn != NULL && freefn == NULL)
 		return NULL;
 	struct ct* ct = CALLOC(1, sizeof(*ct));
 	if (ct == NULL)
 		return NULL;
 	ct->stats = &ct->_stats;
+	ct->nStats = 1;
+	ct->statsStride = sizeof(struct ctStats);
 	ct->stats->size = hsize;
 	ct->stats->ttlNanos = ttlNanos;
 	ct->ttl = ttlNanos;
+	ct->seed = CT_SEED;
 	ct->freefn = freefn;
 	ct->lockfn = lockfn;
 	ct->allocBucket = allocBucketFn;
 	ct->freeBucket = freeBucketFn;
 	ct->user_ref = user_ref;
-	ct->bucket = CALLOC(hsize, sizeof(struct ctBucket));
-	if (ct->bucket == NULL) {
+	if (allocBucketFn == NULL)
+		return oaCreate(ct, hsize);
+	ct->table = CALLOC(1, sizeof(struct ctTable));
+	if (ct->table != NULL)
+		ct->table->bucket = CALLOC(hsize, sizeof(struct ctBucket));
+	if (ct->table == NULL || ct->table->bucket == NULL) {
+		FREE(ct->table);
 		FREE(ct);
 		return NULL;
 	}
+	ct->table->size = hsize;
+	ct->minSize = hsize;
+	ct->stats->chain[0] = hsize;
+	return ct;
+}
 
-	for (ctCounter i = 0; i < hsize; i++) {
-		MUTEX_INIT(&ct->bucket[i].mutex);
-	}
+int ctSetMaxSize(struct ct* ct, ctCounter maxSize)
+{
+	if (ct->group != NULL || maxSize < ct->table->size)
+		return -1;
+	ct->maxSize = maxSize;
+	return 0;
+}
 
-	return ct;
+ctCounter ctExpire(struct ct* ct, struct timespec* now, unsigned n)
+{
+	uint64_t nowNanos = toNanos(now);
+	struct ctStats sum;
+	sumStats(ct, &sum);
+	ctCounter objGC = sum.objGC;
+	// Groups or buckets
+	struct ctTable* t = NULL;
+	unsigned size;
+	if (ct->group != NULL) {
+		size = ct->ngroups + MAX_PROBE - 1;
+		n = n / GROUP_SIZE + (n % GROUP_SIZE != 0);
+	} else {
+		resizeCheck(ct, nowNanos);
+		migrate(ct, n, nowNanos);
+		t = currentTable(ct);
+		size = t->size;
+	}
+	if (n > size)
+		n = size;
+	if (ct->expirePos >= size)
+		ct->expirePos = 0;		/* Resized */
+	while (n-- > 0) {
+		if (ct->group != NULL) {
+			struct ctGroup* g = ct->group + ct->expirePos;
+			LOCK(g);
+			oaGroupGC(ct, g, nowNanos);
+			UNLOCK(g);
+			oaReclaim(ct, ct->expirePos);
+		} else {
+			struct ctBucket* b = t->bucket + ct->expirePos;
+			LOCK(b);
+			bucketGC(ct, b, nowNanos);
+			UNLOCK(b);
+		}
+		if (++ct->expirePos == size)
+			ct->expirePos = 0;
+	}
+	sumStats(ct, &sum);
+	return sum.objGC - objGC;
 }
 
 void ctUseStats(struct ct* ct, struct ctStats* stats)
 {
+	ctUseThreadStats(ct, stats, 1, sizeof(struct ctStats));
+}
+void ctUseThreadStats(
+	struct ct* ct, struct ctStats* stats, unsigned nBlocks, size_t stride)
+{
+	struct ctStats* s = stats;
 	memcpy(stats, ct->stats, sizeof(struct ctStats));
 	ct->stats = stats;
+	ct->nStats = nBlocks;
+	ct->statsStride = stride;
+	for (unsigned i = 1; i < nBlocks; i++) {
+		s = STATS_BLOCK(ct, i);
+		memset(s, 0, sizeof(*s));
+	}
+}
+
+void ctAddStats(struct ctStats* sum, struct ctStats const* stats)
+{
+	sum->size += LOAD(stats->size);
+	sum->active += LOAD(stats->active);
+	sum->collisions += LOAD(stats->collisions);
+	sum->inserts += LOAD(stats->inserts);
+	sum->rejectedInserts += LOAD(stats->rejectedInserts);
+	sum->lookups += LOAD(stats->lookups);
+	sum->objGC += LOAD(stats->objGC);
+	sum->buckets += LOAD(stats->buckets);
+	sum->resizes += LOAD(stats->resizes);
+	for (int i = 0; i < CT_CHAIN_HIST; i++)
+		sum->chain[i] += LOAD(stats->chain[i]);
+}
+
+/*
+  Lookup without locking. Returns the data (or NULL) and the sequence
+  of the bucket in "seqp", and sets "stale" if there are timed out
+  entries in the bucket.
+ */
+static void* lookupNoLock(
+	struct ctBucket* B, uint64_t nowNanos, struct ctKey const* key,
+	struct ctBucket** found, uint32_t* seqp, int* stale)
+{
+	uint32_t seq;
+	void* data;
+retry:
+	seq = READ_BEGIN(B);
+	data = NULL;
+	*stale = 0;
+	struct ctBucket* b = B;
+	while (b != NULL) {
+		void* d = LOAD(b->data);
+		if (nowNanos - LOAD(b->refered) > LOAD(b->ttl)) {
+			if (d != NULL || b != B)
+				*stale = 1;
+		} else if (d != NULL && keyEqual(key, &b->key) == 0) {
+			data = d;
+			*found = b;
+			break;
+		}
+		struct ctBucket* next = LOAD(b->next);
+		if (READ_RETRY(B, seq))
+			goto retry;			/* "next" may be removed */
+		b = next;
+	}
+	if (READ_RETRY(B, seq))
+		goto retry;
+	*seqp = seq;
+	return data;
 }
 
 void* ctLookup(
 	struct ct* ct, struct timespec* now, struct ctKey const* key)
 {
 	uint64_t nowNanos = toNanos(now);
-	struct ctBucket* B = ctLookupBucket(ct, nowNanos, key);
-	ATOMIC_INC(ct->stats->lookups);
-	struct ctBucket* b;
+	CNT_INC(ct, lookups);
+	if (ct->group != NULL)
+		return oaLookup(ct, nowNanos, key);
+	uint32_t hash = keyHash(ct, key);
+	struct ctBucket* B;
+	struct ctBucket* b = NULL;
+	uint32_t seq;
+	int stale;
+	void* data;
+	unsigned gen;
+retry:
+	do {
+		gen = generation(ct);
+		B = homeBucket(currentTable(ct), hash);
+		data = lookupNoLock(B, nowNanos, key, &b, &seq, &stale);
+	} while (data == NULL && (migrated(B) || generation(ct) != gen));
+	if (!stale) {
+		if (data == NULL)
+			return NULL;
+		if (ct->lockfn != NULL) {
+			if (ct->lockfn(ct->user_ref, data) != 0)
+				goto retry;		/* Freed after lookupNoLock */
+			if (READ_RETRY(B, seq)) {
+				ct->freefn(ct->user_ref, data);
+				goto retry;		/* Removed after lookupNoLock */
+			}
+		}
+		STORE(b->refered, nowNanos);
+		return data;
+	}
+
+	// GC is needed. Lock and lookup again
+	B = ctLookupBucket(ct, nowNanos, hash);
 	for (b = B; b != NULL; b = b->next) {
 		if (b->data != NULL && keyEqual(key, &b->key) == 0) {
-			b->refered = nowNanos;
+			STORE(b->refered, nowNanos);
+			data = b->data;
 			if (ct->lockfn != NULL)
-				ct->lockfn(ct->user_ref, b->data);
-			UNLOCK(&B->mutex);
-			return b->data;		/* Found! */
+				ct->lockfn(ct->user_ref, data); /* Can't fail, the ct refers it */
+			UNLOCK(B);
+			return data;		/* Found! */
 		}
 	}
-	UNLOCK(&B->mutex);
+	UNLOCK(B);
 	return NULL;				/* Not found */
 }
+static int chainInsert(
+	struct ct* ct, uint64_t nowNanos, struct ctKey const* key,
+	uint64_t ttl, void* data);
 int ctInsertWithTTL(
 	struct ct* ct, struct timespec* now, struct ctKey const* key,
 	uint64_t ttl, void* data)
@@ -182,8 +1099,18 @@ int ctInsertWithTTL(
 	if (data == NULL)
 		return -1;				/* NULL indicates no-data */
 	uint64_t nowNanos = toNanos(now);
-	struct ctBucket* b = ctLookupBucket(ct, nowNanos, key);
-	ATOMIC_INC(ct->stats->inserts);
+	CNT_INC(ct, inserts);
+	if (ct->group != NULL)
+		return oaInsert(ct, nowNanos, key, ttl, data);
+	int rc = chainInsert(ct, nowNanos, key, ttl, data);
+	resizeCheck(ct, nowNanos);
+	return rc;
+}
+static int chainInsert(
+	struct ct* ct, uint64_t nowNanos, struct ctKey const* key,
+	uint64_t ttl, void* data)
+{
+	struct ctBucket* b = ctLookupBucket(ct, nowNanos, keyHash(ct, key));
 
 	// Check if the entry already exists
 	struct ctBucket* item;
@@ -191,39 +1118,43 @@ int ctInsertWithTTL(
 		if (item->data == NULL)
 			continue;
 		if (keyEqual(key, &item->key) == 0) {
-			item->refered = nowNanos;
-			UNLOCK(&b->mutex);
+			STORE(item->refered, nowNanos);
+			UNLOCK(b);
 			return 1;				/* item exists already */
 		}
 	}
 
 	if (b->data == NULL) {
 		// The main bucket is free
-		b->data = data;
+		STORE(b->data, data);
 		b->key = *key;
-		b->ttl = ttl;
-		b->refered = toNanos(now);
+		STORE(b->ttl, ttl);
+		STORE(b->refered, nowNanos);
 		if (b->next != NULL)
-			ATOMIC_INC(ct->stats->collisions);
-		UNLOCK(&b->mutex);
+			CNT_INC(ct, collisions);
+		CNT_INC(ct, active);
+		UNLOCK(b);
 		return 0;
 	}
 
 	// We must allocate a new bucket
-	ATOMIC_INC(ct->stats->collisions);
+	CNT_INC(ct, collisions);
 	struct ctBucket* x = ct->allocBucket(ct->user_ref);
 	if (x == NULL) {
-		ATOMIC_INC(ct->stats->rejectedInserts);
-		UNLOCK(&b->mutex);
+		CNT_INC(ct, rejectedInserts);
+		UNLOCK(b);
 		return -1;
 	}
 	x->data = data;
 	x->key = *key;
 	x->ttl = ttl;
-	x->refered = toNanos(now);
+	x->refered = nowNanos;
 	x->next = b->next;
-	b->next = x;
-	UNLOCK(&b->mutex);
+	STORE(b->next, x);
+	CNT_INC(ct, active);
+	CNT_INC(ct, buckets);
+	chainAdd(ct, b, 1);
+	UNLOCK(b);
 	return 0;
 }
 int ctInsert(
@@ -236,59 +1167,95 @@ void ctRemove(
 	struct ct* ct, struct timespec* now, struct ctKey const* key)
 {
 	uint64_t nowNanos = toNanos(now);
-	struct ctBucket* b = ctLookupBucket(ct, nowNanos, key);
+	if (ct->group != NULL) {
+		oaRemove(ct, key);
+		return;
+	}
+	struct ctBucket* b = ctLookupBucket(ct, nowNanos, keyHash(ct, key));
 	if (keyEqual(key, &b->key) == 0) {
-		if (b->data != NULL && ct->freefn != NULL)
-			ct->freefn(ct->user_ref, b->data);
-		b->data = NULL;
-		UNLOCK(&b->mutex);
+		if (b->data != NULL) {
+			if (ct->freefn != NULL)
+				ct->freefn(ct->user_ref, b->data);
+			CNT_DEC(ct, active);
+		}
+		STORE(b->data, NULL);
+		UNLOCK(b);
+		resizeCheck(ct, nowNanos);
 		return;
 	}
 	struct ctBucket* prev = b;
 	struct ctBucket* item = prev->next;
 	while (item != NULL) {
 		if (keyEqual(key, &item->key) == 0) {
-			prev->next = item->next;
+			STORE(prev->next, item->next);
 			if (item->data != NULL && ct->freefn != NULL)
 				ct->freefn(ct->user_ref, item->data);
 			ct->freeBucket(ct->user_ref, item);
+			CNT_DEC(ct, active);
+			CNT_DEC(ct, buckets);
+			chainAdd(ct, b, -1);
 			break;
 		} else {
 			prev = item;
 		}
 		item = prev->next;
 	}
-	UNLOCK(&b->mutex);
+	UNLOCK(b);
+	resizeCheck(ct, nowNanos);
 }
 
+struct ctStats const* ctStats(struct ct* ct, struct timespec* now)
+{
+	if (ct->nStats == 1)
+		return ct->stats;
+	sumStats(ct, &ct->sum);
+	return &ct->sum;
+}
 // This function will scan the entire hash table. It will trig a full
 // GC. Use it with caution!
-struct ctStats const* ctStats(struct ct* ct, struct timespec* now)
+struct ctStats const* ctStatsDeep(struct ct* ct, struct timespec* now)
 {
-	ctCounter active = 0;
-	uint64_t nowNanos = toNanos(now);
-	unsigned i;
-	struct ctBucket* b = ct->bucket;
-	for (i = 0; i < ct->stats->size; i++, b++) {
-		LOCK(&b->mutex);
-		active += bucketGC(ct, b, nowNanos);
-		UNLOCK(&b->mutex);
-	}
-	ct->stats->active = active;
-	return ct->stats;
+	ctExpire(ct, now, UINT32_MAX);
+	return ctStats(ct, now);
 }
 void ctDestroy(struct ct* ct)
 {
 	unsigned i;
 	if (ct == NULL)
 		return;
-	struct ctBucket* b = ct->bucket;
-	for (i = 0; i < ct->stats->size; i++, b++) {
-		LOCK(&b->mutex);
+	if (ct->group != NULL) {
+		oaGC(ct, UINT64_MAX);
+		FREE(ct->group);
+		FREE(ct->entry);
+		FREE(ct);
+		return;
+	}
+	migrate(ct, UINT32_MAX, UINT64_MAX);
+	struct ctTable* t = ct->table;
+	struct ctBucket* b = t->bucket;
+	for (i = 0; i < t->size; i++, b++) {
+		LOCK(b);
 		bucketGC(ct, b, UINT64_MAX); /* now=UINT64_MAX ensures all-timeout*/
-		UNLOCK(&b->mutex);
-		MUTEX_DESTROY(&b->mutex);
+		UNLOCK(b);
+	}
+	while (ct->spare != NULL) {
+		struct ctTable* n = ct->spare->next;
+		FREE(ct->spare->bucket);
+		FREE(ct->spare);
+		ct->spare = n;
 	}
-	FREE(ct->bucket);
+	FREE(t->bucket);
+	FREE(t);
 	FREE(ct);
 }
+
+// White-box testing
+#ifdef UNIT_TEST
+unsigned ctTombstones(struct ct* ct)
+{
+	unsigned count = 0;
+	for (unsigned i = 0; i < ct->ngroups + MAX_PROBE - 1; i++)
+		count += __builtin_popcount(groupMatch(ct->group + i, TAG_DELETED));
+	return count;
+}
+#endif
@@ -19,6 +19,21 @@
   only a limited ammount of buckets should be allowed (i.e do not
   simply use "malloc(sizeof_bucket)").
 
+  Lookups are lock-free and may read a bucket, or update it's
+  time-stamp, after it has been passed to "freeBucketFn". The memory
+  must remain readable and only be used for buckets, e.g. use a pool
+  of buckets.
+
+  Open addressing
+
+  If both "allocBucketFn" and "freeBucketFn" are NULL an open
+  addressing table is used instead (Swiss table style). Entries are
+  stored in groups of 16 with a tag byte per entry that is probed
+  with SIMD, and a lookup normally touches 2 cache lines. No buckets
+  are allocated. "ctInsert" fails if there is no free slot within a
+  bounded probe, so "hsize" should be ~1.5 times the max number of
+  connections. The size is rounded up to groups.
+
   User data handling
 
   When a bucket has timed out or when "ctRemove" is called the
@@ -27,13 +42,22 @@
   once for each user data.
 
   A Garbage Collection procedure is used. User-data for timed out
-  buckets is not freed until the bucket is re-used or when "ctStats"
-  is called, which trigs a full GC.
+  buckets is not freed until the bucket is re-used or when
+  "ctStatsDeep" is called, which trigs a full GC. Alternatively
+  "ctExpire" can be called periodically to free timed out entries in
+  bounded slices.
 
   A "lockDataFn" may be specified and will be called on a "ctLookup"
-  while the bucket is locked. This can be used for exclusive use when
-  multiple threads may call "ctLookup" or "ctRemove". Reference
-  counters may be used.
+  hit. This can be used for exclusive use when multiple threads may
+  call "ctLookup" or "ctRemove". Reference counters may be used. The
+  "lockDataFn" is called without locking, so the data may already
+  have been passed to "freeDataFn" by another thread. It must then
+  return non-zero and not touch the data, e.g. increment the
+  reference counter only if it's not 0. The memory must stay readable
+  (use a pool), and if the data has been re-used the reference is
+  released with "freeDataFn" when the lookup detects the change. A
+  "freeDataFn" is required with a "lockDataFn". A "ctLookup" does not
+  lock the bucket unless there are stale entries to GC.
  */
 
 
@@ -57,10 +81,37 @@ struct ctKey {
 	};
 };
 
+/*
+  IPv4 keys have a compact 16 byte form. It is used internally for
+  hashing and compare. Results (e.g. fwmarks) are the same as for
+  the ::ffff:a.b.c.d form.
+ */
+struct ctKey4 {
+	uint32_t src;
+	uint32_t dst;
+	uint64_t id;
+};
+static inline int ctAddrIsIpv4(struct in6_addr const* a)
+{
+	return (a->s6_addr32[0] | a->s6_addr32[1]) == 0 &&
+		a->s6_addr32[2] == htonl(0xffff);
+}
+static inline int ctKeyIsIpv4(struct ctKey const* key)
+{
+	return ctAddrIsIpv4(&key->src) && ctAddrIsIpv4(&key->dst);
+}
+static inline void ctKeyToIpv4(struct ctKey const* key, struct ctKey4* key4)
+{
+	key4->src = key->src.s6_addr32[3];
+	key4->dst = key->dst.s6_addr32[3];
+	key4->id = key->id;
+}
+
 // Stats
 typedef uint32_t ctCounter;
+#define CT_CHAIN_HIST 4
 struct ctStats {
-	uint64_t ttlNanos;
+	uint64_t ttlNanos;			/* (not summed) */
 	ctCounter size;				/* Size of the hash table */
 	ctCounter active;			/* Connections currently in use */
 	ctCounter collisions;		/* Bucket collisions counter */
@@ -68,11 +119,18 @@ struct ctStats {
 	ctCounter rejectedInserts;	/* Rejected insert counter */
 	ctCounter lookups;			/* Lookup counter */
 	ctCounter objGC;			/* Objects GC'ed (not ctRemove'ed) */
-};
+	ctCounter buckets;			/* Allocated collision buckets */
+	ctCounter resizes;			/* Completed resizes */
+	/*
+	  Hash buckets by number of collision buckets 0,1,2,3+. With open
+	  addressing; entries by probe distance in groups 0,1,2,3+.
+	 */
+	ctCounter chain[CT_CHAIN_HIST];
+} __attribute__((aligned(64)));	/* A cache line (STATS_ALIGN) */
 
 
 typedef void (*ctFree)(void* user_ref, void* data);
-typedef void (*ctLock)(void* user_ref, void* data);
+typedef int (*ctLock)(void* user_ref, void* data); /* 0 - Locked */
 typedef void* (*ctAllocBucket)(void* user_ref); /* Return "sizeof_bucket" bytes or NULL */
 extern size_t const sizeof_bucket;
 
@@ -81,8 +139,11 @@ struct ct* ctCreate(
 	uint64_t ttlNanos,
 	/*
 	  The "freeDataFn" or "lockDataFn" functions MUST NOT block or
-	  call other conntrack functions! The bucket is locked during the
-	  call an to do so may cause starvation or a dead-lock.
+	  call other conntrack functions! "freeDataFn" is called with the
+	  bucket locked on GC and remove, and to do so may cause starvation
+	  or a dead-lock. It's also called without locking to release a
+	  reference taken by "lockDataFn". "lockDataFn" is always called
+	  without locking, and the data may already be freed (see above).
 	*/
 	ctFree freeDataFn,
 	ctLock lockDataFn,
@@ -94,6 +155,17 @@ struct ct* ctCreate(
 	 */
 	void* user_ref);
 
+/*
+  Allow the table to grow online up to "maxSize" buckets. The table
+  grows (x2) when the load gets > 75% or an insert is rejected, and
+  shrinks (/2) when the load gets < 12.5%, but never below the size
+  given in ctCreate(). Entries are migrated a few buckets at the time
+  on ctInsert, ctRemove and ctExpire. Must be called right after
+  ctCreate(). Not supported with open addressing.
+  Returns 0 on success.
+*/
+int ctSetMaxSize(struct ct* ct, ctCounter maxSize);
+
 /*
   CT uses this struct to store it's stats from now on. This function
   must only be called right after ctCreate(). It can be used to force
@@ -101,6 +173,19 @@ struct ct* ctCreate(
 */
 void ctUseStats(struct ct* ct, struct ctStats* stats);
 
+/*
+  Per-thread stats (see threadstats.h). "stats" is an array of
+  "nBlocks" stats, "stride" bytes apart (the stats may be a member of
+  a larger struct). The calling thread updates the block given by
+  threadStatsBlock(). ctStats() returns the sum. This function must
+  only be called right after ctCreate().
+*/
+void ctUseThreadStats(
+	struct ct* ct, struct ctStats* stats, unsigned nBlocks, size_t stride);
+
+// Add the counters in "stats" to "sum" (all but ttlNanos)
+void ctAddStats(struct ctStats* sum, struct ctStats const* stats);
+
 /*
   There is nothing that prevents the returned data from beeing removed
   from the conntracker at any time after the call. Some other thread
@@ -131,13 +216,31 @@ int ctInsertWithTTL(
 void ctRemove(
 	struct ct* ct, struct timespec* now, struct ctKey const* key);
 
+/*
+  Returns the stats. The counters are maintained on updates so this is
+  cheap, but "active" includes timed out entries that are not GC'ed.
+  With per-thread stats the blocks are summed in each call.
+*/
+struct ctStats const* ctStats(
+	struct ct* ct, struct timespec* now);
 /*
  This function will scan the entire hash table. It will trig a full
  GC. Use it with caution!
 */
-struct ctStats const* ctStats(
+struct ctStats const* ctStatsDeep(
 	struct ct* ct, struct timespec* now);
 
+/*
+  Incremental expiry. GC the next "n" buckets (or open addressing
+  slots) and continue from there in the next call. Call periodically
+  from one thread, e.g. with n = size * interval / ttl to sweep the
+  whole table once per ttl. If n >= size a full GC is made. With open
+  addressing the DELETED slots (tombstones) are also reclaimed. Returns
+  the number of GC'ed objects (including GC by other threads during
+  the call).
+*/
+ctCounter ctExpire(struct ct* ct, struct timespec* now, unsigned n);
+
 // Will hang until everything is unlocked. Other ct-operations MUST
 // NOT be called after this. "freeDataFn" WILL be called for any remaining
 // entries.
@@ -7,6 +7,7 @@
 #include <die.h>
 #include <rangeset.h>
 #include <match.h>
+#include <threadstats.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -22,11 +23,17 @@
 
 #define MALLOC(x) calloc(1, sizeof(*(x))); if (x == NULL) die("OOM")
 #define CALLOC(n,x) calloc(n, sizeof(*(x))); if (x == NULL) die("OOM")
-#define CNTINC(x) __atomic_add_fetch(&(x),1,__ATOMIC_RELAXED)
+
+// Per-thread match counters (see threadstats.h)
+struct FlowCounter {
+	unsigned matches;
+} __attribute__((aligned(STATS_ALIGN)));
 
 struct Cidr {
 	struct in6_addr adr;
 	uint64_t mask[2];
+	int isIpv4;					/* Mask >= 96 and a ::ffff: address */
+	uint32_t adr4, mask4;
 };
 
 struct Flow {
@@ -40,7 +47,8 @@ struct Flow {
 	unsigned nsrcs; struct Cidr* srcs;
 	struct Match* match;
 	unsigned short udpencap;
-	unsigned match_count;
+	unsigned ncounters;
+	struct FlowCounter* counters;
 };
 
 struct FlowSet {
@@ -48,6 +56,7 @@ struct FlowSet {
 	struct Flow** flows;		/* null terminated */
 	void (*lock_user_ref)(void* user_ref);
 	int promiscuous_ping;
+	unsigned nThreads;			/* Per-thread match counters */
 	pthread_rwlock_t lock;
 };
 #define RLOCK(set) if (pthread_rwlock_rdlock(&set->lock) != 0) \
@@ -64,8 +73,13 @@ struct FlowSet* flowSetCreate(void (*lock_user_ref)(void* user_ref))
 	if (pthread_rwlock_init(&set->lock, NULL) != 0)
 		die("pthread_rwlock_init");
 	set->lock_user_ref = lock_user_ref;
+	set->nThreads = 1;
 	return set;
 }
+void flowSetThreadStats(struct FlowSet* set, unsigned nThreads)
+{
+	set->nThreads = nThreads > 0 ? nThreads : 1;
+}
 void flowSetPromiscuousPing(struct FlowSet* set, int value)
 {
 	set->promiscuous_ping = value;
@@ -80,6 +94,7 @@ static void flowFree(struct Flow* f)
 	rangeSetDestroy(f->dports);
 	rangeSetDestroy(f->sports);
 	matchDestroy(f->match);
+	free(f->counters);
 	free(f->name);
 	free(f);
 }
@@ -195,6 +210,11 @@ static struct Cidr* parseCidrs(
 		}
 		// Apply the mask on the address
 		maskAdr(&(c[i].adr), c[i].mask);
+		if (mask >= 96 && ctAddrIsIpv4(&(c[i].adr))) {
+			c[i].isIpv4 = 1;
+			c[i].adr4 = c[i].adr.s6_addr32[3];
+			c[i].mask4 = (uint32_t)(c[i].mask[1] >> 32);
+		}
 	}
 	*cnt = len;
 	return c;
@@ -230,6 +250,12 @@ char const* flowDefine(
 	f->priority = priority;
 	f->user_ref = user_ref;
 	f->udpencap = udpencap;
+	f->ncounters = set->nThreads;
+	f->counters = aligned_alloc(
+		STATS_ALIGN, f->ncounters * sizeof(struct FlowCounter));
+	if (f->counters == NULL)
+		die("OOM");
+	memset(f->counters, 0, f->ncounters * sizeof(struct FlowCounter));
 	if (protocols != NULL) {
 		f->protocols = parseProtocol(protocols);
 		if (f->protocols == NULL)
@@ -355,10 +381,21 @@ void* flowLookupName(
 	return user_ref;
 }
 
-static int addrInCidr(struct Cidr* cidr, struct in6_addr adr)
+// isIpv4 - the address is ::ffff:a.b.c.d
+static inline int addrInCidr(
+	struct Cidr const* cidr, struct in6_addr const* adr, int isIpv4)
+{
+	if (cidr->isIpv4)
+		return isIpv4 && (adr->s6_addr32[3] & cidr->mask4) == cidr->adr4;
+	struct in6_addr a = *adr;
+	maskAdr(&a, (uint64_t*)cidr->mask);
+	return IN6_ARE_ADDR_EQUAL(&(cidr->adr), &a);
+}
+
+static inline void countMatch(struct Flow* f)
 {
-	maskAdr(&adr, cidr->mask);
-	return IN6_ARE_ADDR_EQUAL(&(cidr->adr), &adr);
+	unsigned i = threadStatsBlock(f->ncounters);
+	STATS_ADD(i, f->counters[i].matches, 1);
 }
 
 static void* flowMatch(
@@ -369,11 +406,13 @@ static void* flowMatch(
 	unsigned short* udpencap)
 {
 	int found;
+	int dstIsIpv4 = ctAddrIsIpv4(&key->dst);
+	int srcIsIpv4 = ctAddrIsIpv4(&key->src);
 
 	if (f->dsts != NULL) {
 		found = 0;
 		for (unsigned i = 0; i < f->ndsts; i++) {
-			if (addrInCidr(f->dsts + i, key->dst)) {
+			if (addrInCidr(f->dsts + i, &key->dst, dstIsIpv4)) {
 				found = 1;
 				break;
 			}
@@ -384,7 +423,7 @@ static void* flowMatch(
 	if (f->srcs != NULL) {
 		found = 0;
 		for (unsigned i = 0; i < f->nsrcs; i++) {
-			if (addrInCidr(f->srcs + i, key->src)) {
+			if (addrInCidr(f->srcs + i, &key->src, srcIsIpv4)) {
 				found = 1;
 				break;
 			}
@@ -396,7 +435,7 @@ static void* flowMatch(
 		// Ping will match any flow with an address match
 		if (key->ports.proto == IPPROTO_ICMP || key->ports.proto == IPPROTO_ICMPV6)
 			if (key->id != 0) {
-				CNTINC(f->match_count);
+				countMatch(f);
 				return f->user_ref;
 			}
 	}
@@ -427,7 +466,7 @@ static void* flowMatch(
 	// We have a match
 	if (udpencap != NULL)
 		*udpencap = f->udpencap;
-	CNTINC(f->match_count);
+	countMatch(f);
 	return f->user_ref;
 }
 
@@ -576,7 +615,10 @@ static void printFlow(
 		fprintf(out, ",\n");
 		fprintf(out, "  \"udpencap\": %u", f->udpencap);
 	}
-	fprintf(out, ",\n  \"matches_count\": %u", f->match_count);
+	unsigned matches = 0;
+	for (unsigned i = 0; i < f->ncounters; i++)
+		matches += __atomic_load_n(&f->counters[i].matches, __ATOMIC_RELAXED);
+	fprintf(out, ",\n  \"matches_count\": %u", matches);
 	if (user_ref2string != NULL) {
 		fprintf(out, ",\n");
 		fprintf(out, "  \"user_ref\": \"%s\"", user_ref2string(f->user_ref));
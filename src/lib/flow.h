@@ -10,6 +10,9 @@
 struct FlowSet;
 struct FlowSet* flowSetCreate(void (*lock_user_ref)(void* user_ref));
 void flowSetDelete(struct FlowSet* set);
+// Per-thread match counters (see threadstats.h). Call before flows
+// are defined. Default 1 (shared).
+void flowSetThreadStats(struct FlowSet* set, unsigned nThreads);
 unsigned flowSetSize(struct FlowSet* set);
 
 // Add or replace a flow
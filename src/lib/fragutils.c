@@ -4,11 +4,13 @@
 */
 
 #include "fragutils.h"
+#include "threadstats.h"
 #include <pthread.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #ifdef SANITY_CHECK
 #include <assert.h>
@@ -22,6 +24,13 @@
 #define REFDEC(x) __atomic_sub_fetch(&(x),1,__ATOMIC_SEQ_CST)
 #define CNTINC(x) __atomic_add_fetch(&(x),1,__ATOMIC_RELAXED)
 #define CNTDEC(x) __atomic_sub_fetch(&(x),1,__ATOMIC_RELAXED)
+// Update a counter in the stats block of the calling thread
+#define FCNT_ADD(ft,x,v) do {								\
+		unsigned _i = threadStatsBlock((ft)->nStats);		\
+		STATS_ADD(_i, (ft)->fstats[_i].x, v);				\
+	} while (0)
+#define FCNT_INC(ft,x) FCNT_ADD(ft,x,1)
+#define FCNT_DEC(ft,x) FCNT_ADD(ft,x,-1)
 #define ATOMIC_LOAD(x) __atomic_load_n(&(x),__ATOMIC_RELAXED)
 #define ATOMIC_STORE(x,v) __atomic_store_n(&(x),v,__ATOMIC_RELAXED)
 #define MUTEX(x) pthread_mutex_t x
@@ -44,7 +53,13 @@ struct FragTable {
 	struct ItemPool* fragmentPool; /* Stored not-first fragments to re-inject */
 	struct fragStats _fstats;
 	struct fragStats* fstats;
+	unsigned nStats;			/* Per-thread stats blocks */
 	struct FragReassembler* reassembler;
+	unsigned ttlMillis;
+	unsigned maxHsize;			/* The ct may grow to this size */
+	unsigned expiryMillis;		/* 0 - No expiry thread */
+	int expiryStop;
+	pthread_t expiryThread;
 };
 
 /*
@@ -68,11 +83,24 @@ struct FragData {
 };
 
 
-// user_ref may be NULL
-static void fragDataLock(void* user_ref, void* data)
+/*
+  Called by ctLookup() without locking, so the object may have been
+  released (and re-allocated) by another thread. Only take a reference
+  if the counter is not 0. The FragData objects are pool items and
+  stay readable.
+  user_ref may be NULL
+ */
+static int fragDataLock(void* user_ref, void* data)
 {
 	struct FragData* f = data;
-	REFINC(f->referenceCounter);
+	int refCount = __atomic_load_n(&f->referenceCounter, __ATOMIC_RELAXED);
+	do {
+		if (refCount <= 0)
+			return -1;
+	} while (!__atomic_compare_exchange_n(
+				 &f->referenceCounter, &refCount, refCount + 1, 1,
+				 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	return 0;
 }
 // user_ref may be NULL
 static void fragDataUnlock(void* user_ref, void* data)
@@ -89,7 +117,7 @@ static void fragDataUnlock(void* user_ref, void* data)
 		struct Item* i;
 		struct FragTable* ft = user_ref;
 		for (i = f->storedFragments; i != NULL; i = i->next)
-			CNTINC(ft->fstats->fragsDiscarded);
+			FCNT_INC(ft, fragsDiscarded);
 		itemFree(f->storedFragments);
 		if (ft->reassembler != NULL && f->assemblyData != NULL) {
 			ft->reassembler->destroy(f->assemblyData);
@@ -170,8 +198,8 @@ static void* bucketPoolAllocate(void* user_ref)
 	struct Item* i = itemAllocate(ft->bucketPool);
 	if (i == NULL)
 		return NULL;
-	CNTINC(ft->fstats->bucketsAllocated);
-	CNTINC(ft->fstats->bucketsUsed);
+	FCNT_INC(ft, bucketsAllocated);
+	FCNT_INC(ft, bucketsUsed);
 	return i->data;
 }
 static void bucketPoolFree(void* user_ref, void* b)
@@ -179,7 +207,7 @@ static void bucketPoolFree(void* user_ref, void* b)
 	struct Item* item = ITEM_OF(b);
 	itemFree(item);
 	struct FragTable* ft = user_ref;
-	CNTDEC(ft->fstats->bucketsUsed);
+	FCNT_DEC(ft, bucketsUsed);
 }
 
 /* ----------------------------------------------------------------------
@@ -209,9 +237,12 @@ struct FragTable* fragTableCreate(
 		hsize + maxBuckets, sizeof(struct FragData), initMutex);
 	// Init stats
 	ft->fstats = &ft->_fstats;
+	ft->nStats = 1;
 	ft->fstats->bucketsMax = maxBuckets;
 	ft->fstats->fragsMax = maxFragments;
 	ft->fstats->mtu = mtu;
+	ft->ttlMillis = timeoutMillis;
+	ft->maxHsize = hsize;
 	/* A pointer to the FragTable structure is passed as "user_ref" to
 	   ctCreate() and is passed back as the firsts parameter in call-backs. */
 	ft->ct = ctCreate(
@@ -221,6 +252,17 @@ struct FragTable* fragTableCreate(
 	return ft;
 }
 
+int fragSetMaxSize(struct FragTable* ft, unsigned maxHsize)
+{
+	if (ctSetMaxSize(ft->ct, maxHsize) != 0)
+		return -1;
+	itemPoolDestroy(ft->fragDataPool, NULL);
+	ft->fragDataPool = itemPoolCreate(
+		maxHsize + ft->fstats->bucketsMax, sizeof(struct FragData), initMutex);
+	ft->maxHsize = maxHsize;
+	return 0;
+}
+
 // https://stackoverflow.com/questions/5617925/maximum-values-for-time-t-struct-timespec/
 // Assuming time_t is an integer, not a float
 #include <limits.h>
@@ -231,6 +273,11 @@ void fragTableDestroy(struct FragTable* ft)
 	struct timespec now;
 	now.tv_sec = MAXTIME;
 	struct fragStats stats;
+	if (ft->expiryMillis > 0) {
+		ATOMIC_STORE(ft->expiryStop, 1);
+		pthread_join(ft->expiryThread, NULL);
+		ctExpire(ft->ct, &now, UINT_MAX);
+	}
 	//printf("now.tv_sec = %ld\n", now.tv_sec);
 	fragGetStats(ft, &now, &stats);
 #ifdef SANITY_CHECK
@@ -250,6 +297,41 @@ void fragTableDestroy(struct FragTable* ft)
 	free(ft);
 }
 
+static void* expiryThread(void* arg)
+{
+	struct FragTable* ft = arg;
+	struct timespec interval, now;
+	interval.tv_sec = ft->expiryMillis / 1000;
+	interval.tv_nsec = (ft->expiryMillis % 1000) * MS;
+	while (!ATOMIC_LOAD(ft->expiryStop)) {
+		nanosleep(&interval, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		unsigned deep = ATOMIC_LOAD(ft->fstats->deepRequest);
+		if (deep != ft->fstats->deepDone) {
+			ctStatsDeep(ft->ct, &now);
+			ATOMIC_STORE(ft->fstats->deepDone, deep);
+		} else {
+			// Sweep the whole table once per ttl. The size may change
+			unsigned n = (uint64_t)ATOMIC_LOAD(ft->fstats->ctstats.size) *
+				ft->expiryMillis / (ft->ttlMillis + 1) + 1;
+			ctExpire(ft->ct, &now, n);
+		}
+	}
+	return NULL;
+}
+
+int fragStartExpiry(struct FragTable* ft, unsigned intervalMillis)
+{
+	if (intervalMillis == 0 || ft->expiryMillis > 0)
+		return -1;
+	ft->expiryMillis = intervalMillis;
+	if (pthread_create(&ft->expiryThread, NULL, expiryThread, ft) != 0) {
+		ft->expiryMillis = 0;
+		return -1;
+	}
+	return 0;
+}
+
 void fragRegisterFragReassembler(
 	struct FragTable* ft, struct FragReassembler* reassembler)
 {
@@ -258,9 +340,16 @@ void fragRegisterFragReassembler(
 
 void fragUseStats(struct FragTable* ft, struct fragStats* stats)
 {
+	fragUseThreadStats(ft, stats, 1);
+}
+void fragUseThreadStats(
+	struct FragTable* ft, struct fragStats* stats, unsigned nThreads)
+{
+	memset(stats, 0, nThreads * sizeof(*stats));
 	*stats = *ft->fstats;
 	ft->fstats = stats;
-	ctUseStats(ft->ct, &stats->ctstats);
+	ft->nStats = nThreads;
+	ctUseThreadStats(ft->ct, &stats->ctstats, nThreads, sizeof(*stats));
 }
 
 int fragInsertFirst(
@@ -301,7 +390,7 @@ int fragInsertFirst(
 		*storedFragments = storedFrags;
 	} else {
 		for (struct Item* i = storedFrags; i != NULL; i = i->next)
-			CNTINC(ft->fstats->fragsDiscarded);
+			FCNT_INC(ft, fragsDiscarded);
 		itemFree(storedFrags);
 	}
 
@@ -340,7 +429,7 @@ int fragGetValueOrStore(
 			if (ATOMIC_LOAD(f->state) == FragData_hashValid) {
 				if (ft->reassembler->handleFragment(f->assemblyData, data, len) == 0) {
 					ctRemove(ft->ct, now, key);
-					CNTINC(ft->fstats->reAssembled);
+					FCNT_INC(ft, reAssembled);
 				}
 			} else {
 				// It we havn't got the first fragment we must store
@@ -387,7 +476,7 @@ int fragGetValueOrStore(
 		fragDataUnlock(ft, f);
 
 		for (struct Item* i = storedFrags; i != NULL; i = i->next)
-			CNTINC(ft->fstats->fragsDiscarded);
+			FCNT_INC(ft, fragsDiscarded);
 		itemFree(storedFrags);
 
 		return -1;				/* Out of fragment space */
@@ -431,7 +520,7 @@ int fragGetValueOrStore(
 		// Release no-longer-needed Item outside the lock
 		itemFree(item);
 	} else {
-		CNTINC(ft->fstats->fragsAllocated);
+		FCNT_INC(ft, fragsAllocated);
 	}
 
 	fragDataUnlock(ft, f);
@@ -477,16 +566,30 @@ int handleFirstFragment(
    Stats;
  */
 
+// Add the frag counters (not the ctstats)
+static void addFragStats(struct fragStats* sum, struct fragStats const* s)
+{
+	sum->bucketsMax += s->bucketsMax;
+	sum->bucketsAllocated += ATOMIC_LOAD(s->bucketsAllocated);
+	sum->bucketsUsed += ATOMIC_LOAD(s->bucketsUsed);
+	sum->fragsMax += s->fragsMax;
+	sum->fragsDiscarded += ATOMIC_LOAD(s->fragsDiscarded);
+	sum->fragsAllocated += ATOMIC_LOAD(s->fragsAllocated);
+	sum->reAssembled += ATOMIC_LOAD(s->reAssembled);
+}
+
 void fragGetStats(
 	struct FragTable* ft, struct timespec* now, struct fragStats* stats)
 {
 	/*
-	  To call ctStats() will trig a full GC. I.e. call-backs to
+	  To call ctStatsDeep() will trig a full GC. I.e. call-backs to
 	  fragDataUnlock for timed-out FragData objects.
 	 */
-	struct ctStats const* ctstats = ctStats(ft->ct, now);
+	struct ctStats const* ctstats = ctStatsDeep(ft->ct, now);
 	if (stats != ft->fstats) {
 		*stats = *ft->fstats;
+		for (unsigned i = 1; i < ft->nStats; i++)
+			addFragStats(stats, ft->fstats + i);
 		stats->ctstats = *ctstats;
 	}
 
@@ -496,7 +599,7 @@ void fragGetStats(
 
 	istats = itemPoolStats(ft->bucketPool);
 	assert(ft->fstats->bucketsMax == istats->size);
-	assert(ft->fstats->ctstats.collisions == (istats->size - istats->nFree));
+	assert(ctstats->buckets == (istats->size - istats->nFree));
 
 	istats = itemPoolStats(ft->fragmentPool);
 	assert(ft->fstats->fragsMax == istats->size);
@@ -504,17 +607,32 @@ void fragGetStats(
 
 	istats = itemPoolStats(ft->fragDataPool);
 	assert(stats->ctstats.active == (istats->size - istats->nFree));
-	assert(istats->size == (ft->fstats->bucketsMax + stats->ctstats.size));
+	assert(istats->size == (ft->fstats->bucketsMax + ft->maxHsize));
 
 #endif
 }
 
+void fragSumStats(struct fragStats const* shards, struct fragStats* sum)
+{
+	unsigned n = shards->nShards > 0 ? shards->nShards : 1;
+	if (shards->nThreads > 0)
+		n *= shards->nThreads;
+	*sum = shards[0];
+	for (unsigned i = 1; i < n; i++) {
+		ctAddStats(&sum->ctstats, &shards[i].ctstats);
+		addFragStats(sum, shards + i);
+	}
+}
+
 void fragPrintStats(struct fragStats* sft)
 {
 	printf(
 		"{\n"
 		"  \"hsize\":            %u,\n"
+		"  \"resizes\":          %u,\n"
 		"  \"ttlMillis\":        %u,\n"
+		"  \"active\":           %u,\n"
+		"  \"chain\":            [%u, %u, %u, %u],\n"
 		"  \"collisions\":       %u,\n"
 		"  \"inserts\":          %u,\n"
 		"  \"rejected\":         %u,\n"
@@ -529,7 +647,10 @@ void fragPrintStats(struct fragStats* sft)
 		"  \"fragsDiscarded\":   %u\n"
 		"  \"reAssembled\":      %u\n"
 		"}\n",
-		sft->ctstats.size, (unsigned)(sft->ctstats.ttlNanos/1000000),
+		sft->ctstats.size, sft->ctstats.resizes,
+		(unsigned)(sft->ctstats.ttlNanos/1000000),
+		sft->ctstats.active, sft->ctstats.chain[0], sft->ctstats.chain[1],
+		sft->ctstats.chain[2], sft->ctstats.chain[3],
 		sft->ctstats.collisions, sft->ctstats.inserts,
 		sft->ctstats.rejectedInserts, sft->ctstats.lookups, sft->ctstats.objGC,
 		sft->mtu, sft->bucketsMax, sft->bucketsAllocated, sft->bucketsUsed,
@@ -66,9 +66,17 @@
   will be re-used eventually, and in case of high load, more
   frequently.
 
-  However a full GC is trigged by reading the fragmentation stats. A
-  reason may be for metrics or for an alarm on over-use of stored
-  fragments which may indicate a DoS attack.
+  The stats in "struct fragStats" are maintained on updates and can
+  be read at any time (e.g from shared memory). But timed out entries
+  are counted as "active" until they are GC'ed. A full GC is trigged
+  by "fragGetStats". A reason may be for an alarm on over-use of
+  stored fragments which may indicate a DoS attack.
+
+  An expiry thread can be started with "fragStartExpiry". It frees
+  timed out entries in small slices (ctExpire) every interval and
+  sweeps the whole table once per ttl. Nothing lingers longer than
+  ~2*ttl. The expiry thread also makes a full GC when "deepRequest"
+  in the stats is stepped, and then sets "deepDone" to the same value.
 
 */
 struct FragTable;
@@ -81,6 +89,16 @@ struct FragTable* fragTableCreate(
 
 void fragTableDestroy(struct FragTable* ft);
 
+/*
+  Let the hash table grow online up to "maxHsize" (see ctSetMaxSize).
+  Resizes are counted in the stats. Must be called right after
+  fragTableCreate().
+  return:
+   0 - Ok
+  -1 - Failed, e.g. maxHsize < hsize
+*/
+int fragSetMaxSize(struct FragTable* ft, unsigned maxHsize);
+
 struct FragReassembler {
 	void* (*new)(void);
 	// Returns;
@@ -93,6 +111,14 @@ struct FragReassembler {
 void fragRegisterFragReassembler(
 	struct FragTable* ft, struct FragReassembler* reassembler);
 
+/*
+  Start the expiry thread. It is stopped by fragTableDestroy().
+  return:
+   0 - Started
+  -1 - Failed, or already started
+*/
+int fragStartExpiry(struct FragTable* ft, unsigned intervalMillis);
+
 
 /*
   Inserts the first fragment and stores the passed value to be used for
@@ -153,9 +179,29 @@ struct fragStats {
 	unsigned fragsDiscarded;
 	unsigned fragsAllocated;
 	unsigned reAssembled;
+	unsigned deepRequest;		/* Stepped to request a full GC */
+	unsigned deepDone;
+	unsigned nShards;			/* Number of FragTables (shards) */
+	unsigned nThreads;			/* Per-thread stats blocks per shard */
 };
 
 void fragUseStats(struct FragTable* ft, struct fragStats* stats);
+/*
+  Per-thread stats (see threadstats.h). "stats" is an array of
+  "nThreads" blocks, e.g. in shared memory. fragGetStats() sums the
+  blocks, so "stats" passed to it must not be the array.
+*/
+void fragUseThreadStats(
+	struct FragTable* ft, struct fragStats* stats, unsigned nThreads);
 void fragGetStats(
 	struct FragTable* ft, struct timespec* now, struct fragStats* stats);
 void fragPrintStats(struct fragStats* sft);
+
+/*
+  Sharded mode; one FragTable per thread, each with it's own stats.
+  The stats for all shards are stored in an array, e.g. in shared
+  memory, with "nShards" and "nThreads" set in all elements. Each
+  shard has "nThreads" per-thread blocks. Sum the array into "sum".
+  Zero is taken as 1.
+*/
+void fragSumStats(struct fragStats const* shards, struct fragStats* sum);
@@ -3,6 +3,10 @@
 */
 
 #include "hash.h"
+#include <string.h>
+
+static unsigned hash_fn = HASH_DJB2;
+static uint32_t hash_seed = 0;
 
 uint32_t djb2_hash(uint8_t const* c, uint32_t len)
 {
@@ -12,3 +16,107 @@ uint32_t djb2_hash(uint8_t const* c, uint32_t len)
 	return hash;
 }
 
+/*
+  djb2 over "::ffff:src4, ::ffff:dst4, tail" without processing the
+  constant prefixes. Since hash = hash * 33 + c the 12 byte prefix
+  {0,0,0,0,0,0,0,0,0,0,0xff,0xff} becomes hash * 33^12 + 8670.
+ */
+#define DJB2_33P12 0x4f5f0981u	/* 33^12 (mod 2^32) */
+#define DJB2_PREFIX 8670u
+static inline uint32_t djb2_update(uint32_t hash, uint8_t const* c, uint32_t len)
+{
+	while (len--)
+		hash = ((hash << 5) + hash) + *c++;
+	return hash;
+}
+uint32_t djb2_hash_ipv4mapped(
+	uint8_t const* src4, uint8_t const* dst4, uint8_t const* tail, uint32_t tlen)
+{
+	uint32_t hash = 5381 * DJB2_33P12 + DJB2_PREFIX;
+	hash = djb2_update(hash, src4, 4);
+	hash = hash * DJB2_33P12 + DJB2_PREFIX;
+	hash = djb2_update(hash, dst4, 4);
+	return djb2_update(hash, tail, tlen);
+}
+
+/*
+  https://github.com/wangyi-fudan/wyhash
+  Simplified, and not compatible with the original. The words are read
+  in host byte order, so the hash differs between little and big
+  endian machines.
+ */
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+static inline uint64_t wyr8(uint8_t const* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+#define WYP0 0xa0761d6478bd642full
+#define WYP1 0xe7037ed1a0b428dbull
+#define WYP2 0x8ebc6af09c88c6e3ull
+#define WYP3 0x589965cc75374cc3ull
+
+uint32_t wy_hash(uint8_t const* c, uint32_t len, uint64_t seed)
+{
+	uint64_t h = seed ^ WYP0;
+	uint32_t n = len;
+	while (n >= 16) {
+		h = wymix(wyr8(c) ^ WYP1, wyr8(c + 8) ^ h);
+		c += 16;
+		n -= 16;
+	}
+	if (n >= 8) {
+		h = wymix(wyr8(c) ^ WYP2, h ^ WYP1);
+		c += 8;
+		n -= 8;
+	}
+	if (n > 0) {
+		uint64_t t = 0;
+		memcpy(&t, c, n);
+		h = wymix(t ^ WYP3, h ^ WYP2);
+	}
+	h = wymix(h ^ WYP1, len ^ WYP3);
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+void hashSetFunction(unsigned fn, uint32_t seed)
+{
+	hash_fn = fn;
+	hash_seed = seed;
+}
+unsigned hashFunction(void)
+{
+	return hash_fn;
+}
+uint32_t hashSeed(void)
+{
+	return hash_seed;
+}
+
+uint32_t hashData(uint8_t const* c, uint32_t len)
+{
+	if (hash_fn == HASH_WYHASH)
+		return wy_hash(c, len, hash_seed);
+	return djb2_hash(c, len);
+}
+
+static char const* const names[] = {"djb2", "wyhash"};
+int hashParseFunction(char const* name)
+{
+	for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+char const* hashFunctionName(unsigned fn)
+{
+	if (fn < sizeof(names) / sizeof(names[0]))
+		return names[fn];
+	return "unknown";
+}
@@ -1,12 +1,37 @@
 #pragma once
 /*
-  http://www.cse.yorku.ca/~oz/hash.html
-*/
+  Hash functions;
+
+  djb2 - http://www.cse.yorku.ca/~oz/hash.html
+    Byte-by-byte. The default for load-balancing for compatibility.
+  wyhash - A simplified wyhash (https://github.com/wangyi-fudan/wyhash)
+    Handles 64-bit words with a 64x64->128 bit multiply and has a seed.
+
+  The hash function used for load-balancing must be the same in all
+  nfqlb instances, so it's stored in the shared memory.
+ */
 
 #include <stdint.h>
 
+#define HASH_DJB2 0
+#define HASH_WYHASH 1
+
 #ifndef HASH
-#define HASH(d,l) djb2_hash((uint8_t const*)d,(uint32_t)l)
+#define HASH(d,l) hashData((uint8_t const*)d,(uint32_t)l)
 #endif
 
 uint32_t djb2_hash(uint8_t const* c, uint32_t len);
+// Same as djb2_hash() on an IPv4 mapped (::ffff:a.b.c.d) src/dst +tail
+uint32_t djb2_hash_ipv4mapped(
+	uint8_t const* src4, uint8_t const* dst4, uint8_t const* tail, uint32_t tlen);
+uint32_t wy_hash(uint8_t const* c, uint32_t len, uint64_t seed);
+
+// Select the function used by hashData(). Default djb2
+void hashSetFunction(unsigned fn, uint32_t seed);
+unsigned hashFunction(void);
+uint32_t hashSeed(void);
+uint32_t hashData(uint8_t const* c, uint32_t len);
+
+// Returns the function (HASH_*) or -1 if unknown
+int hashParseFunction(char const* name);
+char const* hashFunctionName(unsigned fn);
@@ -38,11 +38,20 @@ int ipv6IsExtensionHeader(unsigned hdr)
 }
 
 
+// Init an IPv4 key to ::ffff:0.0.0.0 addresses and zero id. Only the
+// IPv4 addresses needs to be set then, no memset of the entire key.
+static inline void keyInit4(struct ctKey* key)
+{
+	key->src.s6_addr32[0] = 0;
+	key->src.s6_addr32[1] = 0;
+	key->src.s6_addr32[2] = htonl(0xffff);
+	key->src.s6_addr32[3] = 0;
+	key->dst = key->src;
+	key->id = 0;
+}
 static inline void keySetAddr4(struct ctKey* key, struct iphdr* hdr)
 {
-	key->src.s6_addr16[5] = 0xffff;
 	key->src.s6_addr32[3] = hdr->saddr;
-	key->dst.s6_addr16[5] = 0xffff;
 	key->dst.s6_addr32[3] = hdr->daddr;
 }
 
@@ -65,9 +74,7 @@ static int getInnerHashKeyIpv4(
 		return -1;
 
 	// (swapped!)
-	key->src.s6_addr16[5] = 0xffff;
 	key->src.s6_addr32[3] = hdr->daddr;
-	key->dst.s6_addr16[5] = 0xffff;
 	key->dst.s6_addr32[3] = hdr->saddr;
 	key->ports.proto = hdr->protocol;
 
@@ -277,13 +284,21 @@ static int getHashKeyIpv6(
 	
 	if (htype == IPPROTO_FRAGMENT) {
 		struct ip6_frag const* fh = hdr;
+		if (!IN_BOUNDS(fh, sizeof(*fh), endp))
+			return -1;
 		if ((fh->ip6f_offlg & IP6F_OFF_MASK) == 0) {
 			// First fragment
 			if (fragid != NULL)
 				*fragid = fh->ip6f_ident;
+			htype = fh->ip6f_nxt;
+			hdr = fh + 1;
 			while (ipv6IsExtensionHeader(htype)) {
 				struct ip6_ext const* xh = hdr;
+				if (!IN_BOUNDS(xh, sizeof(*xh), endp))
+					return -1;
 				htype = xh->ip6e_nxt;
+				if (xh->ip6e_len == 0)
+					return -1;	/* Corrupt header */
 				hdr = hdr + (xh->ip6e_len * 8);
 			}
 			rc += 1;
@@ -353,27 +368,92 @@ int getHashKey(
 	struct ctKey* key, unsigned short udpencap, uint64_t* fragid,
 	unsigned proto, void const* data, unsigned len, unsigned short hash_mode)
 {
-	memset(key, 0, sizeof(*key));
-
 	switch (proto) {
 	case ETH_P_IP:
+		keyInit4(key);
 		return getHashKeyIpv4(key, udpencap, fragid, data, len, hash_mode);
 	case ETH_P_IPV6:
+		memset(key, 0, sizeof(*key));
 		return getHashKeyIpv6(key, udpencap, fragid, data, len, hash_mode);
 	default:;
 		// We should not get here because ip(6)tables handles only ip (4/6)
 	}
+	memset(key, 0, sizeof(*key));
+	return -1;
+}
+
+int getHashKeyAddresses(
+	struct ctKey* key, uint64_t* fragid,
+	unsigned proto, void const* data, unsigned len)
+{
+	switch (proto) {
+	case ETH_P_IP: {
+		struct iphdr* hdr = (struct iphdr*)data;
+		keyInit4(key);
+		if (!IN_BOUNDS(hdr, sizeof(*hdr), data + len))
+			return -1;
+		keySetAddr4(key, hdr);
+		return 32;
+	}
+	case ETH_P_IPV6: {
+		struct ip6_hdr* ip6hdr = (struct ip6_hdr*)data;
+		memset(key, 0, sizeof(*key));
+		if (!IN_BOUNDS(ip6hdr, sizeof(*ip6hdr), data + len))
+			return -1;
+		key->dst = ip6hdr->ip6_dst;
+		key->src = ip6hdr->ip6_src;
+		/*
+		  Look for a fragment header within the copy range. Without
+		  the fragment bits a first fragment would be handled as a
+		  normal packet, and the sub-sequent fragments dropped.
+		 */
+		void const* endp = data + len;
+		uint8_t htype = ip6hdr->ip6_nxt;
+		void const* hdr = data + sizeof(struct ip6_hdr);
+		while (ipv6IsExtensionHeader(htype) && htype != IPPROTO_FRAGMENT) {
+			struct ip6_ext const* xh = hdr;
+			if (!IN_BOUNDS(xh, sizeof(*xh), endp) || xh->ip6e_len == 0)
+				return 32;
+			htype = xh->ip6e_nxt;
+			hdr = hdr + (xh->ip6e_len * 8);
+		}
+		struct ip6_frag const* fh = hdr;
+		if (htype != IPPROTO_FRAGMENT || !IN_BOUNDS(fh, sizeof(*fh), endp))
+			return 32;
+		if ((fh->ip6f_offlg & IP6F_OFF_MASK) != 0) {
+			key->id = fh->ip6f_ident;
+			return 2;			/* Non-first frag */
+		}
+		if (fragid != NULL)
+			*fragid = fh->ip6f_ident;
+		return 32 + 1;			/* First frag */
+	}
+	default:;
+	}
+	memset(key, 0, sizeof(*key));
 	return -1;
 }
 
+/*
+  djb2 is byte-by-byte so for IPv4 the constant ::ffff: prefixes are
+  skipped. The hash is the same as for the entire key.
+ */
+#define DJB2_IPV4(key,tail,tlen) djb2_hash_ipv4mapped( \
+		(uint8_t const*)&key->src.s6_addr32[3], \
+		(uint8_t const*)&key->dst.s6_addr32[3], (uint8_t const*)tail, tlen)
+
 unsigned hashKey(struct ctKey* key, unsigned short hash_mode)
 {
 	if (key->ports.proto == IPPROTO_SCTP && hash_mode == 1)
 		return HASH(&key->ports.src, sizeof(uint16_t) * 2);
+	if (hashFunction() == HASH_DJB2 && ctKeyIsIpv4(key))
+		return DJB2_IPV4(key, &key->id, sizeof(key->id));
 	return HASH(key, sizeof(*key));
 }
 unsigned hashKeyAddresses(struct ctKey* key)
 {
+	if (hashFunction() == HASH_DJB2 && ctKeyIsIpv4(key))
+		return DJB2_IPV4(key, NULL, 0);
 	return HASH(key, sizeof(struct in6_addr) * 2);
 }
 
@@ -29,6 +29,18 @@ int getHashKey(
 	struct ctKey* key, unsigned short udpencap, uint64_t* fragid,
 	unsigned proto, void const* data, unsigned len, unsigned short hash_mode);
 
+/*
+  Get a key with addresses only. Use it if getHashKey() fails for a
+  packet that is truncated (copy range), e.g. an IPv6 packet with a
+  long extension header chain. All packets in a flow have the same
+  headers, so they get the same key. The fragment bits are kept if the
+  fragment header is within "len". Returns 32, 33 (first fragment,
+  *fragid is returned), 2 (as getHashKey) or <0 (failed).
+ */
+int getHashKeyAddresses(
+	struct ctKey* key, uint64_t* fragid,
+	unsigned proto, void const* data, unsigned len);
+
 // Hash on addresses only
 unsigned hashKeyAddresses(struct ctKey* key);
 
@@ -1,108 +1,677 @@
 #include "maglevdyn.h"
 #include <die.h>
 #include <prime.h>
+#include <hash.h>
 
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
+/*
+  The permutation for target i is (offset[i] + j * skip[i]) % M and is
+  computed on the fly. Only offset/skip are stored. They are derived
+  from a seeded hash of the fwmark (see setPermutation()).
+ */
+#define MAGDYN_MAGIC 0x4d440008	/* "MD" format 8 */
 struct MagDataDynInternal {
+	unsigned magic;
 	unsigned M, N;
+	unsigned width;				/* Lookup entry size */
+	unsigned engine;			/* MAGDYN_MAGLEV, ... */
+	uint32_t seed;				/* For permutations */
 	unsigned len;
+	unsigned generation;		/* Current lookup/active is generation & 1 */
+	struct MagDataDynStats stats;	/* For the last update */
 	uint8_t mem[];				/* Actuall size=len */
 };
 
-unsigned magDataDyn_len(unsigned M, unsigned N)
+// Size of a lookup table, aligned to 8 bytes
+#define LOOKUP_SIZE(M,w) ((((M) * (w)) + 7) & ~7u)
+
+static unsigned entryWidth(unsigned N, unsigned width)
+{
+	unsigned w = N < UINT8_MAX ? 1 : (N < UINT16_MAX ? 2 : 4);
+	if (width == 0)
+		return w;
+	if (width != 1 && width != 2 && width != 4)
+		die("Invalid lookup entry width %u\n", width);
+	if (width < w)
+		die("Lookup entry width %u too small for N=%u\n", width, N);
+	return width;
+}
+
+unsigned magDataDyn_len(unsigned M, unsigned N, unsigned width)
 {
 	if (M < 3)
 		M = 3;
 	M = primeBelow(M);
-	return sizeof(struct MagDataDynInternal)  + sizeof(unsigned) * (3 + M * N)
-		+ sizeof(int) * (M + N);
+	width = entryWidth(N, width);
+	return sizeof(struct MagDataDynInternal) + LOOKUP_SIZE(M, width) * 2
+		+ sizeof(unsigned) * 3 * N + sizeof(int) * N * 2;
 }
 
-void magDataDyn_init(unsigned M, unsigned N, void* mem, unsigned len)
+static void setPermutation(struct MagDataDyn* d, unsigned i);
+
+void magDataDyn_init(
+	unsigned M, unsigned N, unsigned width, unsigned engine, uint32_t seed,
+	void* mem, unsigned len)
 {
+	if (magDataDyn_engineName(engine) == NULL)
+		die("Invalid engine %u\n", engine);
 	if (M < 3)
 		M = 3;
 	M = primeBelow(M);
-	if (len < magDataDyn_len(M, N))
-		die("magDataDyn len too small; %u < %u\n", len, magDataDyn_len(M, N));
+	width = entryWidth(N, width);
+	if (len < magDataDyn_len(M, N, width))
+		die("magDataDyn len too small; %u < %u\n",
+			len, magDataDyn_len(M, N, width));
 
 	memset(mem, 0, len);
 	struct MagDataDynInternal* mi = mem;
+	mi->magic = MAGDYN_MAGIC;
 	mi->M = M;
 	mi->N = N;
+	mi->width = width;
+	mi->engine = engine;
+	mi->seed = seed;
 	mi->len = len;
 
 	struct MagDataDyn m;
 	magDataDyn_map(&m, mem);
 	for (int i = 0; i < m.N; i++) {
-		unsigned offset = rand() % m.M;
-		unsigned skip = rand() % (m.M - 1) + 1;
-		unsigned* row = m.permutation[i];
-		for (unsigned j = 0; j < m.M; j++) {			
-			row[j] = (offset + j * skip) % m.M;
-		}
-		m.active[i] = -1;
+		m.weight[i] = 1;
+		m.activeBuf[0][i] = -1;
+		m.activeBuf[1][i] = -1;
 	}
+	for (int i = 0; i < m.N; i++)
+		setPermutation(&m, i);
 	magDataDyn_populate(&m);
 	magDataDyn_free(&m);
 }
 
 void magDataDyn_map(struct MagDataDyn* m, void* mem)
+{
+	if (magDataDyn_tryMap(m, mem) != 0)
+		die("Incompatible Maglev shm format. Convert with 'nfqlb init --convert'\n");
+}
+
+int magDataDyn_tryMap(struct MagDataDyn* m, void* mem)
 {
 	struct MagDataDynInternal* mi = mem;
+	if (mi->magic != MAGDYN_MAGIC)
+		return -1;
 	m->M = mi->M;
 	m->N = mi->N;
+	m->width = mi->width;
+	m->engine = mi->engine;
+	m->seed = mi->seed;
+	m->modM = UINT64_MAX / m->M + 1;
+	m->generation = &mi->generation;
+	m->stats = &mi->stats;
 	unsigned offset = sizeof(struct MagDataDynInternal);
-	m->lookup = mem + offset;
-	offset += (m->M * sizeof(int));
-	m->permutation = malloc(m->N * sizeof(unsigned*));
-	if (m->permutation == NULL)
-		die("Out of mem\n");
-	unsigned i;
-	for (i = 0; i < m->N; i++) {
-		m->permutation[i] = mem + offset;
-		offset += (m->M * sizeof(unsigned));
-	}
-	m->active = mem + offset;	   
+	m->lookupBuf[0] = mem + offset;
+	offset += LOOKUP_SIZE(m->M, m->width);
+	m->lookupBuf[1] = mem + offset;
+	offset += LOOKUP_SIZE(m->M, m->width);
+	m->offset = mem + offset;
+	offset += (m->N * sizeof(unsigned));
+	m->skip = mem + offset;
+	offset += (m->N * sizeof(unsigned));
+	m->weight = mem + offset;
+	offset += (m->N * sizeof(unsigned));
+	m->activeBuf[0] = mem + offset;
+	offset += (m->N * sizeof(int));
+	m->activeBuf[1] = mem + offset;
+	unsigned g = magDataDyn_generation(m) & 1;
+	m->lookup = m->lookupBuf[g];
+	m->active = m->activeBuf[g];
+	return 0;
+}
+
+unsigned magDataDyn_generation(struct MagDataDyn const* m)
+{
+	return __atomic_load_n(m->generation, __ATOMIC_ACQUIRE);
+}
+
+void magDataDyn_edit(struct MagDataDyn* m)
+{
+	unsigned g = magDataDyn_generation(m);
+	unsigned next = (g + 1) & 1;
+	/*
+	  Readers may still use the "next" buffer (published two
+	  generations ago). The generation must be seen before any update
+	  so they detect it and retry.
+	 */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(m->lookupBuf[next], m->lookupBuf[g & 1], m->M * m->width);
+	memcpy(m->activeBuf[next], m->activeBuf[g & 1], m->N * sizeof(int));
+	m->lookup = m->lookupBuf[next];
+	m->active = m->activeBuf[next];
+}
+
+unsigned magDataDyn_publish(struct MagDataDyn* m)
+{
+	unsigned g = magDataDyn_generation(m);
+	if (m->lookup == m->lookupBuf[g & 1])
+		return g;				/* Not edited */
+	g = __atomic_add_fetch(m->generation, 1, __ATOMIC_RELEASE);
+	m->lookup = m->lookupBuf[g & 1];
+	m->active = m->activeBuf[g & 1];
+	return g;
 }
 void magDataDyn_free(struct MagDataDyn* m)
 {
-	free(m->permutation);
+	/* Nothing allocated any more */
 }
 
-void magDataDyn_populate(struct MagDataDyn* d)
+static inline void setSlot(struct MagDataDyn* d, unsigned i, int v)
+{
+	switch (d->width) {
+	case 1:
+		((uint8_t*)d->lookup)[i] = v;	/* (-1 -> all-ones) */
+		break;
+	case 2:
+		((uint16_t*)d->lookup)[i] = v;
+		break;
+	default:
+		((int*)d->lookup)[i] = v;
+	}
+}
+#define getSlot(d,i) magDataDyn_slot(d,i)
+
+// Step to the next entry in the permutation for target i
+static inline unsigned nextSlot(struct MagDataDyn const* d, unsigned i, unsigned c)
 {
-	for (int i = 0; i < d->M; i++) {
-		d->lookup[i] = -1;
+	c += d->skip[i];
+	return c >= d->M ? c - d->M : c;
+}
+
+/*
+  The permutation is derived from a seeded hash of the fwmark as in the
+  Maglev paper (offset = h1 % M, skip = h2 % (M-1) + 1). So all nodes
+  with the same seed and targets get the same permutations regardless
+  of the index in active[]. If the fwmark is used on a lower index the
+  index is included, so duplicate fwmarks get different permutations.
+ */
+static uint32_t targetHash(struct MagDataDyn const* d, unsigned i, uint32_t n)
+{
+	uint32_t key[3] = {d->active[i], 0, n};
+	for (unsigned j = 0; j < i; j++) {
+		if (d->active[j] == d->active[i]) {
+			key[1] = i + 1;
+			break;
+		}
 	}
+	return wy_hash((uint8_t const*)key, sizeof(key), d->seed);
+}
+static void setPermutation(struct MagDataDyn* d, unsigned i)
+{
+	d->offset[i] = targetHash(d, i, 0) % d->M;
+	d->skip[i] = targetHash(d, i, 1) % (d->M - 1) + 1;
+}
+
+/*
+  Active targets ordered by fwmark (then index) so the populate does
+  not depend on the index in active[]. Returns the number of active.
+ */
+static unsigned activeOrder(struct MagDataDyn const* d, unsigned* order)
+{
+	unsigned n = 0;
+	for (unsigned i = 0; i < d->N; i++) {
+		if (d->active[i] < 0) continue;
+		unsigned k = n++;
+		while (k > 0 && d->active[order[k - 1]] > d->active[i]) {
+			order[k] = order[k - 1];
+			k--;
+		}
+		order[k] = i;
+	}
+	return n;
+}
+
+/*
+  Weighted populate (section 3.4 in the Maglev paper). In each round
+  every active target earns it's weight in credits and picks a slot
+  for each "max weight" of credits. With equal weights this is the
+  original round-robin.
+ */
+static void maglevPopulate(struct MagDataDyn* d)
+{
+	memset(d->lookup, 0xff, d->M * d->width); /* All -1 */
 
 	// Corner case; no active targets
+	unsigned order[d->N];
+	unsigned nActive = activeOrder(d, order), wmax = 0;
+	if (nActive == 0) return;
+	for (unsigned k = 0; k < nActive; k++) {
+		unsigned i = order[k];
+		setPermutation(d, i);
+		if (d->weight[i] > wmax) wmax = d->weight[i];
+	}
+
+	// next[i] is the next slot in the permutation for target i
+	unsigned next[d->N], credit[d->N], c = 0;
+	memcpy(next, d->offset, sizeof(next));
+	memset(credit, 0, sizeof(credit));
+	unsigned n = 0;
+	for (;;) {
+		for (unsigned k = 0; k < nActive; k++) {
+			unsigned i = order[k];
+			credit[i] += d->weight[i];
+			while (credit[i] >= wmax) {
+				credit[i] -= wmax;
+				c = next[i];
+				while (getSlot(d, c) >= 0)
+					c = nextSlot(d, i, c);
+				setSlot(d, c, i);
+				next[i] = nextSlot(d, i, c);
+				n = n + 1;
+				if (n == d->M) return;
+			}
+		}
+	}
+}
+
+// Count the slots per target. Returns number of active targets
+static unsigned countSlots(struct MagDataDyn* d, unsigned* count)
+{
 	unsigned nActive = 0;
-	for (int i = 0; i < d->N; i++) {
+	memset(count, 0, sizeof(unsigned) * d->N);
+	for (unsigned i = 0; i < d->N; i++) {
 		if (d->active[i] >= 0) nActive++;
 	}
+	for (unsigned i = 0; i < d->M; i++) {
+		int s = getSlot(d, i);
+		if (s >= 0)
+			count[s]++;
+	}
+	return nActive;
+}
+
+// sqrt() without -lm (Newton)
+static double dsqrt(double x)
+{
+	if (x <= 0.0)
+		return 0.0;
+	double r = x > 1.0 ? x : 1.0;
+	for (int i = 0; i < 64; i++) {
+		double n = (r + x / r) / 2;
+		if (n >= r)
+			break;
+		r = n;
+	}
+	return r;
+}
+
+static uint64_t nsNow(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Record statistics for an update of m->lookup
+static void recordStats(struct MagDataDyn* d, unsigned changed, uint64_t ns)
+{
+	unsigned count[d->N];
+	unsigned nActive = countSlots(d, count);
+	unsigned min = nActive > 0 ? d->M : 0, max = 0;
+	double sum = 0.0, sum2 = 0.0;
+	for (unsigned i = 0; i < d->N; i++) {
+		if (d->active[i] < 0) continue;
+		if (count[i] < min) min = count[i];
+		if (count[i] > max) max = count[i];
+		sum += count[i];
+		sum2 += (double)count[i] * count[i];
+	}
+	struct MagDataDynStats* st = d->stats;
+	st->changed = changed;
+	st->active = nActive;
+	st->min = min;
+	st->max = max;
+	st->stddev = 0.0;
+	if (nActive > 0) {
+		double mean = sum / nActive;
+		st->stddev = dsqrt(sum2 / nActive - mean * mean);
+	}
+	st->duration = ns;
+}
+
+// The 64-bit finalizer from MurmurHash3
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/*
+  Rendezvous (highest random weight) hashing. Each slot goes to the
+  target with the highest score(slot, target). Rebuild is O(M * N) so
+  it's best for small N. Removing a target only moves it's own slots.
+  Weights are not used.
+ */
+static void hrwPopulate(struct MagDataDyn* d)
+{
+	memset(d->lookup, 0xff, d->M * d->width); /* All -1 */
+	unsigned order[d->N];
+	unsigned nActive = activeOrder(d, order);
 	if (nActive == 0) return;
+	uint64_t th[nActive];
+	for (unsigned k = 0; k < nActive; k++)
+		th[k] = (uint64_t)targetHash(d, order[k], 0) << 32
+			| targetHash(d, order[k], 1);
+	for (unsigned c = 0; c < d->M; c++) {
+		uint64_t sk = (c + 1) * 0x9e3779b97f4a7c15ULL, best = 0;
+		unsigned bk = 0;
+		for (unsigned k = 0; k < nActive; k++) {
+			uint64_t score = fmix64(th[k] ^ sk);
+			if (score > best) {
+				best = score;
+				bk = k;
+			}
+		}
+		setSlot(d, c, order[bk]);
+	}
+}
 
-	unsigned next[d->N], c = 0;
-	memset(next, 0, sizeof(next));
-	unsigned n = 0;
-	unsigned* row;
-	for (;;) {
-		for (int i = 0; i < d->N; i++) {
-			if (d->active[i] < 0) continue; /* Target not active */
-			row = d->permutation[i];
-			c = row[next[i]];
-			while (d->lookup[c] >= 0) {
-				next[i] = next[i] + 1;
-				c = row[next[i]];
+/*
+  Jump consistent hash (Lamping, Veach). Returns a bucket in [0,n).
+ */
+static unsigned jumpHash(uint64_t key, unsigned n)
+{
+	int64_t b = -1, j = 0;
+	while (j < n) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+	}
+	return b;
+}
+
+/*
+  Jump hash over all N indexes in active[]. A slot that hits an
+  inactive index is re-hashed until it hits an active one (as removed
+  buckets in AnchorHash). Removing a target only moves it's own slots
+  and a new target only takes slots. The target identity is the index
+  in active[], not the fwmark. Weights are not used.
+ */
+static void jumpPopulate(struct MagDataDyn* d)
+{
+	memset(d->lookup, 0xff, d->M * d->width); /* All -1 */
+	unsigned nActive = 0;
+	for (unsigned i = 0; i < d->N; i++) {
+		if (d->active[i] >= 0) nActive++;
+	}
+	if (nActive == 0) return;
+	for (unsigned c = 0; c < d->M; c++) {
+		uint64_t key = fmix64(((uint64_t)d->seed << 32) | c);
+		unsigned b = jumpHash(key, d->N);
+		while (d->active[b] < 0) {
+			key = fmix64(key + 1);
+			b = jumpHash(key, d->N);
+		}
+		setSlot(d, c, b);
+	}
+}
+
+static struct {
+	char const* name;
+	void (*populate)(struct MagDataDyn* d);
+} const engines[] = {
+	[MAGDYN_MAGLEV] = {"maglev", maglevPopulate},
+	[MAGDYN_HRW] = {"hrw", hrwPopulate},
+	[MAGDYN_JUMP] = {"jump", jumpPopulate},
+};
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+int magDataDyn_parseEngine(char const* name)
+{
+	for (unsigned e = 0; e < NENGINES; e++) {
+		if (strcmp(name, engines[e].name) == 0)
+			return e;
+	}
+	return -1;
+}
+char const* magDataDyn_engineName(unsigned engine)
+{
+	return engine < NENGINES ? engines[engine].name : NULL;
+}
+
+void magDataDyn_populate(struct MagDataDyn* d)
+{
+	unsigned len = d->M * d->width;
+	void* old = malloc(len);
+	if (old == NULL)
+		die("Out of mem\n");
+	memcpy(old, d->lookup, len);
+	uint64_t t0 = nsNow();
+	engines[d->engine].populate(d);
+	uint64_t ns = nsNow() - t0;
+	unsigned changed = 0;
+	for (unsigned i = 0; i < d->M; i++) {
+		if (magDataDyn_entry(old, d->width, i) != getSlot(d, i))
+			changed++;
+	}
+	free(old);
+	recordStats(d, changed, ns);
+}
+
+/*
+  Activate/deactivate for engines without an incremental update. The
+  engines are consistent so a re-populate only changes the slots of
+  the target.
+ */
+static unsigned repopulate(struct MagDataDyn* d, unsigned index, int fwmark)
+{
+	d->active[index] = fwmark;
+	magDataDyn_populate(d);
+	return d->stats->changed;
+}
+
+// The fair share of slots by weight for active targets, except "skip"
+static void computeShares(struct MagDataDyn* d, int skip, unsigned* share)
+{
+	uint64_t wsum = 0;
+	for (int i = 0; i < d->N; i++) {
+		if (i != skip && d->active[i] >= 0)
+			wsum += d->weight[i];
+	}
+	for (int i = 0; i < d->N; i++) {
+		share[i] = 0;
+		if (i != skip && d->active[i] >= 0 && wsum > 0)
+			share[i] = (uint64_t)d->M * d->weight[i] / wsum;
+	}
+}
+
+unsigned magDataDyn_activate(struct MagDataDyn* d, unsigned index, int fwmark)
+{
+	if (index >= d->N || fwmark < 0)
+		return 0;
+	if (d->active[index] >= 0) {
+		d->active[index] = fwmark; /* Just a new fwmark, lookup unchanged */
+		return 0;
+	}
+	if (d->engine != MAGDYN_MAGLEV)
+		return repopulate(d, index, fwmark);
+	uint64_t t0 = nsNow();
+	unsigned count[d->N], share[d->N];
+	countSlots(d, count);
+	d->active[index] = fwmark;	/* Before it's used in lookup */
+	setPermutation(d, index);
+	computeShares(d, -1, share);
+
+	/*
+	  The new target takes it's share, walking it's permutation. To
+	  keep the balance slots are first taken from targets above
+	  share+1, then from targets above their share. The first target
+	  takes all slots (share == M).
+	 */
+	unsigned changed = 0;
+	for (int above = 1; above >= 0; above--) {
+		unsigned c = d->offset[index];
+		for (unsigned j = 0; j < d->M && count[index] < share[index]; j++,
+				 c = nextSlot(d, index, c)) {
+			int owner = getSlot(d, c);
+			if (owner == index)
+				continue;
+			if (owner >= 0) {
+				if (count[owner] <= share[owner] + above)
+					continue;
+				count[owner]--;
 			}
-			d->lookup[c] = i;
-			next[i] = next[i] + 1;
-			n = n + 1;
-			if (n == d->M) return;
+			setSlot(d, c, index);
+			count[index]++;
+			changed++;
+		}
+	}
+	recordStats(d, changed, nsNow() - t0);
+	return changed;
+}
+
+unsigned magDataDyn_deactivate(struct MagDataDyn* d, unsigned index)
+{
+	if (index >= d->N || d->active[index] < 0)
+		return 0;
+	if (d->engine != MAGDYN_MAGLEV)
+		return repopulate(d, index, -1);
+	uint64_t t0 = nsNow();
+
+	// Collect the slots to re-assign
+	uint8_t* freed = calloc(d->M, 1);
+	if (freed == NULL)
+		die("Out of mem\n");
+	unsigned nfree = 0;
+	for (unsigned i = 0; i < d->M; i++) {
+		if (getSlot(d, i) == index) {
+			freed[i] = 1;
+			nfree++;
 		}
 	}
+
+	unsigned count[d->N], share[d->N];
+	unsigned nActive = countSlots(d, count) - 1;
+	computeShares(d, index, share);
+	unsigned changed = nfree;
+	if (nActive == 0) {
+		// The last target. Nothing to re-assign
+		for (unsigned i = 0; i < d->M; i++) {
+			if (freed[i])
+				setSlot(d, i, -1);
+		}
+		nfree = 0;
+	}
+
+	/*
+	  Round-robin as in populate, but only free slots are taken and
+	  only by targets below their share (+extra) to keep the balance.
+	 */
+	unsigned next[d->N];
+	memcpy(next, d->offset, sizeof(next));
+	unsigned extra = 0;
+	while (nfree > 0) {
+		unsigned taken = 0;
+		for (unsigned i = 0; i < d->N && nfree > 0; i++) {
+			if (i == index || d->active[i] < 0 || count[i] >= share[i] + extra)
+				continue;
+			unsigned c = next[i];
+			while (!freed[c])
+				c = nextSlot(d, i, c);
+			freed[c] = 0;
+			setSlot(d, c, i);
+			count[i]++;
+			next[i] = nextSlot(d, i, c);
+			nfree--;
+			taken++;
+		}
+		if (taken == 0)
+			extra++;
+	}
+	free(freed);
+	d->active[index] = -1;		/* After it's removed from lookup */
+	recordStats(d, changed, nsNow() - t0);
+	return changed;
+}
+
+/*
+  The format before the magic (format 1). The permutation table is
+  M*N unsigned and there are 3 unused unsigned at the end.
+ */
+struct MagDataDynV1 {
+	unsigned M, N;
+	unsigned len;
+	int lookup[];				/* [M], then permutation[N][M], active[N] */
+};
+static size_t v1Len(uint64_t M, uint64_t N)
+{
+	return sizeof(struct MagDataDynV1) + sizeof(unsigned) * (3 + M * N)
+		+ sizeof(int) * (M + N);
+}
+
+int magDataDyn_isV1(void const* mem, size_t len, unsigned* M, unsigned* N)
+{
+	struct MagDataDynV1 const* v1 = mem;
+	if (len < sizeof(*v1) || ((struct MagDataDynInternal const*)mem)->magic == MAGDYN_MAGIC)
+		return 0;
+	if (v1->M < 3 || v1->N == 0 || v1->N > v1->M)
+		return 0;
+	if (v1->len != v1Len(v1->M, v1->N) || v1->len > len)
+		return 0;
+	*M = v1->M;
+	*N = v1->N;
+	return 1;
+}
+
+void magDataDyn_convertV1(struct MagDataDyn* d, void const* mem)
+{
+	struct MagDataDynV1 const* v1 = mem;
+	if (v1->M != d->M || v1->N != d->N)
+		die("Maglev convert; M or N differs\n");
+	int const* active = v1->lookup + v1->M + (size_t)v1->M * v1->N;
+	for (unsigned i = 0; i < d->N; i++) {
+		d->active[i] = active[i];
+		d->weight[i] = 1;
+	}
+	for (unsigned i = 0; i < d->N; i++)
+		setPermutation(d, i);
+	for (unsigned i = 0; i < d->M; i++) {
+		int v = v1->lookup[i];
+		setSlot(d, i, v >= 0 && v < d->N && d->active[v] >= 0 ? v : -1);
+	}
+}
+
+uint32_t magDataDyn_checksum(struct MagDataDyn const* m)
+{
+	int* fw = malloc(m->M * sizeof(int));
+	if (fw == NULL)
+		die("Out of mem\n");
+	for (unsigned i = 0; i < m->M; i++) {
+		int s = magDataDyn_slot(m, i);
+		fw[i] = s < 0 ? -1 : m->active[s];
+	}
+	uint32_t sum = wy_hash((uint8_t const*)fw, m->M * sizeof(int), 0);
+	free(fw);
+	return sum;
+}
+
+uint32_t magDataDyn_populateChecksum(struct MagDataDyn const* m)
+{
+	struct MagDataDynInternal const* mi = (void const*)
+		((char const*)m->generation - offsetof(struct MagDataDynInternal, generation));
+	void* copy = malloc(mi->len);
+	if (copy == NULL)
+		die("Out of mem\n");
+	memcpy(copy, mi, mi->len);
+	struct MagDataDyn c;
+	magDataDyn_map(&c, copy);
+	magDataDyn_edit(&c);
+	magDataDyn_populate(&c);
+	uint32_t sum = magDataDyn_checksum(&c);
+	magDataDyn_free(&c);
+	free(copy);
+	return sum;
 }
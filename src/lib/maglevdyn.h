@@ -1,33 +1,255 @@
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  The lookup and active tables are double-buffered. Readers use the
+  buffer given by the generation (generation & 1). Writers update the
+  other buffer and publish it with an atomic generation increment. A
+  lookup is retried if the generation changes during the lookup, since
+  the next edit re-writes the buffer a slow reader may still use;
+
+    magDataDyn_map(&m, mem);
+    magDataDyn_edit(&m);       // m.lookup/m.active -> copy of current
+    ...update m.active, magDataDyn_populate(&m)...
+    magDataDyn_publish(&m);
+
+  Without magDataDyn_edit() the lookup/active pointers refer to the
+  current buffer (e.g. for printouts).
+ */
+/*
+  Statistics for the last update of the lookup table (populate or
+  incremental activate/deactivate). Slots are counted per active
+  target.
+ */
+struct MagDataDynStats {
+	unsigned changed;			/* Slots that changed owner */
+	unsigned active;			/* Active targets */
+	unsigned min, max;			/* Slots per target */
+	double stddev;
+	uint64_t duration;			/* ns */
+};
+
 struct MagDataDyn {
 	unsigned M, N;
-	int *lookup;
-	unsigned** permutation;
+	void* lookup;				/* Use magDataDyn_slot() */
+	unsigned* offset;			/* Permutation; (offset + j * skip) % M */
+	unsigned* skip;
+	unsigned* weight;			/* Used by populate, default 1 */
 	int* active;
+	unsigned* generation;
+	struct MagDataDynStats* stats;
+	void* lookupBuf[2];
+	int* activeBuf[2];
+	unsigned width;				/* Lookup entry size; 1, 2 or 4 bytes */
+	unsigned engine;			/* Populates the lookup table */
+	uint32_t seed;				/* For permutations */
+	uint64_t modM;				/* For fast modulo M */
 };
 
+/*
+  Consistent hash engines. All engines populate the same lookup table,
+  so the lookup (hot path) is the same for all of them;
+
+  maglev - Maglev (default). Weights and incremental updates
+  hrw - Rendezvous hashing. Slow rebuild for large N
+  jump - Jump hash over the indexes in active[]. Fast rebuild
+ */
+enum { MAGDYN_MAGLEV = 0, MAGDYN_HRW, MAGDYN_JUMP };
+// Returns the engine or -1 if unknown
+int magDataDyn_parseEngine(char const* name);
+// Returns NULL for an invalid engine
+char const* magDataDyn_engineName(unsigned engine);
+
+/*
+  The lookup entries are narrow (uint8_t for N < 255, uint16_t for
+  N < 65535) to keep the table in cache. All-ones is "no target".
+ */
+static inline int magDataDyn_entry(void const* lookup, unsigned width, unsigned i)
+{
+	unsigned v;
+	switch (width) {
+	case 1:
+		v = ((uint8_t const*)lookup)[i];
+		return v == UINT8_MAX ? -1 : (int)v;
+	case 2:
+		v = ((uint16_t const*)lookup)[i];
+		return v == UINT16_MAX ? -1 : (int)v;
+	default:
+		return ((int const*)lookup)[i];
+	}
+}
+// The target index in slot i in m->lookup, or -1
+static inline int magDataDyn_slot(struct MagDataDyn const* m, unsigned i)
+{
+	return magDataDyn_entry(m->lookup, m->width, i);
+}
+
+/*
+  hash % M without a division (Lemire, "Faster Remainder by Direct
+  Computation"). Exact for all 32-bit hash values.
+ */
+static inline unsigned magDataDyn_mod(struct MagDataDyn const* m, uint32_t hash)
+{
+	uint64_t low = m->modM * hash;
+	return ((__uint128_t)low * m->M) >> 64;
+}
+
+/*
+  Returns the fwmark (active) for a hash or -1. There are only two
+  buffers, so the buffer a reader uses is re-written by the second
+  magDataDyn_edit() after it was read. The lookup is retried if the
+  generation has changed meanwhile (as a seqlock).
+ */
+static inline int magDataDyn_lookup(struct MagDataDyn const* m, unsigned hash)
+{
+	unsigned g;
+	int fw;
+	do {
+		g = __atomic_load_n(m->generation, __ATOMIC_ACQUIRE);
+		int i = magDataDyn_entry(
+			m->lookupBuf[g & 1], m->width, magDataDyn_mod(m, hash));
+		fw = i < 0 ? -1 : m->activeBuf[g & 1][i];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(m->generation, __ATOMIC_RELAXED) != g);
+	return fw;
+}
+// As magDataDyn_lookup() but the index in the active table is also
+// returned in "index" (if a fwmark is returned)
+static inline int magDataDyn_lookupIndex(
+	struct MagDataDyn const* m, unsigned hash, unsigned* index)
+{
+	unsigned g;
+	int i, fw;
+	do {
+		g = __atomic_load_n(m->generation, __ATOMIC_ACQUIRE);
+		i = magDataDyn_entry(
+			m->lookupBuf[g & 1], m->width, magDataDyn_mod(m, hash));
+		fw = i < 0 ? -1 : m->activeBuf[g & 1][i];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(m->generation, __ATOMIC_RELAXED) != g);
+	if (i >= 0)
+		*index = i;
+	return fw;
+}
+// The fwmark on "index" in the current active table, or -1
+static inline int magDataDyn_activeAt(struct MagDataDyn const* m, unsigned index)
+{
+	if (index >= m->N)
+		return -1;
+	unsigned g;
+	int fw;
+	do {
+		g = __atomic_load_n(m->generation, __ATOMIC_ACQUIRE);
+		fw = m->activeBuf[g & 1][index];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(m->generation, __ATOMIC_RELAXED) != g);
+	return fw;
+}
+
 /*
   Returns the minimum length of memory.
+  width - Lookup entry size 1, 2 or 4 bytes. 0 - the smallest possible
  */
-unsigned magDataDyn_len(unsigned M, unsigned N);
+unsigned magDataDyn_len(unsigned M, unsigned N, unsigned width);
 
 /*
   M will be adjusted to a prime lower than the passed value if needed
-  and max 994009.
+  and max 994009. die() if the width can't hold N targets.
+
+  The permutations are derived from a hash of the fwmark with the
+  seed. Nodes with the same M, N, engine, seed and targets (and
+  weights) get the same lookup table on a populate. For the "jump"
+  engine the targets must also have the same index in active[].
 
   Prerequisite; mem allocated and len >= returned by magDataDyn_len()
  */
-void magDataDyn_init(unsigned M, unsigned N, void* mem, unsigned len);
+void magDataDyn_init(
+	unsigned M, unsigned N, unsigned width, unsigned engine, uint32_t seed,
+	void* mem, unsigned len);
+
+// The j'th entry in the permutation for target i
+static inline unsigned magDataDyn_permutation(
+	struct MagDataDyn const* m, unsigned i, unsigned j)
+{
+	return (m->offset[i] + (uint64_t)j * m->skip[i]) % m->M;
+}
 
 /*
-  Map to a memory area that may be in shared mem.
+  Map to a memory area that may be in shared mem. die() if the format
+  is incompatible (created by an older nfqlb). magDataDyn_tryMap()
+  returns -1 instead, for programs that must keep running.
   Must call magDataDyn_free() to free allocated memory.
  */
 void magDataDyn_map(struct MagDataDyn* m, void* mem);
+int magDataDyn_tryMap(struct MagDataDyn* m, void* mem);
 void magDataDyn_free(struct MagDataDyn* m);
 
 /*
-  Call when the "active" array is updated
+  Shared memory created by nfqlb before the format was versioned
+  (format 1) has a stored permutation table. magDataDyn_isV1() returns
+  1 and the M and N if "mem" (of "len" bytes) is in format 1.
+  magDataDyn_convertV1() copies the active targets and the lookup
+  table from format 1 to "m", which must be initiated with the same M
+  and N. The lookup table is kept as is, so no traffic moves. The
+  permutations are computed as for a new target, so the next populate
+  may move more slots than usual.
+ */
+int magDataDyn_isV1(void const* mem, size_t len, unsigned* M, unsigned* N);
+void magDataDyn_convertV1(struct MagDataDyn* m, void const* mem);
+
+/*
+  Call when the "active" or "weight" arrays are updated. Targets get a
+  share of the lookup slots proportional to their weight (maglev).
  */
 void magDataDyn_populate(struct MagDataDyn* m);
+
+/*
+  Copy the current tables to the other buffer and point lookup/active
+  to it. The copy is published with magDataDyn_publish(), which
+  returns the new generation. Only one writer is allowed at the time.
+ */
+void magDataDyn_edit(struct MagDataDyn* m);
+unsigned magDataDyn_publish(struct MagDataDyn* m);
+unsigned magDataDyn_generation(struct MagDataDyn const* m);
+
+/*
+  Incremental populate on a single target change. Only the affected
+  slots are updated and the lookup table is never cleared, so a reader
+  always finds a target (minimal disruption);
+
+  activate - The target takes it's share by weight, walking it's
+    permutation and only taking slots from targets above their share.
+  deactivate - The slots of the target are given to the remaining
+    targets in round-robin, each picking by it's permutation.
+
+  The active[] entry is set (or cleared) by the functions in the right
+  order. The weight[] must be set before activate. The result is
+  balanced (+-1 slot from the share) but may differ from
+  magDataDyn_populate() since it depends on the history. Incremental
+  updates can NOT be combined with consistency between nodes, use
+  magDataDyn_populateChecksum() to detect it.
+
+  Other engines than maglev re-populate, which only changes the slots
+  of the target since they are consistent.
+
+  Returns the number of changed slots in lookup.
+ */
+unsigned magDataDyn_activate(struct MagDataDyn* m, unsigned index, int fwmark);
+unsigned magDataDyn_deactivate(struct MagDataDyn* m, unsigned index);
+
+/*
+  A checksum of the fwmark in each slot in m->lookup. It does not
+  depend on the index in active[] or the entry width and can be
+  compared between nodes.
+ */
+uint32_t magDataDyn_checksum(struct MagDataDyn const* m);
+
+/*
+  The checksum the lookup table would get after a full populate with
+  the current targets (computed on a copy). It differs from
+  magDataDyn_checksum() after incremental updates that gave another
+  table, which is then not consistent with other nodes.
+ */
+uint32_t magDataDyn_populateChecksum(struct MagDataDyn const* m);
@@ -1,4 +1,7 @@
+#define _GNU_SOURCE				/* (for recvmmsg) */
 #include "nfqueue.h"
+#include <shmem.h>
+#include <die.h>
 
 /* ----------------------------------------------------------------------
    The NFQUEUE code is taken from the example in;
@@ -9,14 +12,41 @@
 #include <libmnl/libmnl.h>
 #include <linux/netfilter.h>
 #include <libnetfilter_queue/libnetfilter_queue.h>
-/* only for NFQA_CT, not needed otherwise:
+/* only for NFQA_CT: */
 #include <linux/netfilter/nfnetlink_conntrack.h>
-*/
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 static packetHandleFn_t handlePacket = NULL;
 static unsigned queue_length = 1024;
 static unsigned mtu = 1500;
+static unsigned verdict_batch = 0;
+static unsigned recv_batch = 0;
+static unsigned copy_range = 0;
+static int ct_mark = 0;
+static struct nfqueueStats* stats = NULL;
+static unsigned first_queue = 0;
+
+/*
+  Per-queue (thread) data passed to the callback.
+ */
+struct QueueData {
+	struct mnl_socket* nl;
+	struct nfqueueCounters* cnt;
+	struct mnl_nlmsg_batch* batch;
+	/* Current group of packets with the same verdict and fwmark */
+	unsigned pending;
+	uint32_t id;
+	uint32_t mark;
+	uint32_t verdict;
+	uint16_t queue_num;
+	unsigned packets;			/* Packets in this batch */
+};
+static struct nfqueueCounters dummyCounters;
+/* Room for a verdict message with a mark (40 byte) */
+#define VERDICT_MSG_SIZE 64
 
 void nfqueueInit(
 	packetHandleFn_t packetHandleFn, unsigned _queue_length, unsigned _mtu)
@@ -26,6 +56,36 @@ void nfqueueInit(
 	mtu = _mtu;
 }
 
+void nfqueueSetCopyRange(unsigned copyRange)
+{
+	copy_range = copyRange;
+}
+
+void nfqueueSetConntrackMark(int enable)
+{
+	ct_mark = enable;
+}
+
+void nfqueueSetVerdictBatch(unsigned maxBatch)
+{
+	verdict_batch = maxBatch;
+}
+
+void nfqueueSetRecvBatch(unsigned maxDatagrams)
+{
+	recv_batch = maxDatagrams;
+}
+
+void nfqueueUseStats(
+	struct nfqueueStats* _stats, unsigned firstQueue, unsigned nQueues)
+{
+	stats = _stats;
+	first_queue = firstQueue;
+	stats->nQueues = nQueues;
+	for (unsigned i = 0; i < nQueues; i++)
+		stats->q[i].queue = firstQueue + i;
+}
+
 
 static struct nlmsghdr *
 nfq_hdr_put(char *buf, int type, uint32_t queue_num)
@@ -42,10 +102,22 @@ nfq_hdr_put(char *buf, int type, uint32_t queue_num)
 	return nlh;
 }
 
+/*
+  Set the conntrack mark. NFQA_CT is not allowed in a
+  NFQNL_MSG_VERDICT_BATCH so it must be a NFQNL_MSG_VERDICT.
+ */
+static void nfq_verdict_put_ctmark(struct nlmsghdr *nlh, uint32_t mark)
+{
+	struct nlattr *nest;
+	nest = mnl_attr_nest_start(nlh, NFQA_CT);
+	mnl_attr_put_u32(nlh, CTA_MARK, htonl(mark));
+	mnl_attr_nest_end(nlh, nest);
+}
+
 static void
 nfq_send_verdict(
 	struct mnl_socket *nl, int queue_num, uint32_t id,
-	uint32_t mark, uint32_t verdict)
+	uint32_t mark, uint32_t verdict, int setCtMark)
 {
 	char buf[MNL_SOCKET_BUFFER_SIZE];
 	struct nlmsghdr *nlh;
@@ -53,22 +125,196 @@ nfq_send_verdict(
 	nlh = nfq_hdr_put(buf, NFQNL_MSG_VERDICT, queue_num);
 	nfq_nlmsg_verdict_put(nlh, id, verdict);
 	nfq_nlmsg_verdict_put_mark(nlh, mark);
-#if 0
-	struct nlattr *nest;
-	/* example to set the connmark. First, start NFQA_CT section: */
-	nest = mnl_attr_nest_start(nlh, NFQA_CT);
+	if (setCtMark)
+		nfq_verdict_put_ctmark(nlh, mark);
+	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
+		perror("mnl_socket_send");
+		exit(EXIT_FAILURE);
+	}
+}
 
-	/* then, add the connmark attribute: */
-	mnl_attr_put_u32(nlh, CTA_MARK, htonl(42));
-	/* more conntrack attributes, e.g. CTA_LABEL, could be set here */
+static int ctmark_cb(const struct nlattr *attr, void *data)
+{
+	if (mnl_attr_get_type(attr) == CTA_MARK &&
+		mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+		*(uint32_t*)data = ntohl(mnl_attr_get_u32(attr));
+	return MNL_CB_OK;
+}
+/*
+  Check if the conntrack mark shall be set to the fwmark. Returns
+  non-zero if it shall. Requires NFQA_CFG_F_CONNTRACK.
+ */
+static int shallSetCtMark(
+	struct QueueData* q, struct nlattr const* ct, uint32_t mark)
+{
+	if (ct == NULL) {
+		/* Untracked packet, or conntrack not loaded */
+		q->cnt->ctUntracked++;
+		return 0;
+	}
+	uint32_t current = 0;
+	mnl_attr_parse_nested(ct, ctmark_cb, &current);
+	if (current == mark)
+		return 0;				/* Already offloaded */
+	q->cnt->ctMarks++;
+	return 1;
+}
 
-	/* end conntrack section */
-	mnl_attr_nest_end(nlh, nest);
-#endif
-	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
+/*
+  Batched verdicts. A NFQNL_MSG_VERDICT_BATCH applies to all queued
+  packets with id <= the passed id, so a group of consecutive packets
+  with the same verdict and fwmark needs only one message. Messages
+  are collected in a mnl batch and sent in one system call.
+ */
+static void verdictBatchSend(struct QueueData* q)
+{
+	if (mnl_nlmsg_batch_is_empty(q->batch))
+		return;
+	if (mnl_socket_sendto(
+			q->nl, mnl_nlmsg_batch_head(q->batch),
+			mnl_nlmsg_batch_size(q->batch)) < 0) {
 		perror("mnl_socket_send");
 		exit(EXIT_FAILURE);
 	}
+	q->cnt->verdictCalls++;
+	if (q->packets > q->cnt->verdictBatchMax)
+		q->cnt->verdictBatchMax = q->packets;
+	q->packets = 0;
+	mnl_nlmsg_batch_reset(q->batch);
+}
+static void verdictBatchNext(struct QueueData* q)
+{
+	if (!mnl_nlmsg_batch_next(q->batch)) {
+		/* The batch buffer is full. The last message is moved to the
+		 * head on reset. Should not happen since the buffer is
+		 * dimensioned for verdict_batch messages */
+		verdictBatchSend(q);
+	}
+}
+static void verdictBatchPut(struct QueueData* q)
+{
+	if (q->pending == 0)
+		return;
+	struct nlmsghdr *nlh = nfq_hdr_put(
+		mnl_nlmsg_batch_current(q->batch), NFQNL_MSG_VERDICT_BATCH,
+		q->queue_num);
+	nfq_nlmsg_verdict_put(nlh, q->id, q->verdict);
+	nfq_nlmsg_verdict_put_mark(nlh, q->mark);
+	q->cnt->verdictMsgs++;
+	q->packets += q->pending;
+	q->pending = 0;
+	verdictBatchNext(q);
+}
+static void verdictBatchAdd(
+	struct QueueData* q, uint16_t queue_num, uint32_t id,
+	uint32_t mark, uint32_t verdict, int setCtMark)
+{
+	if (setCtMark) {
+		/* Needs a message of its own. Keep the order */
+		verdictBatchPut(q);
+		struct nlmsghdr *nlh = nfq_hdr_put(
+			mnl_nlmsg_batch_current(q->batch), NFQNL_MSG_VERDICT, queue_num);
+		nfq_nlmsg_verdict_put(nlh, id, verdict);
+		nfq_nlmsg_verdict_put_mark(nlh, mark);
+		nfq_verdict_put_ctmark(nlh, mark);
+		q->cnt->verdictMsgs++;
+		q->packets++;
+		verdictBatchNext(q);
+		return;
+	}
+	if (q->pending > 0 && q->verdict == verdict && q->mark == mark) {
+		q->id = id;
+		q->pending++;
+		return;
+	}
+	verdictBatchPut(q);
+	q->queue_num = queue_num;
+	q->id = id;
+	q->mark = mark;
+	q->verdict = verdict;
+	q->pending = 1;
+}
+static void verdictBatchFlush(struct QueueData* q)
+{
+	verdictBatchPut(q);
+	verdictBatchSend(q);
+}
+
+/*
+  Receive buffers. With recvmmsg() a ring of buffers is used and
+  several netlink datagrams (one per packet) are read in one system
+  call.
+ */
+struct RecvRing {
+	unsigned n;					/* Number of buffers */
+	size_t size;				/* Size of each buffer */
+	char* mem;
+	struct mmsghdr* msgs;
+	struct iovec* iov;
+};
+static void recvRingInit(struct RecvRing* r, unsigned n, size_t size)
+{
+	r->n = n;
+	r->size = size;
+	r->mem = malloc(n * size);
+	r->msgs = calloc(n, sizeof(struct mmsghdr));
+	r->iov = calloc(n, sizeof(struct iovec));
+	if (r->mem == NULL || r->msgs == NULL || r->iov == NULL) {
+		perror("allocate receive buffers");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned i = 0; i < n; i++) {
+		r->iov[i].iov_base = r->mem + i * size;
+		r->iov[i].iov_len = size;
+		r->msgs[i].msg_hdr.msg_iov = &r->iov[i];
+		r->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+static void recvRingFree(struct RecvRing* r)
+{
+	free(r->mem);
+	free(r->msgs);
+	free(r->iov);
+}
+/*
+  Receive datagrams into the ring. Blocks until at least one datagram
+  is received unless MSG_DONTWAIT is passed.
+  Returns the number of received datagrams, 0 if none is available.
+ */
+static unsigned recvRingRead(
+	struct RecvRing* r, struct mnl_socket* nl, int flags)
+{
+	int ret;
+	if (r->n == 1) {
+		if (flags == 0)
+			ret = mnl_socket_recvfrom(nl, r->mem, r->size);
+		else
+			ret = recv(mnl_socket_get_fd(nl), r->mem, r->size, flags);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			perror("mnl_socket_recvfrom");
+			exit(EXIT_FAILURE);
+		}
+		r->msgs[0].msg_len = ret;
+		return 1;
+	}
+
+	ret = recvmmsg(
+		mnl_socket_get_fd(nl), r->msgs, r->n, flags | MSG_WAITFORONE, NULL);
+	if (ret == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		perror("recvmmsg");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned i = 0; i < ret; i++) {
+		if (r->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			fputs("recvmmsg: truncated datagram\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	return ret;
 }
 
 static int queue_cb(const struct nlmsghdr *nlh, void *data)
@@ -95,13 +341,35 @@ static int queue_cb(const struct nlmsghdr *nlh, void *data)
 
 	plen = mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]);
 	id = ntohl(ph->packet_id);
+	/* NFQA_CAP_LEN is only present if the packet is truncated */
+	unsigned origlen = plen;
+	if (attr[NFQA_CAP_LEN] != NULL)
+		origlen = ntohl(mnl_attr_get_u32(attr[NFQA_CAP_LEN]));
 
+	struct QueueData* q = data;
+	q->cnt->packets++;
 	uint8_t *payload = mnl_attr_get_payload(attr[NFQA_PAYLOAD]);
-	int fwmark = handlePacket(ntohs(ph->hw_protocol), payload, plen);
-	if (fwmark < 0) 
-		nfq_send_verdict(data, ntohs(nfg->res_id), id, 0, NF_DROP);
-	else
-		nfq_send_verdict(data, ntohs(nfg->res_id), id, fwmark, NF_ACCEPT);
+	int fwmark = handlePacket(
+		ntohs(ph->hw_protocol), payload, plen, origlen);
+	uint32_t verdict = NF_ACCEPT;
+	if (fwmark < 0) {
+		fwmark = 0;
+		verdict = NF_DROP;
+	}
+	int setCtMark = 0;
+	if (ct_mark && fwmark != 0)
+		setCtMark = shallSetCtMark(q, attr[NFQA_CT], fwmark);
+	if (q->batch != NULL) {
+		verdictBatchAdd(
+			q, ntohs(nfg->res_id), id, fwmark, verdict, setCtMark);
+	} else {
+		nfq_send_verdict(
+			q->nl, ntohs(nfg->res_id), id, fwmark, verdict, setCtMark);
+		q->cnt->verdictMsgs++;
+		q->cnt->verdictCalls++;
+		if (q->cnt->verdictBatchMax == 0)
+			q->cnt->verdictBatchMax = 1;
+	}
 
 	return MNL_CB_OK;
 }
@@ -109,8 +377,11 @@ static int queue_cb(const struct nlmsghdr *nlh, void *data)
 int nfqueueRun(unsigned int queue_num)
 {
 	char *buf;
+	unsigned copy = mtu;
+	if (copy_range > 0 && copy_range < mtu)
+		copy = copy_range;
 	/* largest copied packet payload, plus netlink data overhead: */
-	size_t sizeof_buf = mtu + (MNL_SOCKET_BUFFER_SIZE/2);
+	size_t sizeof_buf = copy + (MNL_SOCKET_BUFFER_SIZE/2);
 	unsigned int portid;
 	int ret;
 	struct nlmsghdr *nlh;
@@ -118,6 +389,10 @@ int nfqueueRun(unsigned int queue_num)
 
 	if (handlePacket == NULL)
 		exit(EXIT_FAILURE);
+	/* There can't be more datagrams than queued packets */
+	unsigned nrecv = recv_batch;
+	if (nrecv > queue_length)
+		nrecv = queue_length;
 
 	nl = mnl_socket_open(NETLINK_NETFILTER);
 	if (nl == NULL) {
@@ -162,10 +437,13 @@ int nfqueueRun(unsigned int queue_num)
 	}
 
 	nlh = nfq_hdr_put(buf, NFQNL_MSG_CONFIG, queue_num);
-	nfq_nlmsg_cfg_put_params(nlh, NFQNL_COPY_PACKET, mtu);
+	nfq_nlmsg_cfg_put_params(nlh, NFQNL_COPY_PACKET, copy);
 
-	mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(NFQA_CFG_F_GSO));
-	mnl_attr_put_u32(nlh, NFQA_CFG_MASK, htonl(NFQA_CFG_F_GSO));
+	uint32_t cfgflags = NFQA_CFG_F_GSO;
+	if (ct_mark)
+		cfgflags |= NFQA_CFG_F_CONNTRACK;
+	mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(cfgflags));
+	mnl_attr_put_u32(nlh, NFQA_CFG_MASK, htonl(cfgflags));
 
 	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
 		perror("mnl_socket_send");
@@ -201,26 +479,113 @@ int nfqueueRun(unsigned int queue_num)
 		}
 		getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &n, &socklen);
 		printf(
-			"queue_length=%u, mtu=%u, SO_RCVBUF=%u (%u)\n",
-			queue_length, mtu, n, newsize);
+			"queue_length=%u, mtu=%u, copy=%u, SO_RCVBUF=%u (%u), recv_batch=%u\n",
+			queue_length, mtu, copy, n, newsize, nrecv);
 	} else {
 		printf("getsockopt failed\n");
 	}
 
-	for (;;) {
-		ret = mnl_socket_recvfrom(nl, buf, sizeof_buf);
-		if (ret == -1) {
-			perror("mnl_socket_recvfrom");
-			exit(EXIT_FAILURE);
-		}
-		ret = mnl_cb_run(buf, ret, 0, portid, queue_cb, nl);
-		if (ret < 0){
-			perror("mnl_cb_run");
+	struct QueueData q = {0};
+	q.nl = nl;
+	q.cnt = &dummyCounters;
+	if (stats != NULL && queue_num >= first_queue &&
+		(queue_num - first_queue) < stats->nQueues)
+		q.cnt = &stats->q[queue_num - first_queue];
+	char* batchbuf = NULL;
+	if (verdict_batch > 0) {
+		/* mnl_nlmsg_batch requires a buffer twice the limit */
+		size_t limit = (verdict_batch + nrecv + 1) * VERDICT_MSG_SIZE;
+		batchbuf = malloc(limit * 2);
+		if (!batchbuf) {
+			perror("allocate batch buffer");
 			exit(EXIT_FAILURE);
 		}
+		q.batch = mnl_nlmsg_batch_start(batchbuf, limit);
+	}
+
+	/*
+	  The kernel sends one netlink message per packet. With batched
+	  verdicts, handle packets already in the socket buffer (don't
+	  block) and send all verdicts in one call.
+	 */
+	struct RecvRing r;
+	recvRingInit(&r, nrecv > 1 ? nrecv : 1, sizeof_buf);
+	for (;;) {
+		unsigned npkt = 0;
+		int flags = 0;
+		do {
+			unsigned cnt = recvRingRead(&r, nl, flags);
+			if (cnt == 0)
+				break;
+			q.cnt->recvCalls++;
+			for (unsigned i = 0; i < cnt; i++) {
+				ret = mnl_cb_run(
+					r.iov[i].iov_base, r.msgs[i].msg_len, 0, portid,
+					queue_cb, &q);
+				if (ret < 0){
+					/* An async error for the queue config */
+					if (ct_mark && errno == EOPNOTSUPP)
+						fputs("Conntrack not supported in nfqueue "
+							  "(NETFILTER_NETLINK_GLUE_CT)\n", stderr);
+					perror("mnl_cb_run");
+					exit(EXIT_FAILURE);
+				}
+			}
+			npkt += cnt;
+			flags = MSG_DONTWAIT;
+		} while (q.batch != NULL && npkt < verdict_batch);
+		if (q.batch != NULL)
+			verdictBatchFlush(&q);
 	}
 
 	/* We will never get here */
+	recvRingFree(&r);
+	if (q.batch != NULL)
+		mnl_nlmsg_batch_stop(q.batch);
+	free(batchbuf);
+	free(buf);
 	mnl_socket_close(nl);
 	return 0;
 }
+
+void nfqueuePrintStats(struct nfqueueStats const* stats)
+{
+	printf("[\n");
+	for (unsigned i = 0; i < stats->nQueues; i++) {
+		struct nfqueueCounters const* c = stats->q + i;
+		double perCall = 0.0, perRecv = 0.0;
+		if (c->verdictCalls > 0)
+			perCall = (double)c->packets / (double)c->verdictCalls;
+		if (c->recvCalls > 0)
+			perRecv = (double)c->packets / (double)c->recvCalls;
+		printf(
+			"  {\n"
+			"    \"queue\":           %u,\n"
+			"    \"packets\":         %lu,\n"
+			"    \"recvCalls\":       %lu,\n"
+			"    \"packetsPerRecv\":  %.2f,\n"
+			"    \"verdictMsgs\":     %lu,\n"
+			"    \"verdictCalls\":    %lu,\n"
+			"    \"packetsPerCall\":  %.2f,\n"
+			"    \"verdictBatchMax\": %u,\n"
+			"    \"ctMarks\":         %lu,\n"
+			"    \"ctUntracked\":     %lu\n"
+			"  }%s\n",
+			c->queue, (unsigned long)c->packets,
+			(unsigned long)c->recvCalls, perRecv,
+			(unsigned long)c->verdictMsgs, (unsigned long)c->verdictCalls,
+			perCall, c->verdictBatchMax,
+			(unsigned long)c->ctMarks, (unsigned long)c->ctUntracked,
+			(i + 1) < stats->nQueues ? "," : "");
+	}
+	printf("]\n");
+}
+
+struct SharedData* mapTargetShmOrDie(char const* name, int mode)
+{
+	struct SharedData* s = mapSharedDataOrDie(name, mode);
+	if (s->magic != SHARED_DATA_MAGIC)
+		die("Incompatible shm format in %s. Convert with 'nfqlb init --convert'\n",
+			name);
+	return s;
+}
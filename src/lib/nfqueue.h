@@ -1,16 +1,97 @@
 #pragma once
 #include <conntrack.h>
 
+/*
+  The target shm. The format 1 had only the ownFwmark, which is kept
+  first so an old shm can be converted. The magic is checked on map
+  so a shm in another format is detected rather than read as garbage.
+ */
+#define SHARED_DATA_MAGIC 0x53440002	/* "SD" format 2 */
 struct SharedData {
 	int ownFwmark;
-	unsigned char mem[];
+	unsigned magic;				/* SHARED_DATA_MAGIC */
+	unsigned hashFn;			/* HASH_* in hash.h */
+	uint32_t hashSeed;
+	unsigned hugepages;			/* SHM_HUGE_* in shmem.h */
+	unsigned char mem[] __attribute__ ((aligned (8)));
 };
 
 extern char const* const defaultTargetShm;
+// Map a target shm and check the format. Dies on failure
+struct SharedData* mapTargetShmOrDie(char const* name, int mode);
 
+/*
+  The packet handler. The payload may be truncated to the copy range
+  (see nfqueueSetCopyRange) so plen may be less than origlen, the
+  length of the packet in the kernel.
+ */
 typedef int (*packetHandleFn_t)(
-	unsigned short proto, void* payload, unsigned plen);
+	unsigned short proto, void* payload, unsigned plen, unsigned origlen);
 void nfqueueInit(
 	packetHandleFn_t packetHandleFn, unsigned queue_length, unsigned mtu);
 int nfqueueRun(unsigned int queue_num); /* Will not return */
 
+/*
+  Copy only the first copyRange bytes of packets to user-space. This
+  is enough for load-balancing (L3/L4 headers) but must not be used if
+  fragments are stored or reassembled. Must be called before
+  nfqueueRun(). copyRange=0 (default) copy the whole packet (mtu).
+ */
+void nfqueueSetCopyRange(unsigned copyRange);
+
+/*
+  Write the fwmark to the conntrack mark (CTA_MARK) in the verdict
+  message. Queues are configured with NFQA_CFG_F_CONNTRACK and the
+  mark is only written if it differs from the current conntrack
+  mark. With a ruleset that restores the conntrack mark, subsequent
+  packets in the flow will bypass the queue. Requires the
+  nf_conntrack_netlink module. Must be called before nfqueueRun().
+ */
+void nfqueueSetConntrackMark(int enable);
+
+/*
+  Batched verdicts. When maxBatch > 0 verdicts are not sent per
+  packet. Instead all packets that can be read from the socket without
+  blocking (max maxBatch) are handled, consecutive packets with the
+  same verdict and fwmark are grouped in a NFQNL_MSG_VERDICT_BATCH
+  message and all messages are sent in one system call.
+  Must be called before nfqueueRun(). maxBatch=0 (default) disables.
+ */
+void nfqueueSetVerdictBatch(unsigned maxBatch);
+
+/*
+  Receive up to maxDatagrams netlink datagrams (one per packet) in one
+  recvmmsg() system call. A ring of maxDatagrams buffers, each of
+  mtu + netlink overhead size, is allocated per queue. maxDatagrams is
+  limited to queue_length. Must be called before nfqueueRun().
+  maxDatagrams=0 (default) use one recv per packet.
+ */
+void nfqueueSetRecvBatch(unsigned maxDatagrams);
+
+/*
+  Per-queue counters. Each queue thread only updates its own entry.
+ */
+struct nfqueueCounters {
+	unsigned queue;
+	uint64_t packets;			/* Received packets */
+	uint64_t recvCalls;			/* System calls used to receive packets */
+	uint64_t verdictMsgs;		/* Verdict messages (batch or single) */
+	uint64_t verdictCalls;		/* System calls used to send verdicts */
+	unsigned verdictBatchMax;	/* Max packets covered by one call */
+	uint64_t ctMarks;			/* Conntrack marks set (offloaded flows) */
+	uint64_t ctUntracked;		/* Packets without conntrack (not offloaded) */
+};
+struct nfqueueStats {
+	unsigned nQueues;
+	struct nfqueueCounters q[];	/* Actual size nQueues */
+};
+#define NFQUEUE_STATS_LEN(n) \
+	(sizeof(struct nfqueueStats) + (n) * sizeof(struct nfqueueCounters))
+
+/*
+  Use the passed stats for the queues firstQueue..(firstQueue+nQueues-1).
+  The stats may be in shared mem. Must be called before nfqueueRun().
+ */
+void nfqueueUseStats(
+	struct nfqueueStats* stats, unsigned firstQueue, unsigned nQueues);
+void nfqueuePrintStats(struct nfqueueStats const* stats);
@@ -10,6 +10,9 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <limits.h>
+#include <mntent.h>
 
 // https://stackoverflow.com/questions/32683086/handling-incomplete-write-calls
 // Modified to make a short delay between retries and return bytes written
@@ -35,8 +38,19 @@ write_full(int fd, const void* buf, size_t size)
 	return size;
 }
 
+static void hugetlbPath(char const* name, char* path)
+{
+	while (*name == '/')
+		name++;
+	snprintf(path, PATH_MAX, "%s/%s", HUGETLBFS_DIR, name);
+}
+
 int createSharedData(char const* name, void* data, size_t len)
 {
+	// Remove a stale hugetlbfs file, it would be mapped if the shm is deleted
+	char path[PATH_MAX];
+	hugetlbPath(name, path);
+	(void)unlink(path);
 	int fd = shm_open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
 	if (fd < 0) return fd;
 	int c = write_full(fd, data, len);
@@ -51,9 +65,106 @@ void createSharedDataOrDie(char const* name, void* data, size_t len)
 		die("createSharedData: %s\n", strerror(errno));
 	}
 }
-void* mapSharedData(char const* name, int mode)
+/*
+  Huge pages. A hugetlbfs file is used if no shm is found, so mappers
+  don't have to know how the shm was created. A shm with a size that
+  is a multiple of the huge page size is advised for THP.
+ */
+static int openShm(char const* name, int mode)
 {
 	int fd = shm_open(name, mode, (mode == O_RDONLY)?0400:0600);
+	if (fd < 0 && errno == ENOENT) {
+		char path[PATH_MAX];
+		hugetlbPath(name, path);
+		fd = open(path, mode);
+		if (fd < 0)
+			errno = ENOENT;
+	}
+	return fd;
+}
+static void adviseHuge(void* m, size_t len)
+{
+	if (len >= HUGE_PAGE_SIZE && len % HUGE_PAGE_SIZE == 0)
+		(void)madvise(m, len, MADV_HUGEPAGE); /* EINVAL on hugetlbfs */
+}
+// THP for shm requires the "huge=" option on the /dev/shm tmpfs mount
+static int thpShmemEnabled(void)
+{
+	FILE* f = setmntent("/proc/mounts", "r");
+	if (f == NULL)
+		return 0;
+	int enabled = 0;
+	struct mntent* ent;
+	while ((ent = getmntent(f)) != NULL) {
+		if (strcmp(ent->mnt_dir, "/dev/shm") != 0)
+			continue;
+		char const* opt = hasmntopt(ent, "huge");
+		enabled = opt != NULL && strncmp(opt, "huge=never", 10) != 0
+			&& strncmp(opt, "huge=deny", 9) != 0;
+	}
+	endmntent(f);
+	return enabled;
+}
+// Create an fd of len bytes (rounded to huge pages) with data in it
+static int writeHuge(int fd, void* data, size_t len, int advise)
+{
+	size_t hlen = (len + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	if (ftruncate(fd, hlen) != 0)
+		return -1;
+	void* m = mmap(NULL, hlen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED)
+		return -1;
+	if (advise && madvise(m, hlen, MADV_HUGEPAGE) != 0) {
+		munmap(m, hlen);
+		return -1;
+	}
+	memcpy(m, data, len);
+	munmap(m, hlen);
+	return 0;
+}
+int createSharedDataHuge(char const* name, void* data, size_t len, int huge)
+{
+	char path[PATH_MAX];
+	hugetlbPath(name, path);
+	(void)unlink(path);
+	if (huge == SHM_HUGE_TLB) {
+		int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+		if (fd >= 0) {
+			int rc = writeHuge(fd, data, len, 0);
+			close(fd);
+			if (rc == 0) {
+				(void)shm_unlink(name);
+				return SHM_HUGE_TLB;
+			}
+			(void)unlink(path);
+		}
+		huge = SHM_HUGE_THP;
+	}
+	if (huge == SHM_HUGE_THP && thpShmemEnabled()) {
+		int fd = shm_open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+		if (fd < 0) return fd;
+		int rc = writeHuge(fd, data, len, 1);
+		close(fd);
+		if (rc == 0)
+			return SHM_HUGE_THP;
+	}
+	int rc = createSharedData(name, data, len);
+	return rc == 0 ? SHM_HUGE_NO : rc;
+}
+int deleteSharedData(char const* name)
+{
+	char path[PATH_MAX];
+	hugetlbPath(name, path);
+	// Both may exist, e.g. if a shm is re-created without huge pages
+	int rc = unlink(path);
+	if (shm_unlink(name) == 0)
+		return 0;
+	return rc == 0 ? 0 : -1;
+}
+
+void* mapSharedData(char const* name, int mode)
+{
+	int fd = openShm(name, mode);
 	if (fd < 0)
 		return NULL;
 	struct stat statbuf;
@@ -66,6 +177,7 @@ void* mapSharedData(char const* name, int mode)
 		close(fd);
 		return NULL;
 	}
+	adviseHuge(m, statbuf.st_size);
 	return m;
 }
 void* mapSharedDataOrDie(char const* name, int mode)
@@ -77,7 +189,7 @@ void* mapSharedDataOrDie(char const* name, int mode)
 }
 void* mapSharedDataRead(char const* name, /*out*/int* _fd)
 {
-	int fd = shm_open(name, O_RDONLY, 0400);
+	int fd = openShm(name, O_RDONLY);
 	if (fd < 0)
 		return NULL;
 	struct stat statbuf;
@@ -88,6 +200,7 @@ void* mapSharedDataRead(char const* name, /*out*/int* _fd)
 		close(fd);
 		return NULL;
 	}
+	adviseHuge(m, statbuf.st_size);
 	*_fd = fd;
 	return m;
 
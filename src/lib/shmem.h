@@ -13,3 +13,25 @@ void* mapSharedData(char const* name, int mode);
 void* mapSharedDataOrDie(char const* name, int mode);
 void* mapSharedDataRead(char const* name, /*out*/int* fd);
 
+/*
+  Huge page backed shared data;
+  SHM_HUGE_TLB - A file in hugetlbfs (HUGETLBFS_DIR). Requires free
+    huge pages (e.g. "echo 64 > /proc/sys/vm/nr_hugepages")
+  SHM_HUGE_THP - A shm advised for transparent huge pages. Requires
+    the "huge=advise" option on /dev/shm (mount -o remount,huge=advise)
+  The size is rounded up to huge pages. If TLB fails THP is used, and
+  if THP fails a normal shm. Returns the used SHM_HUGE_* or < 0 on
+  error. All map functions above handles huge page shared data.
+ */
+#ifndef HUGETLBFS_DIR
+#define HUGETLBFS_DIR "/dev/hugepages"
+#endif
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SHM_HUGE_NO 0
+#define SHM_HUGE_THP 1
+#define SHM_HUGE_TLB 2
+int createSharedDataHuge(char const* name, void* data, size_t len, int huge);
+// Delete shared data, both the shm and in hugetlbfs. Returns 0 if any
+// was deleted, else -1 (errno from shm_unlink(3))
+int deleteSharedData(char const* name);
+
@@ -0,0 +1,138 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+#include "affinity.h"
+#include "maglevdyn.h"
+#include "iputils.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void setKey(struct ctKey* key, unsigned i)
+{
+	memset(key, 0, sizeof(*key));
+	key->src.s6_addr32[2] = htonl(0xffff);
+	key->src.s6_addr32[3] = htonl(0x0a000000 + i);
+	key->dst.s6_addr32[2] = htonl(0xffff);
+	key->dst.s6_addr32[3] = htonl(0x0a0000ff);
+	key->ports.proto = IPPROTO_TCP;
+	key->ports.src = htons(10000 + i);
+	key->ports.dst = htons(80);
+}
+
+static void basic(void)
+{
+	struct timespec now = {0};
+	struct ctKey key;
+	unsigned tag;
+	struct Affinity* a = affinityCreate(100, 1000, 1);
+	assert(a != NULL);
+	setKey(&key, 1);
+	assert(affinityLookup(a, &now, &key, &tag) == -1);
+	assert(affinityInsert(a, &now, &key, 7, 3) == 0);
+	assert(affinityInsert(a, &now, &key, 8, 3) == 1);
+	assert(affinityLookup(a, &now, &key, &tag) == 7);
+	assert(tag == 3);
+
+	// Zero and max values must not be taken as "not found"
+	setKey(&key, 2);
+	assert(affinityInsert(a, &now, &key, 0, 0) == 0);
+	assert(affinityLookup(a, &now, &key, &tag) == 0);
+	assert(tag == 0);
+	setKey(&key, 3);
+	assert(affinityInsert(a, &now, &key, 0x7fffffff, 0x7fffffff) == 0);
+	assert(affinityLookup(a, &now, &key, &tag) == 0x7fffffff);
+	assert(tag == 0x7fffffff);
+	affinityRemove(a, &now, &key);
+	assert(affinityLookup(a, &now, &key, &tag) == -1);
+
+	// A lookup refreshes the ttl
+	setKey(&key, 1);
+	now.tv_nsec = 800000000;
+	assert(affinityLookup(a, &now, &key, &tag) == 7);
+	now.tv_sec = 1;
+	assert(affinityLookup(a, &now, &key, &tag) == 7);
+	now.tv_sec = 3;
+	assert(affinityLookup(a, &now, &key, &tag) == -1);
+	setKey(&key, 2);
+	assert(affinityLookup(a, &now, &key, &tag) == -1);
+
+	struct ctStats const* stats = affinityStats(a, &now);
+	assert(stats->inserts == 4);	/* Including the busy insert */
+	affinityDestroy(a);
+}
+
+/*
+  Connections stay on their target when a target is added, and a hit
+  for a removed target is detected with magDataDyn_activeAt().
+ */
+#define NCONN 1000
+static void sticky(void)
+{
+	struct timespec now = {0};
+	struct ctKey key;
+	unsigned M = 997, N = 10, len = magDataDyn_len(M, N, 0);
+	void* mem = malloc(len);
+	magDataDyn_init(M, N, 0, MAGDYN_MAGLEV, 0, mem, len);
+	struct MagDataDyn m;
+	magDataDyn_map(&m, mem);
+	for (unsigned i = 0; i < 4; i++)
+		m.active[i] = 100 + i;
+	magDataDyn_populate(&m);
+
+	struct Affinity* a = affinityCreate(NCONN, 1000, 1);
+	assert(a != NULL);
+	unsigned index;
+	for (unsigned i = 0; i < NCONN; i++) {
+		setKey(&key, i);
+		int fw = magDataDyn_lookupIndex(&m, hashKey(&key, 0), &index);
+		assert(fw >= 100 && fw < 104);
+		assert(magDataDyn_activeAt(&m, index) == fw);
+		assert(affinityInsert(a, &now, &key, fw, index) == 0);
+	}
+
+	// Add a target. All entries are still valid
+	m.active[4] = 104;
+	magDataDyn_populate(&m);
+	unsigned moved = 0;
+	for (unsigned i = 0; i < NCONN; i++) {
+		setKey(&key, i);
+		int fw = affinityLookup(a, &now, &key, &index);
+		assert(fw >= 100 && fw < 104);
+		assert(magDataDyn_activeAt(&m, index) == fw);
+		if (magDataDyn_lookup(&m, hashKey(&key, 0)) != fw)
+			moved++;
+	}
+	assert(moved > 0);
+
+	// Remove a target. Only the entries for it are invalid
+	m.active[0] = -1;
+	magDataDyn_populate(&m);
+	unsigned invalid = 0;
+	for (unsigned i = 0; i < NCONN; i++) {
+		setKey(&key, i);
+		int fw = affinityLookup(a, &now, &key, &index);
+		if (magDataDyn_activeAt(&m, index) != fw) {
+			assert(fw == 100);
+			invalid++;
+		}
+	}
+	assert(invalid > 0 && invalid < NCONN / 2);
+	assert(magDataDyn_activeAt(&m, N) == -1);
+
+	affinityDestroy(a);
+	magDataDyn_free(&m);
+	free(mem);
+}
+
+int main(int argc, char* argv[])
+{
+	basic();
+	sticky();
+	printf("==== affinity-test OK\n");
+	return 0;
+}
@@ -4,6 +4,7 @@
 */
 
 #include "conntrack.h"
+#include <threadstats.h>
 #include <cmd.h>
 #include <die.h>
 #include <assert.h>
@@ -11,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 // Debug macros
 #define Dx(x) x
@@ -21,6 +23,10 @@ static void testConntrack(struct ctStats* stats);
 static void testRefcount(struct ctStats* accumulatedStats);
 static void testLimitedBuckets(struct ctStats* accumulatedStats);
 static void testFreeDataFn(struct ctStats* accumulatedStats);
+static void testOpenAddressing(struct ctStats* accumulatedStats);
+static void testExpire(struct ctStats* accumulatedStats);
+static void testResize(struct ctStats* accumulatedStats);
+static void testThreadStats(struct ctStats* accumulatedStats);
 
 struct SustainedRateArg {
 	unsigned duration;
@@ -32,6 +38,9 @@ struct SustainedRateArg {
 	int assert;					/* Assert if packet loss > 1% */
 };
 static void* testSustainedRate(void *arg);
+static void testLookupScaling(
+	unsigned maxThreads, unsigned lookups, int open, int lockfn);
+static void benchLookup(unsigned lookups);
 
 int
 cmdCtBasic(int argc, char* argv[])
@@ -43,6 +52,10 @@ cmdCtBasic(int argc, char* argv[])
 	char const* parallel = "4";
 	char const* duration = "0";
 	char const* rate = "10000";
+	char const* lookups = "0";
+	char const* open = "no";
+	char const* lockfn = "no";
+	char const* bench = "0";
 	struct Option options[] = {
 		{"help", NULL, 0,
 		 "conntrack-test [options]\n"
@@ -54,11 +67,24 @@ cmdCtBasic(int argc, char* argv[])
 		{"parallel", &parallel, 0, "Parallel for repeated tests"},
 		{"duration", &duration, 0, "Simulated test time in seconds"},
 		{"rate", &rate, 0, "Rate in packets/S"},
+		{"lookups", &lookups, 0, "Lookups/thread. Test lookup scaling up to --parallel threads"},
+		{"open", &open, 0, "Use open addressing in the lookup scaling test"},
+		{"lockfn", &lockfn, 0, "Use refcounted data in the lookup scaling test"},
+		{"bench", &bench, 0, "Lookups. Compare chained and open addressing"},
 		{0, 0, 0, 0}
 	};
 	(void)parseOptionsOrDie(argc, argv, options);
 	srand(time(NULL));
 	int rpt = atoi(repeat);
+	if (atoi(lookups) > 0) {
+		testLookupScaling(
+			atoi(parallel), atoi(lookups), open == NULL, lockfn == NULL);
+		return 0;
+	}
+	if (atoi(bench) > 0) {
+		benchLookup(atoi(bench));
+		return 0;
+	}
 	
 	struct SustainedRateArg sarg;
 	sarg.duration = atoi(duration);
@@ -100,6 +126,10 @@ cmdCtBasic(int argc, char* argv[])
 	testRefcount(&stats);
 	testLimitedBuckets(&stats);
 	testFreeDataFn(&stats);
+	testOpenAddressing(&stats);
+	testExpire(&stats);
+	testResize(&stats);
+	testThreadStats(&stats);
 
 	if (sarg.duration > 0) {
 		sarg.assert = 1;
@@ -114,12 +144,15 @@ cmdCtBasic(int argc, char* argv[])
 
 
 static long nAllocatedBuckets = 0;
+static int failBucketAlloc = 0;
 static void* BUCKET_ALLOC(void* user_ref) {
-	nAllocatedBuckets++;
+	if (failBucketAlloc)
+		return NULL;
+	__atomic_add_fetch(&nAllocatedBuckets, 1, __ATOMIC_RELAXED);
 	return calloc(1,sizeof_bucket);
 }
 static void BUCKET_FREE(void* user_ref, void* b) {
-	nAllocatedBuckets--;
+	__atomic_sub_fetch(&nAllocatedBuckets, 1, __ATOMIC_RELAXED);
 	free(b);
 }
 
@@ -167,7 +200,7 @@ static void testConntrack(struct ctStats* accumulatedStats)
 	assert(nAllocatedBuckets == 0);
 	data = ctLookup(ct, &now, &key);
 	assert(data == (void*)1001);
-	assert(ctStats(ct, &now)->active == 1);
+	assert(ctStatsDeep(ct, &now)->active == 1);
 	assert(nFreeData == 0);
 
 	// Insert the same key again.
@@ -178,7 +211,7 @@ static void testConntrack(struct ctStats* accumulatedStats)
 	assert(nFreeData == 0);
 	data = ctLookup(ct, &now, &key);
 	assert(data == (void*)1001);
-	assert(ctStats(ct, &now)->active == 1);
+	assert(ctStatsDeep(ct, &now)->active == 1);
 	
 	// The existing item should expire
 	nFreeData = 0;
@@ -188,7 +221,7 @@ static void testConntrack(struct ctStats* accumulatedStats)
 	assert(rc == 0);
 	assert(nFreeData == 1);
 	assert(nAllocatedBuckets == 0);
-	assert(ctStats(ct, &now)->active == 1);
+	assert(ctStatsDeep(ct, &now)->active == 1);
 	expectedFreeData = 0;
 
 	// Cause a collision
@@ -198,8 +231,8 @@ static void testConntrack(struct ctStats* accumulatedStats)
 	assert(rc == 0);
 	assert(nFreeData == 0);
 	assert(nAllocatedBuckets == 1);
-	assert(ctStats(ct, &now)->active == 2);
-	assert(ctStats(ct, &now)->collisions == 1);
+	assert(ctStatsDeep(ct, &now)->active == 2);
+	assert(ctStatsDeep(ct, &now)->collisions == 1);
 
 	// Insert a new item after some time
 	nFreeData = 0;
@@ -209,8 +242,8 @@ static void testConntrack(struct ctStats* accumulatedStats)
 	assert(rc == 0);
 	assert(nFreeData == 0);
 	assert(nAllocatedBuckets == 2);
-	assert(ctStats(ct, &now)->active == 3);
-	assert(ctStats(ct, &now)->collisions == 2);
+	assert(ctStatsDeep(ct, &now)->active == 3);
+	assert(ctStatsDeep(ct, &now)->collisions == 2);
 
 	// Let the first 2 items expire then lookup the remaining
 	nFreeData = 0;
@@ -219,8 +252,8 @@ static void testConntrack(struct ctStats* accumulatedStats)
 	assert(data == (void*)1005);
 	assert(nAllocatedBuckets == 1);
 	assert(nFreeData == 2);
-	assert(ctStats(ct, &now)->active == 1);
-	assert(ctStats(ct, &now)->collisions == 2);
+	assert(ctStatsDeep(ct, &now)->active == 1);
+	assert(ctStatsDeep(ct, &now)->collisions == 2);
 
 	// The main bucket should be free. Insert and check nAllocatedBuckets
 	nFreeData = 0;
@@ -231,8 +264,8 @@ static void testConntrack(struct ctStats* accumulatedStats)
 	assert(data == (void*)1006);
 	assert(nAllocatedBuckets == 1);
 	assert(nFreeData == 0);
-	assert(ctStats(ct, &now)->active == 2);
-	assert(ctStats(ct, &now)->collisions == 3);
+	assert(ctStatsDeep(ct, &now)->active == 2);
+	assert(ctStatsDeep(ct, &now)->collisions == 3);
 
 	// Remove the item in the "main" bucket
 	nFreeData = 0;
@@ -242,15 +275,15 @@ static void testConntrack(struct ctStats* accumulatedStats)
 	assert(nAllocatedBuckets == 1);	
 	data = ctLookup(ct, &now, &key);
 	assert(data == NULL);
-	assert(ctStats(ct, &now)->active == 1);
-	assert(ctStats(ct, &now)->collisions == 3);
+	assert(ctStatsDeep(ct, &now)->active == 1);
+	assert(ctStatsDeep(ct, &now)->collisions == 3);
 
 	// Flush the remaining item
 	nFreeData = 0;
 	expectedFreeData = 1005;
-	assert(ctStats(ct, &now)->active == 1);
+	assert(ctStatsDeep(ct, &now)->active == 1);
 	now.tv_nsec += 100;
-	assert(ctStats(ct, &now)->active == 0);
+	assert(ctStatsDeep(ct, &now)->active == 0);
 	assert(nFreeData == 1);
 
 	// Insert 2 items with different TTL, step time and verify that
@@ -261,17 +294,17 @@ static void testConntrack(struct ctStats* accumulatedStats)
 	key.id = 1008;
 	rc = ctInsertWithTTL(ct, &now, &key, 100, (void*)key.id);
 	assert(rc == 0);
-	assert(ctStats(ct, &now)->active == 2);
+	assert(ctStatsDeep(ct, &now)->active == 2);
 	now.tv_nsec += 150;
 	nFreeData = 0;
 	expectedFreeData = 1008;
-	assert(ctStats(ct, &now)->active == 1);
+	assert(ctStatsDeep(ct, &now)->active == 1);
 	assert(nFreeData == 1);
 	
 	// Destroy the table. Remaining items shall be freed
 	nFreeData = 0;
 	expectedFreeData = 1007;
-	collectStats(accumulatedStats, ctStats(ct, &now));
+	collectStats(accumulatedStats, ctStatsDeep(ct, &now));
 	ctDestroy(ct);
 	assert(nFreeData == 1);
 	assert(nAllocatedBuckets == 0);	
@@ -290,22 +323,22 @@ static void testConntrack(struct ctStats* accumulatedStats)
 		key.id++;
 	}
 	assert(nFreeData == 0);
-	D(printf("Now = %lu, Active = %u\n",now.tv_nsec,ctStats(ct,&now)->active));
-	assert(ctStats(ct, &now)->active == 1000);
+	D(printf("Now = %lu, Active = %u\n",now.tv_nsec,ctStatsDeep(ct,&now)->active));
+	assert(ctStatsDeep(ct, &now)->active == 1000);
 	D(printf(
 		  "allocated=%ld, collisions=%u\n",
-		  nAllocatedBuckets, ctStats(ct, &now)->collisions));
-	// NOTE; nAllocatedBuckets will change if a better hash function is used!!
-	// (and BTW 766 is quite lousy)
-	assert(nAllocatedBuckets == 766);
-	assert(ctStats(ct, &now)->collisions == nAllocatedBuckets);
+		  nAllocatedBuckets, ctStatsDeep(ct, &now)->collisions));
+	// NOTE; nAllocatedBuckets will change if the hash function is changed!!
+	// (it was 766 with djb2, ~368 is expected for random hashing)
+	assert(nAllocatedBuckets == 373);
+	assert(ctStatsDeep(ct, &now)->collisions == nAllocatedBuckets);
 	now.tv_nsec += 500;
-	D(printf("Now = %lu, Active = %u\n",now.tv_nsec,ctStats(ct,&now)->active));
-	assert(ctStats(ct, &now)->active == 500);
+	D(printf("Now = %lu, Active = %u\n",now.tv_nsec,ctStatsDeep(ct,&now)->active));
+	assert(ctStatsDeep(ct, &now)->active == 500);
 	assert(nFreeData == 500);
 	D(printf("allocated=%ld\n", nAllocatedBuckets));
-	assert(nAllocatedBuckets == 384);
-	collectStats(accumulatedStats, ctStats(ct, &now));
+	assert(nAllocatedBuckets == 265);	// (384 with djb2)
+	collectStats(accumulatedStats, ctStatsDeep(ct, &now));
 	ctDestroy(ct);
 	assert(nFreeData == 1000);
 }
@@ -320,10 +353,18 @@ struct FragData {
 };
 static unsigned allocatedFrags = 0;
 
-static void lockFragData(void* user_ref, void* data)
+// Take a reference only if the object is not being freed
+static int lockFragData(void* user_ref, void* data)
 {
 	struct FragData* f = data;
-	REFINC(f->referenceCounter);
+	int n = __atomic_load_n(&f->referenceCounter, __ATOMIC_RELAXED);
+	do {
+		if (n <= 0)
+			return -1;
+	} while (!__atomic_compare_exchange_n(
+				 &f->referenceCounter, &n, n + 1, 1,
+				 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	return 0;
 }
 static void unlockFragData(void* user_ref, void* data)
 {
@@ -376,7 +417,7 @@ static void testRefcount(struct ctStats* accumulatedStats)
 	unlockFragData(NULL, f);
 	assert(allocatedFrags == 0);
 	
-	collectStats(accumulatedStats, ctStats(ct, &now));
+	collectStats(accumulatedStats, ctStatsDeep(ct, &now));
 	ctDestroy(ct);
 }
 
@@ -447,6 +488,9 @@ static void testLimitedBuckets(struct ctStats* accumulatedStats)
 	rc = ctInsert(ct, &now, &key, (void*)key.id);
 	assert(rc == 0);
 	assert(bucketPool.nfree == 0);
+	assert(ctStats(ct, &now)->active == 3);
+	assert(ctStats(ct, &now)->buckets == 2);
+	assert(ctStats(ct, &now)->chain[2] == 1);
 
 	key.id = 1004;
 	rc = ctInsert(ct, &now, &key, (void*)key.id);
@@ -470,8 +514,11 @@ static void testLimitedBuckets(struct ctStats* accumulatedStats)
 	key.id = 1003;
 	ctRemove(ct, &now, &key);
 	assert(bucketPool.nfree == 1);
+	assert(ctStats(ct, &now)->buckets == 1);
+	assert(ctStats(ct, &now)->chain[1] == 1);
+	assert(ctStats(ct, &now)->chain[2] == 0);
 	
-	collectStats(accumulatedStats, ctStats(ct, &now));
+	collectStats(accumulatedStats, ctStatsDeep(ct, &now));
 	ctDestroy(ct);
 	// Allocated buckets shall be freed on "ctDestroy"
 	assert(bucketPool.nfree == 2);
@@ -504,7 +551,373 @@ static void testFreeDataFn(struct ctStats* accumulatedStats)
 	ctRemove(ct, &now, &key);
 	expectedFreeData = 0;
 
-	collectStats(accumulatedStats, ctStats(ct, &now));
+	collectStats(accumulatedStats, ctStatsDeep(ct, &now));
+	ctDestroy(ct);
+}
+
+static void testOpenAddressing(struct ctStats* accumulatedStats)
+{
+	struct ct* ct;
+	struct timespec now = {0,0};
+	struct ctKey key = {IN6ADDR_ANY_INIT,IN6ADDR_ANY_INIT,{0ull}};
+	struct ctStats const* stats;
+	int rc;
+
+	// Both or none of the bucket functions must be specified
+	assert(ctCreate(1, 100, NULL, NULL, BUCKET_ALLOC, NULL, NULL) == NULL);
+
+	// One group (all keys in the same home group) + overflow groups
+	ct = ctCreate(1, 100, freeData, NULL, NULL, NULL, NULL);
+	assert(ct != NULL);
+	nFreeData = 0;
+	stats = ctStatsDeep(ct, &now);
+	assert(stats->size == 128);
+	for (key.id = 1; key.id <= 128; key.id++) {
+		rc = ctInsert(ct, &now, &key, (void*)key.id);
+		assert(rc == 0);
+	}
+	rc = ctInsert(ct, &now, &key, (void*)key.id);
+	assert(rc == -1);
+	stats = ctStatsDeep(ct, &now);
+	assert(stats->active == 128);
+	assert(stats->collisions == 112);
+	assert(stats->rejectedInserts == 1);
+	for (key.id = 1; key.id <= 128; key.id++)
+		assert(ctLookup(ct, &now, &key) == (void*)key.id);
+	key.id = 10;
+	rc = ctInsert(ct, &now, &key, (void*)key.id);
+	assert(rc == 1);
+
+	// Removed entries are DELETED in full groups and the probe continues
+	expectedFreeData = key.id;
+	ctRemove(ct, &now, &key);
+	expectedFreeData = 0;
+	assert(nFreeData == 1);
+	assert(ctLookup(ct, &now, &key) == NULL);
+	key.id = 100;
+	assert(ctLookup(ct, &now, &key) == (void*)key.id);
+	key.id = 129;
+	rc = ctInsert(ct, &now, &key, (void*)key.id);
+	assert(rc == 0);
+	assert(ctLookup(ct, &now, &key) == (void*)key.id);
+	key.id = 10;
+	ctRemove(ct, &now, &key);	/* no-op */
+	assert(nFreeData == 1);
+
+	// A stale entry found in a lookup GC's it's group
+	now.tv_nsec = 200;
+	key.id = 1;
+	assert(ctLookup(ct, &now, &key) == NULL);
+	assert(nFreeData == 1 + 16);
+	stats = ctStatsDeep(ct, &now);
+	assert(stats->active == 0);
+	assert(nFreeData == 1 + 128);
+	assert(stats->objGC == 128);
+	rc = ctInsert(ct, &now, &key, (void*)key.id);
+	assert(rc == 0);
+	collectStats(accumulatedStats, ctStatsDeep(ct, &now));
+	ctDestroy(ct);
+	assert(nFreeData == 1 + 128 + 1);
+
+	// DELETED slots are reclaimed unless a later entry has probed past
+	extern unsigned ctTombstones(struct ct* ct);
+	ct = ctCreate(1, 100, NULL, NULL, NULL, NULL, NULL);
+	now.tv_nsec = 0;
+	for (key.id = 1; key.id <= 128; key.id++)
+		assert(ctInsert(ct, &now, &key, (void*)key.id) == 0);
+	for (key.id = 1; key.id < 128; key.id++)
+		ctRemove(ct, &now, &key);
+	assert(ctTombstones(ct) == 127);
+	assert(ctExpire(ct, &now, UINT32_MAX) == 0);
+	assert(ctTombstones(ct) == 112); /* Only the last group */
+	assert(ctLookup(ct, &now, &key) == (void*)key.id);
+	ctRemove(ct, &now, &key);
+	ctExpire(ct, &now, UINT32_MAX);
+	assert(ctTombstones(ct) == 0);
+	ctDestroy(ct);
+
+	// Refcount with a lockfn
+	struct FragData* f;
+	now.tv_nsec = 0;
+	ct = ctCreate(1000, 1000, unlockFragData, lockFragData, NULL, NULL, NULL);
+	key.id = 1001;
+	rc = ctInsert(ct, &now, &key, allocFragData(key.id));
+	assert(rc == 0);
+	f = ctLookup(ct, &now, &key);
+	assert(f != NULL);
+	assert(f->id == 1001);
+	assert(f->referenceCounter == 2);
+	ctRemove(ct, &now, &key);
+	assert(f->referenceCounter == 1);
+	unlockFragData(NULL, f);
+	assert(allocatedFrags == 0);
+	collectStats(accumulatedStats, ctStatsDeep(ct, &now));
+	ctDestroy(ct);
+}
+
+static void testExpire(struct ctStats* accumulatedStats)
+{
+	struct ct* ct;
+	struct timespec now = {0,0};
+	struct ctKey key = {IN6ADDR_ANY_INIT,IN6ADDR_ANY_INIT,{0ull}};
+	struct ctStats const* stats;
+
+	for (int open = 0; open < 2; open++) {
+		if (open)
+			ct = ctCreate(64, 100, freeData, NULL, NULL, NULL, NULL);
+		else
+			ct = ctCreate(64, 100, freeData, NULL, BUCKET_ALLOC, BUCKET_FREE, NULL);
+		nFreeData = 0;
+		for (key.id = 1; key.id <= 40; key.id++)
+			assert(ctInsert(ct, &now, &key, (void*)key.id) == 0);
+		stats = ctStats(ct, &now);
+		unsigned size = stats->size;
+		unsigned half = size / 32 * 16; /* Whole open addressing groups */
+		assert(stats->active == 40);
+		assert(ctExpire(ct, &now, half) == 0);
+		assert(ctExpire(ct, &now, size - half) == 0);
+		assert(stats->active == 40);
+
+		// Timed out entries are counted as active until freed in slices
+		now.tv_nsec = 200;
+		assert(ctStats(ct, &now)->active == 40);
+		key.id = 41;
+		assert(ctInsert(ct, &now, &key, (void*)key.id) == 0);
+		unsigned freed = nFreeData; /* GC'ed by the insert */
+		assert(stats->active == 41 - freed);
+		ctCounter gc = ctExpire(ct, &now, half);
+		assert(gc > 0 && gc < 40);
+		assert(nFreeData == freed + gc);
+		assert(stats->active == 41 - nFreeData);
+		gc += ctExpire(ct, &now, size - half);
+		assert(nFreeData == 40);
+		assert(gc == 40 - freed);
+		assert(stats->active == 1);
+		if (!open) {
+			assert(nAllocatedBuckets == 0);
+			assert(stats->buckets == 0);
+			assert(stats->chain[0] == size);
+		} else {
+			assert(stats->chain[0] + stats->chain[1] == 1);
+		}
+
+		// A full GC
+		now.tv_nsec = 400;
+		assert(ctExpire(ct, &now, UINT32_MAX) == 1);
+		assert(stats->active == 0);
+		collectStats(accumulatedStats, stats);
+		ctDestroy(ct);
+	}
+}
+
+static void checkChain(struct ctStats const* stats)
+{
+	ctCounter n = 0;
+	for (int i = 0; i < CT_CHAIN_HIST; i++)
+		n += stats->chain[i];
+	assert(n == stats->size);
+}
+struct ResizeArg {
+	struct ct* ct;
+	unsigned lookups;
+	int stop;
+};
+static void* resizeLookupThread(void* _arg)
+{
+	struct ResizeArg* arg = _arg;
+	struct timespec now = {0,0};
+	struct ctKey key = {IN6ADDR_ANY_INIT,IN6ADDR_ANY_INIT,{0ull}};
+	while (!__atomic_load_n(&arg->stop, __ATOMIC_RELAXED)) {
+		for (key.id = 1; key.id <= 100; key.id++)
+			assert(ctLookup(arg->ct, &now, &key) == (void*)key.id);
+		arg->lookups += 100;
+	}
+	return NULL;
+}
+static void testResize(struct ctStats* accumulatedStats)
+{
+	struct ct* ct;
+	struct timespec now = {0,0};
+	struct ctKey key = {IN6ADDR_ANY_INIT,IN6ADDR_ANY_INIT,{0ull}};
+	struct ctStats const* stats;
+
+	ct = ctCreate(16, 1000, freeData, NULL, NULL, NULL, NULL);
+	assert(ctSetMaxSize(ct, 256) == -1); /* Not for open addressing */
+	ctDestroy(ct);
+
+	ct = ctCreate(16, 1000, freeData, NULL, BUCKET_ALLOC, BUCKET_FREE, NULL);
+	assert(ctSetMaxSize(ct, 8) == -1);
+	assert(ctSetMaxSize(ct, 200) == 0);
+	stats = ctStats(ct, &now);
+	nFreeData = 0;
+
+	// Grow. All entries must be found during migration
+	for (key.id = 1; key.id <= 150; key.id++) {
+		assert(ctInsert(ct, &now, &key, (void*)key.id) == 0);
+		struct ctKey k = key;
+		for (k.id = 1; k.id <= key.id; k.id++)
+			assert(ctLookup(ct, &now, &k) == (void*)k.id);
+	}
+	assert(stats->active == 150);
+	assert(stats->size == 200);	/* 16,32,64,128,200 */
+	assert(stats->resizes >= 3);
+	assert(ctStatsDeep(ct, &now)->resizes == 4);
+	assert(stats->rejectedInserts == 0);
+	assert(stats->buckets == nAllocatedBuckets);
+	checkChain(stats);
+	key.id = 1;
+	assert(ctInsert(ct, &now, &key, (void*)key.id) == 1);
+
+	// Shrink when entries are removed, but not below the initial size
+	for (key.id = 150; key.id > 0; key.id--) {
+		ctRemove(ct, &now, &key);
+		struct ctKey k = key;
+		for (k.id = 1; k.id < key.id; k.id++)
+			assert(ctLookup(ct, &now, &k) == (void*)k.id);
+	}
+	assert(nFreeData == 150);
+	assert(stats->active == 0);
+	for (int i = 0; i < 8 && stats->size > 16; i++)
+		ctStatsDeep(ct, &now);	/* One resize per call */
+	assert(stats->size == 16);
+	assert(stats->buckets == 0);
+	assert(nAllocatedBuckets == 0);
+	checkChain(stats);
+
+	// Stale entries are not migrated
+	for (key.id = 1; key.id <= 12; key.id++)
+		assert(ctInsert(ct, &now, &key, (void*)key.id) == 0);
+	now.tv_nsec = 2000;
+	ctCounter resizes = stats->resizes;
+	for (key.id = 13; key.id <= 14; key.id++)
+		assert(ctInsert(ct, &now, &key, (void*)key.id) == 0);
+	ctStatsDeep(ct, &now);
+	assert(stats->resizes == resizes + 1);
+	assert(stats->active == 2);
+	assert(nFreeData == 150 + 12);
+	checkChain(stats);
+	collectStats(accumulatedStats, stats);
+	ctDestroy(ct);
+	assert(nAllocatedBuckets == 0);
+
+	// Entries are not lost if a collision bucket can't be allocated
+	// during migration. The resize completes when allocation works
+	// again. Growing x2 never needs a bucket for a main entry, 128->200
+	// does
+	ct = ctCreate(16, 1000, freeData, NULL, BUCKET_ALLOC, BUCKET_FREE, NULL);
+	assert(ctSetMaxSize(ct, 200) == 0);
+	stats = ctStats(ct, &now);
+	nFreeData = 0;
+	now.tv_nsec = 0;
+	for (key.id = 1; key.id <= 96; key.id++)
+		assert(ctInsert(ct, &now, &key, (void*)key.id) == 0);
+	assert(ctStatsDeep(ct, &now)->size == 128);
+	resizes = stats->resizes;
+	failBucketAlloc = 1;
+	for (key.id = 97; key.id <= 100; key.id++)
+		ctInsert(ct, &now, &key, (void*)key.id);
+	ctStatsDeep(ct, &now);
+	assert(stats->size == 200);
+	assert(stats->resizes == resizes);	/* Stalled */
+	ctCounter active = stats->active;
+	assert(active >= 96);
+	for (key.id = 1; key.id <= 96; key.id++)
+		assert(ctLookup(ct, &now, &key) == (void*)key.id);
+	assert(nFreeData == 0);
+	failBucketAlloc = 0;
+	ctStatsDeep(ct, &now);
+	assert(stats->resizes == resizes + 1);
+	assert(stats->active == active);
+	for (key.id = 1; key.id <= 96; key.id++)
+		assert(ctLookup(ct, &now, &key) == (void*)key.id);
+	assert(stats->buckets == nAllocatedBuckets);
+	checkChain(stats);
+	ctDestroy(ct);
+	assert(nAllocatedBuckets == 0);
+
+	// Lock-free lookups while the table grows and shrinks
+	struct bucketPool bucketPool;
+	bucketPoolInit(&bucketPool, 4000);
+	ct = ctCreate(
+		64, 1000, NULL, NULL, bucketPoolAllocate, bucketPoolFree, &bucketPool);
+	assert(ctSetMaxSize(ct, 8192) == 0);
+	now.tv_nsec = 0;
+	for (key.id = 1; key.id <= 100; key.id++)
+		assert(ctInsert(ct, &now, &key, (void*)key.id) == 0);
+	struct ResizeArg arg = {ct, 0, 0};
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, resizeLookupThread, &arg) != 0)
+		die("Failed to start pthread\n");
+	for (int i = 0; i < 5; i++) {
+		for (key.id = 1000; key.id < 5000; key.id++)
+			assert(ctInsert(ct, &now, &key, (void*)key.id) == 0);
+		for (key.id = 1000; key.id < 5000; key.id++)
+			ctRemove(ct, &now, &key);
+	}
+	__atomic_store_n(&arg.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	stats = ctStatsDeep(ct, &now);
+	assert(stats->active == 100);
+	assert(stats->resizes >= 10);
+	assert(stats->rejectedInserts == 0);
+	assert(stats->buckets + bucketPool.nfree == 4000);
+	checkChain(stats);
+	ctDestroy(ct);
+	free(bucketPool.buffer);
+	free(bucketPool.freeBuckets);
+}
+
+struct ThreadStatsArg {
+	struct ct* ct;
+	unsigned index;
+};
+static void* threadStatsThread(void* _arg)
+{
+	struct ThreadStatsArg* arg = _arg;
+	struct timespec now = {0,0};
+	struct ctKey key = {IN6ADDR_ANY_INIT,IN6ADDR_ANY_INIT,{0ull}};
+	threadStatsSetIndex(arg->index);
+	for (unsigned i = 0; i < 1000; i++) {
+		key.id = arg->index * 1000 + i + 1;
+		assert(ctInsert(arg->ct, &now, &key, (void*)key.id) == 0);
+		assert(ctLookup(arg->ct, &now, &key) == (void*)key.id);
+		if (i % 2)
+			ctRemove(arg->ct, &now, &key);
+	}
+	return NULL;
+}
+static void testThreadStats(struct ctStats* accumulatedStats)
+{
+	struct timespec now = {0,0};
+	struct ctStats blocks[3];
+	struct ct* ct = ctCreate(
+		4000, 1000, NULL, NULL, BUCKET_ALLOC, BUCKET_FREE, NULL);
+	ctUseThreadStats(ct, blocks, 3, sizeof(struct ctStats));
+	assert(ctStats(ct, &now)->size == 4000);
+
+	// Index 0, and out of range indexes, share block 0
+	pthread_t threads[4];
+	struct ThreadStatsArg args[4] = {{ct,0},{ct,1},{ct,2},{ct,3}};
+	for (int i = 0; i < 4; i++) {
+		if (pthread_create(&threads[i], NULL, threadStatsThread, &args[i]) != 0)
+			die("Failed to start pthread\n");
+	}
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	assert(blocks[1].inserts == 1000);
+	assert(blocks[1].active == 500);
+	assert(blocks[2].lookups == 1000);
+	assert(blocks[0].inserts == 2000);
+
+	struct ctStats const* stats = ctStats(ct, &now);
+	assert(stats->size == 4000);
+	assert(stats->inserts == 4000);
+	assert(stats->lookups == 4000);
+	assert(stats->active == 2000);
+	assert(stats->buckets == nAllocatedBuckets);
+	assert(stats->chain[0] + stats->chain[1] + stats->chain[2] +
+		   stats->chain[3] == 4000);
+	collectStats(accumulatedStats, stats);
 	ctDestroy(ct);
 }
 
@@ -592,7 +1005,7 @@ static void* testSustainedRate(void *_arg)
 	}
 
 	unsigned beforeFullGC = stats.objGC;
-	(void)ctStats(ct, &now);
+	(void)ctStatsDeep(ct, &now);
 	double percentLoss = 0;
 	if (stats.inserts > 0)
 		percentLoss =
@@ -640,6 +1053,216 @@ static uint64_t timeToNextPacket(unsigned rate, unsigned* seed)
 	return rand_r(seed) % (d * 2);
 }
 
+/* ----------------------------------------------------------------------
+   Lookup scaling. Threads make lookups in a shared table while another
+   thread inserts and removes other keys.
+
+   With a lockfn the data are refcounted objects from a static pool.
+   The churn thread re-uses a removed object for another key, and a
+   lookup must never get a reference to an object used for another key.
+*/
+#define NKEYS 100000
+struct LookupArg {
+	struct ct* ct;
+	unsigned lookups;
+	unsigned seed;
+	int lockfn;
+};
+static int churnStop = 0;
+static struct FragData refData[NKEYS * 2];
+static void unlockRefData(void* user_ref, void* data)
+{
+	struct FragData* f = data;
+	int refCount = REFDEC(f->referenceCounter);
+	assert(refCount >= 0);
+}
+static uint64_t nowNs(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * SEC + t.tv_nsec;
+}
+static void* lookupThread(void* _arg)
+{
+	struct LookupArg* arg = _arg;
+	struct timespec now = {1,0};
+	struct ctKey key;
+	memset(&key, 0, sizeof(key));
+	uint32_t x = arg->seed | 1;
+	for (unsigned i = 0; i < arg->lookups; i++) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5; /* xorshift */
+		if (!arg->lockfn) {
+			key.id = x % NKEYS;
+			void* data = ctLookup(arg->ct, &now, &key);
+			assert(data == (void*)(key.id + 1));
+			continue;
+		}
+		key.id = x % (NKEYS * 2);
+		struct FragData* f = ctLookup(arg->ct, &now, &key);
+		if (key.id < NKEYS)
+			assert(f == refData + key.id);
+		if (f == NULL)
+			continue;
+		assert(__atomic_load_n(&f->id, __ATOMIC_RELAXED) == key.id);
+		assert(__atomic_load_n(&f->referenceCounter, __ATOMIC_RELAXED) > 0);
+		unlockRefData(NULL, f);
+	}
+	return NULL;
+}
+static void* churnThread(void* _arg)
+{
+	struct LookupArg* arg = _arg;
+	struct ct* ct = arg->ct;
+	struct timespec now = {1,0};
+	struct ctKey key;
+	memset(&key, 0, sizeof(key));
+	uint64_t id = 0;
+	while (!__atomic_load_n(&churnStop, __ATOMIC_RELAXED)) {
+		key.id = NKEYS + (id % NKEYS);
+		if (!arg->lockfn) {
+			ctInsert(ct, &now, &key, (void*)(key.id + 1));
+		} else {
+			// Take a free object, not the one for the key
+			struct FragData* f = refData + NKEYS + (id * 7) % NKEYS;
+			if (__atomic_load_n(&f->referenceCounter, __ATOMIC_SEQ_CST) == 0) {
+				__atomic_store_n(&f->id, key.id, __ATOMIC_RELAXED);
+				REFINC(f->referenceCounter);
+				if (ctInsert(ct, &now, &key, f) != 0)
+					unlockRefData(NULL, f);
+			}
+		}
+		key.id = NKEYS + ((id + NKEYS / 2) % NKEYS);
+		ctRemove(ct, &now, &key);
+		id++;
+	}
+	return NULL;
+}
+static void testLookupScaling(
+	unsigned maxThreads, unsigned lookups, int open, int lockfn)
+{
+	ctFree freefn = lockfn ? unlockRefData : NULL;
+	ctLock lockDataFn = lockfn ? lockFragData : NULL;
+	// Collision buckets are read after removal, so use a pool
+	struct bucketPool bucketPool;
+	bucketPoolInit(&bucketPool, NKEYS * 2);
+	struct ct* ct;
+	if (open)
+		ct = ctCreate(
+			NKEYS * 2, UINT64_MAX / 2, freefn, lockDataFn, NULL, NULL, NULL);
+	else
+		ct = ctCreate(
+			NKEYS, UINT64_MAX / 2, freefn, lockDataFn,
+			bucketPoolAllocate, bucketPoolFree, &bucketPool);
+	struct timespec now = {1,0};
+	struct ctKey key;
+	memset(&key, 0, sizeof(key));
+	for (key.id = 0; key.id < NKEYS; key.id++) {
+		void* data = (void*)(key.id + 1);
+		if (lockfn) {
+			refData[key.id].id = key.id;
+			refData[key.id].referenceCounter = 1;
+			data = refData + key.id;
+		}
+		assert(ctInsert(ct, &now, &key, data) == 0);
+	}
+
+	pthread_t churn;
+	struct LookupArg churnArg = { .ct = ct, .lockfn = lockfn };
+	if (pthread_create(&churn, NULL, churnThread, &churnArg) != 0)
+		die("Failed to start pthread\n");
+	for (unsigned n = 1; ; n *= 2) {
+		if (n > maxThreads)
+			n = maxThreads;
+		pthread_t threads[n];
+		struct LookupArg args[n];
+		uint64_t t0 = nowNs();
+		for (unsigned i = 0; i < n; i++) {
+			args[i].ct = ct;
+			args[i].lookups = lookups;
+			args[i].seed = i + 1;
+			args[i].lockfn = lockfn;
+			if (pthread_create(&threads[i], NULL, lookupThread, &args[i]) != 0)
+				die("Failed to start pthread\n");
+		}
+		for (unsigned i = 0; i < n; i++)
+			pthread_join(threads[i], NULL);
+		uint64_t ns = nowNs() - t0;
+		printf(
+			"threads=%-3u %.1f Mlookups/s (%.1f/thread)\n", n,
+			(double)n * lookups * 1000.0 / ns, (double)lookups * 1000.0 / ns);
+		if (n == maxThreads)
+			break;
+	}
+	__atomic_store_n(&churnStop, 1, __ATOMIC_RELAXED);
+	pthread_join(churn, NULL);
+	ctDestroy(ct);
+	if (lockfn) {
+		// All references are released
+		for (unsigned i = 0; i < NKEYS * 2; i++)
+			assert(refData[i].referenceCounter == 0);
+	}
+	free(bucketPool.buffer);
+	free(bucketPool.freeBuckets);
+}
+
+/*
+  Compare lookups in the chained and open addressing tables at
+  different loads. The table is larger than the CPU caches so the
+  number of cache lines touched per lookup dominates.
+ */
+#define BENCH_SIZE (1024 * 1024)
+static void benchLookup(unsigned lookups)
+{
+	static unsigned const load[] = {50, 75, 90};
+	struct bucketPool bucketPool;
+	struct timespec now = {1,0};
+	struct ctKey key;
+	memset(&key, 0, sizeof(key));
+	for (int open = 0; open < 2; open++) {
+		for (int l = 0; l < sizeof(load) / sizeof(load[0]); l++) {
+			unsigned nkeys = BENCH_SIZE / 100 * load[l];
+			struct ct* ct;
+			if (open) {
+				ct = ctCreate(BENCH_SIZE, UINT64_MAX / 2, NULL, NULL, NULL, NULL, NULL);
+			} else {
+				bucketPoolInit(&bucketPool, nkeys);
+				ct = ctCreate(
+					BENCH_SIZE, UINT64_MAX / 2, NULL, NULL,
+					bucketPoolAllocate, bucketPoolFree, &bucketPool);
+			}
+			for (key.id = 0; key.id < nkeys; key.id++)
+				ctInsert(ct, &now, &key, (void*)(key.id + 1));
+			struct ctStats const* stats = ctStatsDeep(ct, &now);
+			double ns[2];
+			for (int miss = 0; miss < 2; miss++) {
+				uint32_t x = 4711;
+				unsigned found = 0;
+				uint64_t t0 = nowNs();
+				for (unsigned i = 0; i < lookups; i++) {
+					x ^= x << 13; x ^= x >> 17; x ^= x << 5; /* xorshift */
+					key.id = x % nkeys + (miss ? nkeys : 0);
+					if (ctLookup(ct, &now, &key) != NULL)
+						found++;
+				}
+				ns[miss] = (double)(nowNs() - t0) / lookups;
+				if (miss)
+					assert(found == 0);
+				else if (stats->rejectedInserts == 0)
+					assert(found == lookups);
+			}
+			printf(
+				"%-7s load=%u%% hit %.1f ns, miss %.1f ns, collisions=%u, rejected=%u\n",
+				open ? "open" : "chained", load[l], ns[0], ns[1],
+				stats->collisions, stats->rejectedInserts);
+			ctDestroy(ct);
+			if (!open) {
+				free(bucketPool.buffer);
+				free(bucketPool.freeBuckets);
+			}
+		}
+	}
+}
+
 #ifdef CMD
 void addCmd(char const* name, int (*fn)(int argc, char* argv[]));
 __attribute__ ((__constructor__)) static void addCommand(void) {
@@ -127,6 +127,25 @@ int main(int argc, char* argv[])
 	assert(flowLookup(f, &key, 0,NULL,0,  NULL) == (void*)2);
 	flowSetDelete(f);
 
+	// IPv4 cidrs only matches IPv4 (mapped) addresses
+	f = flowSetCreate(NULL);
+	char const* adr02[] = {"0.0.0.0/0", NULL};
+	char const* adr03[] = {"192.168.1.0/24", "::ffff:10.0.0.0/104", NULL};
+	err = flowDefine(f, "adr02", 1, (void*)2, NULL, NULL, NULL, adr02, adr03, NULL, 0);
+	assert(err == NULL);
+	memset(&key, 0, sizeof(key));
+	assert(inet_pton(AF_INET6, "::ffff:1.2.3.4", &key.dst) == 1);
+	assert(inet_pton(AF_INET6, "::ffff:192.168.1.77", &key.src) == 1);
+	assert(flowLookup(f, &key, 0,NULL,0,  NULL) == (void*)2);
+	assert(inet_pton(AF_INET6, "::ffff:10.22.1.77", &key.src) == 1);
+	assert(flowLookup(f, &key, 0,NULL,0,  NULL) == (void*)2);
+	assert(inet_pton(AF_INET6, "::ffff:192.168.2.77", &key.src) == 1);
+	assert(flowLookup(f, &key, 0,NULL,0,  NULL) == NULL);
+	assert(inet_pton(AF_INET6, "::ffff:192.168.1.77", &key.src) == 1);
+	assert(inet_pton(AF_INET6, "::1.2.3.4", &key.dst) == 1);
+	assert(flowLookup(f, &key, 0,NULL,0,  NULL) == NULL);
+	flowSetDelete(f);
+
 	// Basic port
 	f = flowSetCreate(NULL);
 	char const* ports = "22-30, 1025, 20000-30000, 22000-23000, 25, 27";
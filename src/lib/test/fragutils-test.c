@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #define MS 1000000				/* One milli second in nanos */
 
@@ -317,6 +318,61 @@ cmdFragutilsBasic(int argc, char* argv[])
 	assert(statsCmp(&a, &b) == 0);
 
 	fragTableDestroy(ft);
+
+	// The expiry thread frees timed out entries (real time, ttl=10ms)
+	ft = fragTableCreate(2, 3, 4, 1500, 10);
+	assert(fragStartExpiry(ft, 1) == 0);
+	assert(fragStartExpiry(ft, 1) == -1);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (key.id = 1; key.id <= 4; key.id++) {
+		rc = fragInsertFirst(ft, &now, &key, 5, NULL, NULL, 0);
+		assert(rc == 0);
+	}
+	struct timespec delay = {0, 100 * MS};
+	nanosleep(&delay, NULL);
+	fragGetStats(ft, &now, &b);
+	assert(b.ctstats.active == 0);
+	assert(b.ctstats.objGC == 4);
+	fragTableDestroy(ft);
+
+	// The table grows instead of rejecting inserts
+	ft = fragTableCreate(2, 3, 4, 1500, 100);
+	assert(fragSetMaxSize(ft, 1) == -1);
+	assert(fragSetMaxSize(ft, 16) == 0);
+	for (key.id = 1; key.id <= 10; key.id++) {
+		rc = fragInsertFirst(ft, &now, &key, 5, NULL, NULL, 0);
+		assert(rc == 0);
+	}
+	fragGetStats(ft, &now, &b);
+	assert(b.ctstats.active == 10);
+	assert(b.ctstats.rejectedInserts == 0);
+	assert(b.ctstats.resizes > 0);
+	assert(b.ctstats.size > 2 && b.ctstats.size <= 16);
+	fragTableDestroy(ft);
+
+	// Sharded; the stats for all shards are summed
+	struct fragStats shards[2];
+	struct FragTable* fts[2];
+	for (int i = 0; i < 2; i++) {
+		fts[i] = fragTableCreate(2, 3, 4, 1500, 100);
+		fragUseStats(fts[i], shards + i);
+		shards[i].nShards = 2;
+	}
+	for (key.id = 1; key.id <= 3; key.id++) {
+		rc = fragInsertFirst(fts[key.id % 2], &now, &key, 5, NULL, NULL, 0);
+		assert(rc == 0);
+	}
+	fragSumStats(shards, &b);
+	assert(b.ctstats.size == 4);
+	assert(b.ctstats.active == 3);
+	assert(b.ctstats.inserts == 3);
+	assert(b.bucketsMax == 6);
+	assert(b.fragsMax == 8);
+	shards[0].nShards = 0;		/* Not sharded */
+	fragSumStats(shards, &b);
+	assert(b.ctstats.active == 1);
+	for (int i = 0; i < 2; i++)
+		fragTableDestroy(fts[i]);
 	
 	printf("==== fragutils-test OK\n");
 	return 0;
@@ -0,0 +1,172 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+#include <hash.h>
+#include <iputils.h>
+#include <conntrack.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <netinet/in.h>
+
+/*
+  Generate unique IPv4 keys as nfqlb would see them from a client
+  network to a VIP; sources 10.x.y.z (sequential) with random ports,
+  dst 10.0.0.0:80.
+ */
+static void makeKey(struct ctKey* key, unsigned i, unsigned* seed)
+{
+	memset(key, 0, sizeof(*key));
+	key->src.s6_addr[10] = 0xff;
+	key->src.s6_addr[11] = 0xff;
+	key->src.s6_addr[12] = 10;
+	key->src.s6_addr[13] = (i >> 16) & 0xff;
+	key->src.s6_addr[14] = (i >> 8) & 0xff;
+	key->src.s6_addr[15] = i & 0xff;
+	key->dst.s6_addr[10] = 0xff;
+	key->dst.s6_addr[11] = 0xff;
+	key->dst.s6_addr[12] = 10;
+	key->ports.proto = IPPROTO_TCP;
+	key->ports.src = htons(1024 + rand_r(seed) % 64000);
+	key->ports.dst = htons(80);
+}
+
+/*
+  Chi-square of hashing n keys into M buckets (as Maglev lookup). For
+  a uniform hash the expected value is M-1 with stddev sqrt(2(M-1)).
+ */
+static double chiSquare(unsigned fn, unsigned M, unsigned n, unsigned len)
+{
+	unsigned* buckets = calloc(M, sizeof(unsigned));
+	unsigned seed = 1;
+	struct ctKey key;
+	hashSetFunction(fn, 0);
+	for (unsigned i = 0; i < n; i++) {
+		makeKey(&key, i, &seed);
+		buckets[HASH(&key, len) % M]++;
+	}
+	double e = (double)n / M, chi2 = 0.0;
+	for (unsigned i = 0; i < M; i++)
+		chi2 += (buckets[i] - e) * (buckets[i] - e) / e;
+	free(buckets);
+	return chi2;
+}
+
+// (no -lm)
+static unsigned isqrt(unsigned n)
+{
+	unsigned r = 0;
+	while ((r + 1) * (r + 1) <= n) r++;
+	return r;
+}
+
+static void testDistribution(unsigned M)
+{
+	double lim = (M - 1) + 5 * (isqrt(2 * (M - 1)) + 1);
+	struct { char const* name; unsigned len; } keys[] = {
+		{"key", sizeof(struct ctKey)},
+		{"addresses", sizeof(struct in6_addr) * 2},
+	};
+	for (int k = 0; k < 2; k++) {
+		double djb2 = chiSquare(HASH_DJB2, M, 100 * M, keys[k].len);
+		double wy = chiSquare(HASH_WYHASH, M, 100 * M, keys[k].len);
+		printf(
+			"  M=%u %-9s chi2; djb2=%.0f, wyhash=%.0f (expected %u, lim %.0f)\n",
+			M, keys[k].name, djb2, wy, M - 1, lim);
+		assert(wy < lim);
+	}
+}
+
+static uint64_t nsNow(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void bench(unsigned loops)
+{
+	struct ctKey key;
+	unsigned seed = 1;
+	makeKey(&key, 1, &seed);
+	volatile uint32_t sink = 0;
+	for (unsigned fn = HASH_DJB2; fn <= HASH_WYHASH; fn++) {
+		hashSetFunction(fn, 0);
+		uint64_t t0 = nsNow();
+		for (unsigned i = 0; i < loops; i++) {
+			key.ports.src = i;
+			sink += hashKey(&key, 0);
+		}
+		uint64_t ns = nsNow() - t0;
+		printf(
+			"  %-6s %.2f ns/hashKey (IPv4)\n", hashFunctionName(fn),
+			(double)ns / loops);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		bench(argc > 2 ? atoi(argv[2]) : 10000000);
+		return 0;
+	}
+
+	// djb2 must not change (fwmarks would change)
+	assert(djb2_hash((uint8_t const*)"", 0) == 5381);
+	assert(djb2_hash((uint8_t const*)"a", 1) == 5381 * 33 + 'a');
+	assert(hashFunction() == HASH_DJB2);
+
+	// Selection and seed
+	struct ctKey key;
+	unsigned seed = 1;
+	makeKey(&key, 1, &seed);
+	hashSetFunction(HASH_WYHASH, 0);
+	uint32_t h0 = HASH(&key, sizeof(key));
+	assert(h0 == wy_hash((uint8_t const*)&key, sizeof(key), 0));
+	assert(h0 == HASH(&key, sizeof(key)));
+	hashSetFunction(HASH_WYHASH, 1);
+	assert(h0 != HASH(&key, sizeof(key)));
+	assert(hashSeed() == 1);
+	hashSetFunction(HASH_DJB2, 1);
+	assert(HASH(&key, sizeof(key)) == djb2_hash((uint8_t*)&key, sizeof(key)));
+
+	// All lengths (tail handling)
+	uint8_t buf[64] = {0};
+	for (unsigned len = 1; len < sizeof(buf); len++) {
+		h0 = wy_hash(buf, len, 0);
+		buf[len - 1] = 1;
+		assert(wy_hash(buf, len, 0) != h0);
+		buf[len - 1] = 0;
+	}
+
+	// The IPv4 fast-path must give the same hash as the mapped form
+	hashSetFunction(HASH_DJB2, 0);
+	for (unsigned i = 0; i < 1000; i++) {
+		makeKey(&key, i * 7919, &seed);
+		assert(ctKeyIsIpv4(&key));
+		assert(hashKey(&key, 0) == djb2_hash((uint8_t*)&key, sizeof(key)));
+		assert(hashKeyAddresses(&key) ==
+			   djb2_hash((uint8_t*)&key, sizeof(struct in6_addr) * 2));
+	}
+	key.src.s6_addr[0] = 0xfd;
+	assert(!ctKeyIsIpv4(&key));
+	assert(hashKey(&key, 0) == djb2_hash((uint8_t*)&key, sizeof(key)));
+
+	assert(hashParseFunction("djb2") == HASH_DJB2);
+	assert(hashParseFunction("wyhash") == HASH_WYHASH);
+	assert(hashParseFunction("md5") == -1);
+	assert(strcmp(hashFunctionName(HASH_WYHASH), "wyhash") == 0);
+
+	// Distribution over Maglev lookup tables
+	testDistribution(997);
+	testDistribution(10007);
+
+	hashSetFunction(HASH_DJB2, 0);
+	printf("==== hash-test OK\n");
+	return 0;
+}
@@ -10,6 +10,100 @@
 #include <sys/un.h>
 #include <stddef.h>
 #include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/ether.h>
+#include <arpa/inet.h>
+
+/*
+  An IPv6 TCP packet with a long extension header chain, truncated
+  to a copy range of 128 byte. The L4 header is not copied, so only
+  the addresses can be used.
+ */
+static void truncatedIpv6(void)
+{
+	uint8_t pkt[256] = {0};
+	struct ip6_hdr* ip6hdr = (struct ip6_hdr*)pkt;
+	ip6hdr->ip6_vfc = 6 << 4;
+	ip6hdr->ip6_nxt = IPPROTO_HOPOPTS;
+	inet_pton(AF_INET6, "1000::1", &ip6hdr->ip6_src);
+	inet_pton(AF_INET6, "1000::2", &ip6hdr->ip6_dst);
+	struct ip6_ext* xh = (struct ip6_ext*)(pkt + sizeof(*ip6hdr));
+	xh->ip6e_nxt = IPPROTO_DSTOPTS;
+	xh->ip6e_len = 8;
+	xh = (void*)xh + xh->ip6e_len * 8;
+	xh->ip6e_nxt = IPPROTO_TCP;
+	xh->ip6e_len = 4;
+	struct tcphdr* tcp = (void*)xh + xh->ip6e_len * 8;
+	tcp->source = htons(4000);
+	tcp->dest = htons(80);
+	unsigned len = (void*)(tcp + 1) - (void*)pkt;
+	assert(len > 128);
+
+	struct ctKey key;
+	assert(getHashKey(&key, 0, NULL, ETH_P_IPV6, pkt, len, 0) == 0);
+	assert(key.ports.proto == IPPROTO_TCP);
+	assert(ntohs(key.ports.dst) == 80);
+
+	assert(getHashKey(&key, 0, NULL, ETH_P_IPV6, pkt, 128, 0) < 0);
+	assert(getHashKeyAddresses(&key, NULL, ETH_P_IPV6, pkt, 128) == 32);
+	assert(IN6_ARE_ADDR_EQUAL(&key.src, &ip6hdr->ip6_src));
+	assert(IN6_ARE_ADDR_EQUAL(&key.dst, &ip6hdr->ip6_dst));
+	assert(key.id == 0);
+	assert(getHashKeyAddresses(&key, NULL, ETH_P_IPV6, pkt, 20) < 0);
+}
+
+/*
+  As truncatedIpv6() but a first fragment with the fragment header
+  within the copy range. The fragment bits must be kept, or the
+  sub-sequent fragments are not handled.
+ */
+static void truncatedIpv6Frag(void)
+{
+	uint8_t pkt[256] = {0};
+	struct ip6_hdr* ip6hdr = (struct ip6_hdr*)pkt;
+	ip6hdr->ip6_vfc = 6 << 4;
+	ip6hdr->ip6_nxt = IPPROTO_HOPOPTS;
+	inet_pton(AF_INET6, "1000::1", &ip6hdr->ip6_src);
+	inet_pton(AF_INET6, "1000::2", &ip6hdr->ip6_dst);
+	struct ip6_ext* xh = (struct ip6_ext*)(pkt + sizeof(*ip6hdr));
+	xh->ip6e_nxt = IPPROTO_FRAGMENT;
+	xh->ip6e_len = 1;
+	struct ip6_frag* fh = (void*)xh + xh->ip6e_len * 8;
+	fh->ip6f_nxt = IPPROTO_DSTOPTS;
+	fh->ip6f_ident = htonl(4711);
+	xh = (struct ip6_ext*)(fh + 1);
+	xh->ip6e_nxt = IPPROTO_TCP;
+	xh->ip6e_len = 12;
+	struct tcphdr* tcp = (void*)xh + xh->ip6e_len * 8;
+	tcp->source = htons(4000);
+	tcp->dest = htons(80);
+	unsigned len = (void*)(tcp + 1) - (void*)pkt;
+	assert(len > 128);
+
+	struct ctKey key;
+	uint64_t fragid = 0;
+	assert(getHashKey(&key, 0, &fragid, ETH_P_IPV6, pkt, len, 0) == 1);
+	assert(fragid == htonl(4711));
+	assert(key.ports.proto == IPPROTO_TCP);
+	assert(ntohs(key.ports.dst) == 80);
+
+	fragid = 0;
+	assert(getHashKey(&key, 0, &fragid, ETH_P_IPV6, pkt, 128, 0) < 0);
+	assert(getHashKeyAddresses(&key, &fragid, ETH_P_IPV6, pkt, 128) == 33);
+	assert(fragid == htonl(4711));
+	assert(IN6_ARE_ADDR_EQUAL(&key.src, &ip6hdr->ip6_src));
+	assert(key.ports.proto == 0);
+
+	// The fragment header beyond the copy range. Can't be detected
+	assert(getHashKeyAddresses(&key, &fragid, ETH_P_IPV6, pkt, 48) == 32);
+
+	// Non-first fragment
+	fh->ip6f_offlg = htons(100 << 3);
+	assert(getHashKey(&key, 0, &fragid, ETH_P_IPV6, pkt, 128, 0) == 2);
+	assert(getHashKeyAddresses(&key, &fragid, ETH_P_IPV6, pkt, 128) == 2);
+	assert(key.id == htonl(4711));
+}
 
 int main(int argc, char* argv[])
 {
@@ -66,6 +160,9 @@ int main(int argc, char* argv[])
 	assert(parseAddress("tcp:100.0.0.256:0", &sas, &len) != 0);
 	assert(parseAddress("tcp:[2000::1::1]:0", &sas, &len) != 0);
 
+	truncatedIpv6();
+	truncatedIpv6Frag();
+
 	printf("=== iputils-test OK\n");
 	return 0;
 }
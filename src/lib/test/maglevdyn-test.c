@@ -6,55 +6,83 @@
 #include "maglevdyn.h"
 #include <prime.h>
 #include <cmd.h>
+#include <die.h>
+#include <shmem.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #define Dx(x)
 #define D(x)
 
 static void targetAddRemove(unsigned M, unsigned N, unsigned A, float lim);
+static void incremental(unsigned M, unsigned N, unsigned width);
+static void randomIncremental(unsigned M, unsigned N, unsigned ops, int weights);
+static void doubleBuffer(unsigned M, unsigned N, unsigned width);
+static void concurrentPublish(unsigned M, unsigned N);
+static void fastMod(void);
+static void weighted(unsigned M, unsigned N);
+static void deterministic(unsigned M, unsigned N, unsigned engine);
+static void engines(unsigned M, unsigned N, unsigned engine);
+static int cmdEngines(int argc, char **argv);
+static int cmdHugepages(int argc, char **argv);
+static void stats(unsigned M, unsigned N, unsigned engine);
+static void convertV1(unsigned M, unsigned N);
 static int cmdTest(int argc, char **argv);
+static int cmdBench(int argc, char **argv);
 
 int main(int argc, char* argv[])
 {
 	srand(time(NULL));
 
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+		return cmdBench(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "engines") == 0)
+		return cmdEngines(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "hugepages") == 0)
+		return cmdHugepages(argc - 1, argv + 1);
 	if (argc > 1)
 		return cmdTest(argc, argv);
 
 	unsigned int M=1000, N=100, len, i, j;
 	struct MagDataDyn m;
 	void* mem;
-	unsigned* row;
 
-	len = magDataDyn_len(M, N);
+	len = magDataDyn_len(M, N, 0);
 	mem = malloc(len);
-	magDataDyn_init(M, N, mem, len);
+	magDataDyn_init(M, N, 0, MAGDYN_MAGLEV, 0, mem, len);
 	magDataDyn_map(&m, mem);
 	Dx(printf("M=%u, N=%u, len=%u\n", m.M, m.N, len));
 	assert(m.M == primeBelow(M));
 	assert(m.N == N);
+	assert((void*)(m.activeBuf[1] + m.N) - mem <= len);
+	uint8_t* seen = malloc(m.M);
 	for (i = 0; i < m.N; i++) {
-		row = m.permutation[i];
-		assert((void*)row - (void*)m.lookup < len);
+		// Must be a permutation of 0..M-1
+		memset(seen, 0, m.M);
 		for (j = 0; j < m.M; j++) {
-			assert(row[j] < m.M);
+			unsigned c = magDataDyn_permutation(&m, i, j);
+			assert(c < m.M);
+			assert(!seen[c]);
+			seen[c] = 1;
 		}
 		assert(m.active[i] == -1);
-		assert(m.lookup[i] == -1);
+		assert(magDataDyn_slot(&m, i) == -1);
 	}
+	free(seen);
 	m.active[0] = 100;
 	magDataDyn_populate(&m);
 	for (i = 0; i < m.N; i++) {
-		assert(m.lookup[i] == 0);
+		assert(magDataDyn_slot(&m, i) == 0);
 	}
 	m.active[1] = 101;
 	magDataDyn_populate(&m);
 	for (i = 0; i < m.N; i++) {
-		assert(m.lookup[i] < 2);
+		assert(magDataDyn_slot(&m, i) < 2);
 	}
 	magDataDyn_free(&m);
 	free(mem);
@@ -68,18 +96,50 @@ int main(int argc, char* argv[])
 	targetAddRemove(1009, 20, 10, 13.0); /* perfect = 10% */
 	targetAddRemove(10009, 100, 50, 5.0); /* perfect = 2% */
 
+	incremental(109, 20, 0);
+	incremental(10009, 100, 0);
+	incremental(10009, 100, 4);
+	randomIncremental(109, 10, 1000, 0);
+	randomIncremental(10009, 50, 500, 0);
+	randomIncremental(10009, 20, 500, 1);
+	doubleBuffer(1009, 20, 1);
+	doubleBuffer(1009, 20, 2);
+	doubleBuffer(1009, 20, 4);
+	concurrentPublish(1009, 4);
+	fastMod();
+	weighted(10007, 10);
+	weighted(993997, 100);
+	deterministic(1009, 20, MAGDYN_MAGLEV);
+	deterministic(10007, 100, MAGDYN_MAGLEV);
+	deterministic(1009, 20, MAGDYN_HRW);
+	engines(10007, 10, MAGDYN_HRW);
+	engines(10007, 20, MAGDYN_JUMP);
+	engines(1009, 4, MAGDYN_JUMP);
+	stats(10007, 10, MAGDYN_MAGLEV);
+	stats(10007, 10, MAGDYN_HRW);
+	convertV1(1009, 20);
+
 	printf("==== maglevdyn-test OK\n");
 	return 0;
 }
 
 
-static void* create(unsigned M, unsigned N)
+static void* createW(unsigned M, unsigned N, unsigned width)
 {
-	unsigned len = magDataDyn_len(M, N);
+	unsigned len = magDataDyn_len(M, N, width);
 	void* mem = malloc(len);
-	magDataDyn_init(M, N, mem, len);
+	magDataDyn_init(M, N, width, MAGDYN_MAGLEV, 0, mem, len);
 	return mem;
 }
+static void* create(unsigned M, unsigned N)
+{
+	return createW(M, N, 0);
+}
+static void saveLookup(struct MagDataDyn* m, int* lookup)
+{
+	for (int i = 0; i < m->M; i++)
+		lookup[i] = magDataDyn_slot(m, i);
+}
 
 static float addTargets(void* mem, unsigned n)
 {
@@ -87,10 +147,10 @@ static float addTargets(void* mem, unsigned n)
 	magDataDyn_map(&m, mem);
 	// Save the lookup table
 	int lookup[m.M];
-	memcpy(lookup, m.lookup, sizeof(lookup));
+	saveLookup(&m, lookup);
 	for (int i = 0; i < m.N && n > 0; i++) {
 		if (m.active[i] < 0) {
-			m.active[i] = 1;
+			m.active[i] = 100 + i;	/* Unique fwmarks */
 			n--;
 		}
 	}
@@ -99,7 +159,7 @@ static float addTargets(void* mem, unsigned n)
 	// Compute the update impact in percent
 	unsigned ndiff = 0;
 	for (int i = 0; i < m.M; i++) {
-		if (lookup[i] != m.lookup[i])
+		if (lookup[i] != magDataDyn_slot(&m, i))
 			ndiff++;
 	}
 	magDataDyn_free(&m);
@@ -112,7 +172,7 @@ static float removeTargets(void* mem, unsigned n)
 	magDataDyn_map(&m, mem);
 	// Save the lookup table
 	int lookup[m.M];
-	memcpy(lookup, m.lookup, sizeof(lookup));
+	saveLookup(&m, lookup);
 	for (int i = 0; i < m.N && n > 0; i++) {
 		if (m.active[i] >= 0) {
 			m.active[i] = -1;
@@ -124,7 +184,7 @@ static float removeTargets(void* mem, unsigned n)
 	// Compute the update impact in percent
 	unsigned ndiff = 0;
 	for (int i = 0; i < m.M; i++) {
-		if (lookup[i] != m.lookup[i])
+		if (lookup[i] != magDataDyn_slot(&m, i))
 			ndiff++;
 	}
 	magDataDyn_free(&m);
@@ -148,6 +208,702 @@ static void targetAddRemove(
 	free(mem);
 }
 
+/*
+  Check that incremental updates only changes slots of the added or
+  removed target and that the result is balanced (+-1).
+ */
+static unsigned diffSlots(struct MagDataDyn* m, int* lookup, int index)
+{
+	unsigned ndiff = 0;
+	for (int i = 0; i < m->M; i++) {
+		if (lookup[i] != magDataDyn_slot(m, i)) {
+			assert(lookup[i] == index || magDataDyn_slot(m, i) == index);
+			ndiff++;
+		}
+	}
+	return ndiff;
+}
+static void checkBalance(struct MagDataDyn* m)
+{
+	unsigned count[m->N], nActive = 0, min = m->M, max = 0;
+	memset(count, 0, sizeof(count));
+	for (int i = 0; i < m->M; i++) {
+		assert(magDataDyn_slot(m, i) >= 0);
+		assert(m->active[magDataDyn_slot(m, i)] >= 0);
+		count[magDataDyn_slot(m, i)]++;
+	}
+	for (int i = 0; i < m->N; i++) {
+		if (m->active[i] < 0) continue;
+		nActive++;
+		if (count[i] < min) min = count[i];
+		if (count[i] > max) max = count[i];
+	}
+	Dx(printf("nActive=%u, min=%u, max=%u\n", nActive, min, max));
+	assert(max - min <= 1);
+}
+static void incremental(unsigned M, unsigned N, unsigned width)
+{
+	void* mem = createW(M, N, width);
+	struct MagDataDyn m;
+	magDataDyn_map(&m, mem);
+	int lookup[m.M];
+	unsigned n;
+
+	for (int i = 0; i < m.N; i++) {
+		saveLookup(&m, lookup);
+		n = magDataDyn_activate(&m, i, 100 + i);
+		assert(n == diffSlots(&m, lookup, i));
+		assert(n == m.M / (i + 1));
+		checkBalance(&m);
+	}
+	assert(magDataDyn_activate(&m, 0, 200) == 0);
+	assert(m.active[0] == 200);
+	for (int i = 0; i < m.N - 1; i += 3) {
+		saveLookup(&m, lookup);
+		n = magDataDyn_deactivate(&m, i);
+		assert(n > 0);
+		assert(n == diffSlots(&m, lookup, i));
+		assert(m.active[i] == -1);
+		checkBalance(&m);
+	}
+	assert(magDataDyn_deactivate(&m, 0) == 0);
+	for (int i = 0; i < m.N; i++)
+		magDataDyn_deactivate(&m, i);
+	for (int i = 0; i < m.M; i++)
+		assert(magDataDyn_slot(&m, i) == -1);
+	magDataDyn_free(&m);
+	free(mem);
+}
+
+/*
+  A random sequence of incremental activate/deactivate. After each
+  update every slot must map to an active target and every target
+  must have it's share of slots +-1.
+ */
+static void checkShareBound(struct MagDataDyn* m)
+{
+	unsigned count[m->N], wsum = 0;
+	memset(count, 0, sizeof(count));
+	for (int i = 0; i < m->N; i++) {
+		if (m->active[i] >= 0)
+			wsum += m->weight[i];
+	}
+	for (int i = 0; i < m->M; i++) {
+		int s = magDataDyn_slot(m, i);
+		if (wsum == 0) {
+			assert(s == -1);
+			continue;
+		}
+		assert(s >= 0 && s < m->N);
+		assert(m->active[s] >= 0);
+		count[s]++;
+	}
+	for (int i = 0; i < m->N; i++) {
+		if (m->active[i] < 0) {
+			assert(count[i] == 0);
+			continue;
+		}
+		double share = (double)m->M * m->weight[i] / wsum;
+		if (count[i] < share - 1.0 || count[i] > share + 1.0)
+			printf("Share %u; target=%d, count=%u, share=%.1f\n",
+				   i, m->active[i], count[i], share);
+		assert(count[i] >= share - 1.0 && count[i] <= share + 1.0);
+	}
+}
+static void randomIncremental(unsigned M, unsigned N, unsigned ops, int weights)
+{
+	void* mem = create(M, N);
+	struct MagDataDyn m;
+	magDataDyn_map(&m, mem);
+	int lookup[m.M];
+	for (unsigned op = 0; op < ops; op++) {
+		unsigned i = rand() % m.N;
+		saveLookup(&m, lookup);
+		unsigned n;
+		if (m.active[i] < 0) {
+			if (weights)
+				m.weight[i] = rand() % 4 + 1;
+			n = magDataDyn_activate(&m, i, 100 + i);
+			assert(m.active[i] == 100 + i);
+		} else {
+			n = magDataDyn_deactivate(&m, i);
+			assert(m.active[i] == -1);
+		}
+		assert(n == diffSlots(&m, lookup, i));
+		checkShareBound(&m);
+	}
+	magDataDyn_free(&m);
+	free(mem);
+}
+
+/*
+  Updates are not seen by readers until published.
+ */
+static void doubleBuffer(unsigned M, unsigned N, unsigned width)
+{
+	void* mem = createW(M, N, width);
+	struct MagDataDyn m;
+	magDataDyn_map(&m, mem);
+	assert(magDataDyn_generation(&m) == 0);
+	for (unsigned h = 0; h < m.M; h++)
+		assert(magDataDyn_lookup(&m, h) == -1);
+
+	magDataDyn_edit(&m);
+	m.active[0] = 100;
+	magDataDyn_populate(&m);
+	for (unsigned h = 0; h < m.M; h++)
+		assert(magDataDyn_lookup(&m, h) == -1);
+	assert(magDataDyn_publish(&m) == 1);
+	for (unsigned h = 0; h < m.M; h++)
+		assert(magDataDyn_lookup(&m, h) == 100);
+
+	// A publish without edit is a no-op
+	assert(magDataDyn_publish(&m) == 1);
+
+	magDataDyn_edit(&m);
+	assert(m.active[0] == 100);	/* A copy of the current */
+	magDataDyn_activate(&m, 1, 101);
+	for (unsigned h = 0; h < m.M; h++)
+		assert(magDataDyn_lookup(&m, h) == 100);
+	assert(magDataDyn_publish(&m) == 2);
+	unsigned n101 = 0;
+	for (unsigned h = 0; h < m.M; h++) {
+		if (magDataDyn_lookup(&m, h) == 101)
+			n101++;
+	}
+	assert(n101 == m.M / 2);
+
+	// Another mapping sees the current generation
+	struct MagDataDyn m2;
+	magDataDyn_map(&m2, mem);
+	assert(m2.lookup == m.lookup);
+	assert(m2.active[1] == 101);
+	magDataDyn_free(&m2);
+	magDataDyn_free(&m);
+	free(mem);
+}
+
+/*
+  Lookups while tables are published back-to-back. Every table has
+  active targets, so a lookup must never return -1 (a lookup entry from
+  one table and the active from another).
+ */
+struct ReaderArg {
+	struct MagDataDyn* m;
+	int stop;
+	unsigned lookups;
+};
+static void* readerThread(void* _arg)
+{
+	struct ReaderArg* arg = _arg;
+	unsigned h = 0;
+	while (!__atomic_load_n(&arg->stop, __ATOMIC_RELAXED)) {
+		assert(magDataDyn_lookup(arg->m, h++) >= 0);
+		arg->lookups++;
+	}
+	return NULL;
+}
+static void concurrentPublish(unsigned M, unsigned N)
+{
+	void* mem = create(M, N);
+	struct MagDataDyn m;
+	magDataDyn_map(&m, mem);
+	magDataDyn_edit(&m);
+	m.active[0] = 100;
+	m.active[1] = 101;
+	magDataDyn_populate(&m);
+	magDataDyn_publish(&m);
+	struct ReaderArg arg = {&m, 0, 0};
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, readerThread, &arg) != 0)
+		die("Failed to start pthread\n");
+	for (unsigned i = 0; i < 2000; i++) {
+		// Swap between targets {0,1} and {2,3}
+		unsigned a = (i % 2) * 2, b = 2 - a;
+		magDataDyn_edit(&m);
+		m.active[a] = 100 + a;
+		m.active[a + 1] = 101 + a;
+		m.active[b] = -1;
+		m.active[b + 1] = -1;
+		magDataDyn_populate(&m);
+		magDataDyn_publish(&m);
+	}
+	__atomic_store_n(&arg.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	D(printf("concurrentPublish: lookups=%u\n", arg.lookups));
+	assert(arg.lookups > 0);
+	magDataDyn_free(&m);
+	free(mem);
+}
+
+/*
+  The share of slots must follow the weights. Check both a full
+  populate and incremental activate/deactivate.
+ */
+static void checkShares(struct MagDataDyn* m)
+{
+	unsigned count[m->N];
+	uint64_t wsum = 0;
+	memset(count, 0, sizeof(count));
+	for (int i = 0; i < m->M; i++)
+		count[magDataDyn_slot(m, i)]++;
+	for (int i = 0; i < m->N; i++) {
+		if (m->active[i] >= 0)
+			wsum += m->weight[i];
+	}
+	for (int i = 0; i < m->N; i++) {
+		if (m->active[i] < 0) {
+			assert(count[i] == 0);
+			continue;
+		}
+		double expected = (double)m->M * m->weight[i] / wsum;
+		Dx(printf("%d: w=%u, count=%u, expected=%.1f\n", i, m->weight[i], count[i], expected));
+		assert(count[i] + 2.0 >= expected && count[i] <= expected + 2.0);
+	}
+}
+static void weighted(unsigned M, unsigned N)
+{
+	void* mem = create(M, N);
+	struct MagDataDyn m;
+	magDataDyn_map(&m, mem);
+
+	// Mix of 16 and 64 core machines, and some odd weights
+	for (int i = 0; i < m.N; i++) {
+		m.active[i] = 100 + i;
+		m.weight[i] = (i % 3 == 0) ? 64 : ((i % 3 == 1) ? 16 : 5 + i);
+	}
+	magDataDyn_populate(&m);
+	checkShares(&m);
+
+	magDataDyn_deactivate(&m, 0);
+	checkShares(&m);
+	magDataDyn_deactivate(&m, 1);
+	checkShares(&m);
+	m.weight[1] = 200;
+	magDataDyn_activate(&m, 1, 101);
+	checkShares(&m);
+	m.weight[0] = 1;
+	magDataDyn_activate(&m, 0, 100);
+	checkShares(&m);
+
+	// Equal weights (not 1) gives the same as weight 1
+	int* lookup = malloc(m.M * sizeof(int));
+	for (int i = 0; i < m.N; i++)
+		m.weight[i] = 1;
+	magDataDyn_populate(&m);
+	saveLookup(&m, lookup);
+	for (int i = 0; i < m.N; i++)
+		m.weight[i] = 7;
+	magDataDyn_populate(&m);
+	for (int i = 0; i < m.M; i++)
+		assert(lookup[i] == magDataDyn_slot(&m, i));
+	free(lookup);
+
+	magDataDyn_free(&m);
+	free(mem);
+}
+
+/*
+  Nodes with the same seed and targets must get the same table, even
+  if the targets are on different indexes in active[].
+ */
+static void* createEngine(
+	unsigned M, unsigned N, unsigned engine, uint32_t seed)
+{
+	unsigned len = magDataDyn_len(M, N, 0);
+	void* mem = malloc(len);
+	magDataDyn_init(M, N, 0, engine, seed, mem, len);
+	return mem;
+}
+static void deterministic(unsigned M, unsigned N, unsigned engine)
+{
+	void* mem1 = createEngine(M, N, engine, 17);
+	void* mem2 = createEngine(M, N, engine, 17);
+	void* mem3 = createEngine(M, N, engine, 18);
+	struct MagDataDyn m1, m2, m3;
+	magDataDyn_map(&m1, mem1);
+	magDataDyn_map(&m2, mem2);
+	magDataDyn_map(&m3, mem3);
+	assert(m1.seed == 17);
+	unsigned n = N / 2;
+	for (unsigned i = 0; i < n; i++) {
+		m1.active[i] = 100 + i;
+		m1.weight[i] = 1 + i % 3;
+		m2.active[N - 1 - i] = 100 + i; /* reverse order */
+		m2.weight[N - 1 - i] = 1 + i % 3;
+		m3.active[i] = 100 + i;
+		m3.weight[i] = 1 + i % 3;
+	}
+	magDataDyn_populate(&m1);
+	magDataDyn_populate(&m2);
+	magDataDyn_populate(&m3);
+	for (unsigned i = 0; i < m1.M; i++)
+		assert(magDataDyn_lookup(&m1, i) == magDataDyn_lookup(&m2, i));
+	assert(magDataDyn_checksum(&m1) == magDataDyn_checksum(&m2));
+	assert(magDataDyn_checksum(&m1) != magDataDyn_checksum(&m3));
+
+	// Same fwmark on many indexes gives different permutations
+	m1.active[n] = 100;
+	magDataDyn_populate(&m1);
+	if (engine == MAGDYN_MAGLEV)
+		assert(m1.offset[0] != m1.offset[n] || m1.skip[0] != m1.skip[n]);
+	assert(magDataDyn_checksum(&m1) != magDataDyn_checksum(&m2));
+
+	magDataDyn_free(&m1);
+	magDataDyn_free(&m2);
+	magDataDyn_free(&m3);
+	free(mem1);
+	free(mem2);
+	free(mem3);
+}
+
+/*
+  Engines other than maglev. All slots must be used, the balance must
+  be reasonable (random, so +-25%) and scale events must only move the
+  slots of the changed target.
+ */
+static void engineBalance(struct MagDataDyn* m)
+{
+	unsigned count[m->N], nActive = 0;
+	memset(count, 0, sizeof(count));
+	for (int i = 0; i < m->M; i++) {
+		assert(magDataDyn_slot(m, i) >= 0);
+		assert(m->active[magDataDyn_slot(m, i)] >= 0);
+		count[magDataDyn_slot(m, i)]++;
+	}
+	for (int i = 0; i < m->N; i++) {
+		if (m->active[i] >= 0) nActive++;
+	}
+	unsigned share = m->M / nActive;
+	for (int i = 0; i < m->N; i++) {
+		if (m->active[i] < 0) continue;
+		Dx(printf("%d: count=%u, share=%u\n", i, count[i], share));
+		assert(count[i] * 4 >= share * 3 && count[i] * 4 <= share * 5);
+	}
+}
+static void engines(unsigned M, unsigned N, unsigned engine)
+{
+	void* mem = createEngine(M, N, engine, 0);
+	struct MagDataDyn m;
+	magDataDyn_map(&m, mem);
+	assert(m.engine == engine);
+	for (int i = 0; i < m.N; i++)
+		m.active[i] = 100 + i;
+	magDataDyn_populate(&m);
+	engineBalance(&m);
+
+	int* lookup = malloc(m.M * sizeof(int));
+	unsigned n;
+	for (int i = 0; i < m.N - 1; i += 3) {
+		saveLookup(&m, lookup);
+		n = magDataDyn_deactivate(&m, i);
+		assert(n > 0);
+		assert(n == diffSlots(&m, lookup, i));
+		assert(m.active[i] == -1);
+		engineBalance(&m);
+	}
+	for (int i = 0; i < m.N - 1; i += 3) {
+		saveLookup(&m, lookup);
+		n = magDataDyn_activate(&m, i, 100 + i);
+		assert(n > 0);
+		assert(n == diffSlots(&m, lookup, i));
+		engineBalance(&m);
+	}
+	free(lookup);
+	magDataDyn_free(&m);
+	free(mem);
+}
+
+/*
+  Statistics are recorded for populate and incremental updates.
+ */
+static void stats(unsigned M, unsigned N, unsigned engine)
+{
+	void* mem = createEngine(M, N, engine, 0);
+	struct MagDataDyn m;
+	magDataDyn_map(&m, mem);
+	assert(m.stats->active == 0);
+	for (int i = 0; i < m.N; i++)
+		m.active[i] = 100 + i;
+	magDataDyn_populate(&m);
+	struct MagDataDynStats const* st = m.stats;
+	assert(st->changed == m.M);
+	assert(st->active == m.N);
+	assert(st->min <= m.M / m.N && st->max >= m.M / m.N);
+	if (engine == MAGDYN_MAGLEV) {
+		assert(st->max - st->min <= 1);
+		assert(st->stddev < 1.0);
+	}
+	assert(st->stddev <= st->max - st->min);
+	assert(st->duration > 0);
+	magDataDyn_populate(&m);
+	assert(st->changed == 0);
+
+	unsigned n = magDataDyn_deactivate(&m, 3);
+	assert(st->changed == n);
+	assert(st->active == m.N - 1);
+	n = magDataDyn_activate(&m, 3, 103);
+	assert(st->changed == n);
+	assert(st->active == m.N);
+	magDataDyn_free(&m);
+	free(mem);
+}
+
+static void fastMod(void)
+{
+	unsigned Ms[] = {3, 997, 10007, 993997};
+	struct MagDataDyn m;
+	for (int i = 0; i < 4; i++) {
+		m.M = Ms[i];
+		m.modM = UINT64_MAX / m.M + 1;
+		assert(magDataDyn_mod(&m, 0) == 0);
+		assert(magDataDyn_mod(&m, UINT32_MAX) == UINT32_MAX % m.M);
+		for (int j = 0; j < 100000; j++) {
+			uint32_t h = ((uint32_t)rand() << 16) ^ rand();
+			assert(magDataDyn_mod(&m, h) == h % m.M);
+		}
+	}
+}
+
+static uint64_t nsNow(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// The lookup before narrow entries and fast modulo (width=4)
+static inline int lookupMod(struct MagDataDyn const* m, unsigned hash)
+{
+	unsigned g = __atomic_load_n(m->generation, __ATOMIC_ACQUIRE) & 1;
+	int i = ((int const*)m->lookupBuf[g])[hash % m->M];
+	return i < 0 ? -1 : m->activeBuf[g][i];
+}
+
+/*
+  Measure lookups/s with random hashes for different entry widths.
+  The hashes are pre-computed to measure only the table lookup.
+ */
+static int cmdBench(int argc, char **argv)
+{
+	char const* M = "993997";
+	char const* N = "100";
+	char const* loops = "20000000";
+	struct Option options[] = {
+		{"help", NULL, 0,
+		 "bench [options]\n"
+		 "  Measure Maglev lookups/s"},
+		{"N", &N, 0, "Maglev max targets"},
+		{"M", &M, 0, "Maglev lookup table size"},
+		{"loops", &loops, 0, "Number of lookups"},
+		{0, 0, 0, 0}
+	};
+	(void)parseOptionsOrDie(argc, argv, options);
+
+	unsigned nloops = atoi(loops);
+	#define NHASH (1 << 20)
+	uint32_t* hashes = malloc(NHASH * sizeof(uint32_t));
+	for (unsigned i = 0; i < NHASH; i++)
+		hashes[i] = ((uint32_t)rand() << 16) ^ rand();
+
+	struct { char const* name; unsigned width; int fastmod; } v[] = {
+		{"int32 %", 4, 0},
+		{"int32 fastmod", 4, 1},
+		{"uint16 fastmod", 2, 1},
+		{"uint8 fastmod", 1, 1},
+	};
+	for (int k = 0; k < 4; k++) {
+		if (v[k].width == 1 && atoi(N) >= UINT8_MAX)
+			continue;
+		void* mem = createW(atoi(M), atoi(N), v[k].width);
+		struct MagDataDyn m;
+		magDataDyn_map(&m, mem);
+		for (int i = 0; i < m.N; i++)
+			m.active[i] = 100 + i;
+		magDataDyn_populate(&m);
+		volatile int sink = 0;
+		int sum = 0;
+		uint64_t t0 = nsNow();
+		if (v[k].fastmod) {
+			for (unsigned i = 0; i < nloops; i++)
+				sum += magDataDyn_lookup(&m, hashes[i & (NHASH - 1)]);
+		} else {
+			for (unsigned i = 0; i < nloops; i++)
+				sum += lookupMod(&m, hashes[i & (NHASH - 1)]);
+		}
+		uint64_t ns = nsNow() - t0;
+		sink = sum;
+		(void)sink;
+		printf(
+			"%-15s M=%u, table=%uKB; %.1f Mlookups/s\n", v[k].name, m.M,
+			m.M * m.width / 1024, (double)nloops * 1000.0 / ns);
+		magDataDyn_free(&m);
+		free(mem);
+	}
+	free(hashes);
+	return 0;
+}
+
+/*
+  Compare the engines; rebuild time, lookups/s, disruption on scale
+  events (percent of the slots moved, the ideal is 100/active) and
+  the balance (max/min slots per target).
+ */
+static float moved(struct MagDataDyn* m, int* lookup)
+{
+	unsigned ndiff = 0;
+	for (int i = 0; i < m->M; i++) {
+		if (lookup[i] != magDataDyn_slot(m, i))
+			ndiff++;
+	}
+	return 100.0 * (float)ndiff / (float)m->M;
+}
+static int cmdEngines(int argc, char **argv)
+{
+	char const* M = "65521";
+	char const* N = "100";
+	char const* A = "50";
+	char const* loops = "20000000";
+	struct Option options[] = {
+		{"help", NULL, 0,
+		 "engines [options]\n"
+		 "  Compare consistent hash engines"},
+		{"N", &N, 0, "Maglev max targets"},
+		{"M", &M, 0, "Maglev lookup table size"},
+		{"active", &A, 0, "Active targets"},
+		{"loops", &loops, 0, "Number of lookups"},
+		{0, 0, 0, 0}
+	};
+	(void)parseOptionsOrDie(argc, argv, options);
+
+	unsigned nloops = atoi(loops), nactive = atoi(A);
+	uint32_t* hashes = malloc(NHASH * sizeof(uint32_t));
+	for (unsigned i = 0; i < NHASH; i++)
+		hashes[i] = ((uint32_t)rand() << 16) ^ rand();
+
+	for (unsigned e = 0; magDataDyn_engineName(e) != NULL; e++) {
+		void* mem = createEngine(atoi(M), atoi(N), e, 0);
+		struct MagDataDyn m;
+		magDataDyn_map(&m, mem);
+		if (nactive == 0 || nactive >= m.N)
+			die("Active must be 1..N-1\n");
+		for (int i = 0; i < nactive; i++)
+			m.active[i] = 100 + i;
+		uint64_t t0 = nsNow();
+		magDataDyn_populate(&m);
+		uint64_t rebuild = nsNow() - t0;
+
+		volatile int sink = 0;
+		int sum = 0;
+		t0 = nsNow();
+		for (unsigned i = 0; i < nloops; i++)
+			sum += magDataDyn_lookup(&m, hashes[i & (NHASH - 1)]);
+		uint64_t ns = nsNow() - t0;
+		sink = sum;
+		(void)sink;
+
+		unsigned count[m.N], min = m.M, max = 0;
+		memset(count, 0, sizeof(count));
+		for (int i = 0; i < m.M; i++)
+			count[magDataDyn_slot(&m, i)]++;
+		for (int i = 0; i < nactive; i++) {
+			if (count[i] < min) min = count[i];
+			if (count[i] > max) max = count[i];
+		}
+
+		int* lookup = malloc(m.M * sizeof(int));
+		saveLookup(&m, lookup);
+		m.active[nactive / 2] = -1;
+		magDataDyn_populate(&m);
+		float fremove = moved(&m, lookup);
+		saveLookup(&m, lookup);
+		m.active[nactive / 2] = 100 + nactive / 2;
+		magDataDyn_populate(&m);
+		float fadd = moved(&m, lookup);
+		free(lookup);
+
+		printf(
+			"%-6s M=%u, active=%u; rebuild %.2f ms, %.1f Mlookups/s, "
+			"moved add/remove %.1f/%.1f%% (ideal %.1f), max/min %.3f\n",
+			magDataDyn_engineName(e), m.M, nactive, rebuild / 1000000.0,
+			(double)nloops * 1000.0 / ns, fadd, fremove, 100.0 / nactive,
+			(double)max / min);
+		magDataDyn_free(&m);
+		free(mem);
+	}
+	free(hashes);
+	return 0;
+}
+
+/*
+  Lookup cost with and without huge pages. The table is in shm
+  created as by "nfqlb init --hugepages=". Latency is measured with
+  dependent lookups (the next hash depends on the previous fwmark).
+ */
+static int cmdHugepages(int argc, char **argv)
+{
+	char const* M = "993997";
+	char const* N = "100";
+	char const* width = "4";
+	char const* loops = "20000000";
+	struct Option options[] = {
+		{"help", NULL, 0,
+		 "hugepages [options]\n"
+		 "  Measure Maglev lookups with and without huge pages"},
+		{"N", &N, 0, "Maglev max targets"},
+		{"M", &M, 0, "Maglev lookup table size"},
+		{"width", &width, 0, "Lookup entry width"},
+		{"loops", &loops, 0, "Number of lookups"},
+		{0, 0, 0, 0}
+	};
+	(void)parseOptionsOrDie(argc, argv, options);
+
+	static char const* const names[] = {"no", "thp", "hugetlb"};
+	char const* shm = "maglevdyn-test-huge";
+	unsigned nloops = atoi(loops);
+	uint32_t* hashes = malloc(NHASH * sizeof(uint32_t));
+	for (unsigned i = 0; i < NHASH; i++)
+		hashes[i] = ((uint32_t)rand() << 16) ^ rand();
+
+	for (int huge = SHM_HUGE_NO; huge <= SHM_HUGE_TLB; huge++) {
+		unsigned len = magDataDyn_len(atoi(M), atoi(N), atoi(width));
+		void* mem = malloc(len);
+		magDataDyn_init(atoi(M), atoi(N), atoi(width), MAGDYN_MAGLEV, 0, mem, len);
+		int used = createSharedDataHuge(shm, mem, len, huge);
+		free(mem);
+		if (used < 0)
+			die("createSharedDataHuge failed\n");
+		mem = mapSharedDataOrDie(shm, O_RDWR);
+		struct MagDataDyn m;
+		magDataDyn_map(&m, mem);
+		for (int i = 0; i < m.N; i++)
+			m.active[i] = 100 + i;
+		magDataDyn_populate(&m);
+
+		volatile int sink = 0;
+		int sum = 0;
+		uint64_t t0 = nsNow();
+		for (unsigned i = 0; i < nloops; i++)
+			sum += magDataDyn_lookup(&m, hashes[i & (NHASH - 1)]);
+		uint64_t ns = nsNow() - t0;
+		t0 = nsNow();
+		for (unsigned i = 0; i < nloops; i++)
+			sum = magDataDyn_lookup(&m, hashes[i & (NHASH - 1)] ^ sum);
+		uint64_t lat = nsNow() - t0;
+		sink = sum;
+		(void)sink;
+		printf(
+			"%-7s (used %-7s) table=%uKB; %.1f Mlookups/s, latency %.2f ns\n",
+			names[huge], names[used], m.M * m.width / 1024,
+			(double)nloops * 1000.0 / ns, (double)lat / nloops);
+		magDataDyn_free(&m);
+		if (deleteSharedData(shm) != 0)
+			die("deleteSharedData failed\n");
+	}
+	free(hashes);
+	return 0;
+}
+
 static int cmdTest(int argc, char **argv)
 {
 	char const* M = "997";
@@ -180,3 +936,49 @@ static int cmdTest(int argc, char **argv)
 }
 
 
+
+/*
+  Format 1 (before the magic); {M, N, len}, int lookup[M], unsigned
+  permutation[N][M], int active[N] and 3 unused unsigned.
+ */
+static void convertV1(unsigned M, unsigned N)
+{
+	unsigned len1 = sizeof(unsigned) * (3 + 3 + M * N) + sizeof(int) * (M + N);
+	unsigned* v1 = calloc(1, len1);
+	v1[0] = M;
+	v1[1] = N;
+	v1[2] = len1;
+	int* lookup = (int*)(v1 + 3);
+	int* active = lookup + M + M * N;
+	for (unsigned i = 0; i < N; i++)
+		active[i] = i % 3 == 0 ? -1 : 200 + i;
+	for (unsigned i = 0; i < M; i++)
+		lookup[i] = 1 + (i % 3 == 0 ? 1 : 0);	/* index 1 or 2 */
+	lookup[M - 1] = 0;						/* not active -> -1 */
+
+	unsigned m, n;
+	assert(magDataDyn_isV1(v1, len1, &m, &n) == 1);
+	assert(m == M && n == N);
+	assert(magDataDyn_isV1(v1, len1 - 1, &m, &n) == 0);
+
+	void* mem = createW(M, N, 0);
+	struct MagDataDyn md;
+	magDataDyn_map(&md, mem);
+	assert(magDataDyn_isV1(mem, magDataDyn_len(M, N, 0), &m, &n) == 0);
+	magDataDyn_convertV1(&md, v1);
+	for (unsigned i = 0; i < N; i++) {
+		assert(md.active[i] == active[i]);
+		assert(md.weight[i] == 1);
+	}
+	for (unsigned i = 0; i < M - 1; i++)
+		assert(magDataDyn_slot(&md, i) == lookup[i]);
+	assert(magDataDyn_slot(&md, M - 1) == -1);
+	assert(magDataDyn_lookup(&md, 0) == active[lookup[0]]);
+
+	// An incremental update works on the converted table
+	assert(magDataDyn_activate(&md, 0, 300) > 0);
+	assert(magDataDyn_deactivate(&md, 0) > 0);
+	magDataDyn_free(&md);
+	free(mem);
+	free(v1);
+}
@@ -0,0 +1,8 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+#include "threadstats.h"
+
+__thread unsigned threadStatsIndex = 0;
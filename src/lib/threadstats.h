@@ -0,0 +1,47 @@
+#pragma once
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+/*
+  Per-thread stats counters
+
+  Counters that are updated for every packet are kept in one block per
+  thread, aligned to cache lines, so the queue threads don't bounce
+  cache lines between them. The blocks may be in shared memory. The
+  reader sums all blocks. Counters are unsigned, so gauges that are
+  incremented and decremented by different threads (e.g. "active")
+  sum up correctly.
+
+  A thread sets its index with threadStatsSetIndex(). Threads with
+  index 0 (the default), or an index out of range, share block 0
+  which is updated with atomic operations. Other blocks have a single
+  writer and are updated with plain (relaxed) loads and stores.
+ */
+
+#define STATS_ALIGN 64
+
+extern __thread unsigned threadStatsIndex;
+
+static inline void threadStatsSetIndex(unsigned index)
+{
+	threadStatsIndex = index;
+}
+
+// The block for the calling thread
+static inline unsigned threadStatsBlock(unsigned nBlocks)
+{
+	unsigned i = threadStatsIndex;
+	return i < nBlocks ? i : 0;
+}
+
+// Add "v" to counter "x" in block "i"
+#define STATS_ADD(i,x,v) do {										\
+		if ((i) == 0)												\
+			__atomic_add_fetch(&(x), (v), __ATOMIC_RELAXED);		\
+		else														\
+			__atomic_store_n(										\
+				&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED) + (v),	\
+				__ATOMIC_RELAXED);									\
+	} while (0)
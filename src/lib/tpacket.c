@@ -0,0 +1,241 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+#include "tpacket.h"
+#include <die.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+static packetHandleFn_t handlePacket = NULL;
+static unsigned queue_length = 1024;
+static unsigned mtu = 1500;
+static struct nfqueueStats* stats = NULL;
+static unsigned first_queue = 0;
+static char const* ingress = NULL;
+
+#define MAX_STEER 64
+struct Steer {
+	int fwmark;
+	struct sockaddr_ll sll;
+};
+static struct Steer steer[MAX_STEER];
+static unsigned nsteer = 0;
+static struct nfqueueCounters dummyCounters;
+
+#define BLOCK_SIZE (1 << 20)
+#define MIN_BLOCKS 4
+
+void tpacketInit(
+	packetHandleFn_t packetHandleFn, unsigned _queue_length, unsigned _mtu)
+{
+	handlePacket = packetHandleFn;
+	queue_length = _queue_length;
+	mtu = _mtu;
+}
+
+void tpacketUseStats(
+	struct nfqueueStats* _stats, unsigned firstQueue, unsigned nQueues)
+{
+	stats = _stats;
+	first_queue = firstQueue;
+	stats->nQueues = nQueues;
+	for (unsigned i = 0; i < nQueues; i++)
+		stats->q[i].queue = firstQueue + i;
+}
+
+void tpacketSetIngress(char const* ifname)
+{
+	ingress = ifname;
+}
+
+static void parseMacOrDie(char const* str, unsigned char* mac)
+{
+	if (sscanf(
+			str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+			mac, mac+1, mac+2, mac+3, mac+4, mac+5) != 6)
+		die("Invalid mac [%s]\n", str);
+}
+
+void tpacketSetSteering(char const* spec)
+{
+	char* str = strdup(spec);
+	char* saveptr = NULL;
+	char* item;
+	for (item = strtok_r(str, ",", &saveptr); item != NULL;
+		 item = strtok_r(NULL, ",", &saveptr)) {
+		if (nsteer >= MAX_STEER)
+			die("Too many steering items, max %u\n", MAX_STEER);
+		char* ifname = strchr(item, ':');
+		if (ifname == NULL)
+			die("Invalid steering [%s]\n", item);
+		*ifname++ = 0;
+		struct Steer* s = steer + nsteer;
+		memset(s, 0, sizeof(*s));
+		s->fwmark = atoi(item);
+		memset(s->sll.sll_addr, 0xff, ETH_ALEN);
+		char* mac = strchr(ifname, '/');
+		if (mac != NULL) {
+			*mac++ = 0;
+			parseMacOrDie(mac, s->sll.sll_addr);
+		}
+		s->sll.sll_family = AF_PACKET;
+		s->sll.sll_ifindex = if_nametoindex(ifname);
+		if (s->sll.sll_ifindex == 0)
+			die("Unknown interface [%s]\n", ifname);
+		s->sll.sll_halen = ETH_ALEN;
+		nsteer++;
+	}
+	free(str);
+}
+
+static struct Steer* findSteer(int fwmark)
+{
+	for (unsigned i = 0; i < nsteer; i++) {
+		if (steer[i].fwmark == fwmark)
+			return steer + i;
+	}
+	return NULL;
+}
+
+/*
+  Open a socket with a TPACKET_V3 rx ring on the ingress interface and
+  join the fanout group. Returns the mapped ring.
+ */
+static void* openRxRing(int* fd, struct tpacket_req3* req)
+{
+	unsigned ifindex = if_nametoindex(ingress);
+	if (ifindex == 0)
+		die("Unknown interface [%s]\n", ingress);
+	*fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (*fd < 0)
+		die("socket AF_PACKET; %s\n", strerror(errno));
+	int v = TPACKET_V3;
+	if (setsockopt(*fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) != 0)
+		die("PACKET_VERSION; %s\n", strerror(errno));
+
+	/* The ring is dimensioned to hold queue_length packets of mtu size */
+	unsigned frame_size = TPACKET_ALIGN(
+		mtu + TPACKET3_HDRLEN + ETH_HLEN + TPACKET_ALIGNMENT);
+	unsigned nblocks = (queue_length * frame_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (nblocks < MIN_BLOCKS)
+		nblocks = MIN_BLOCKS;
+	memset(req, 0, sizeof(*req));
+	req->tp_block_size = BLOCK_SIZE;
+	req->tp_block_nr = nblocks;
+	req->tp_frame_size = frame_size;
+	req->tp_frame_nr = (BLOCK_SIZE / frame_size) * nblocks;
+	req->tp_retire_blk_tov = 10;	/* milli seconds */
+	if (setsockopt(*fd, SOL_PACKET, PACKET_RX_RING, req, sizeof(*req)) != 0)
+		die("PACKET_RX_RING; %s\n", strerror(errno));
+	void* ring = mmap(
+		NULL, req->tp_block_size * req->tp_block_nr, PROT_READ|PROT_WRITE,
+		MAP_SHARED, *fd, 0);
+	if (ring == MAP_FAILED)
+		die("mmap rx ring; %s\n", strerror(errno));
+
+	struct sockaddr_ll sll;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(*fd, (struct sockaddr*)&sll, sizeof(sll)) != 0)
+		die("bind [%s]; %s\n", ingress, strerror(errno));
+
+	/* All threads in this process are in the same fanout group */
+	int fanout = (getpid() & 0xffff) | (PACKET_FANOUT_HASH << 16);
+	if (setsockopt(*fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) != 0)
+		die("PACKET_FANOUT; %s\n", strerror(errno));
+	printf(
+		"tpacket; ingress=%s, blocks=%u, block_size=%u, frame_size=%u\n",
+		ingress, nblocks, BLOCK_SIZE, frame_size);
+	return ring;
+}
+
+static void handleBlock(
+	struct tpacket_block_desc* bd, int txfd, struct nfqueueCounters* cnt)
+{
+	struct tpacket3_hdr* h = (void*)bd + bd->hdr.bh1.offset_to_first_pkt;
+	for (unsigned i = 0; i < bd->hdr.bh1.num_pkts; i++,
+			 h = (void*)h + h->tp_next_offset) {
+		struct sockaddr_ll* sll = (void*)h + TPACKET_ALIGN(sizeof(*h));
+		if (sll->sll_pkttype == PACKET_OUTGOING)
+			continue;
+		cnt->packets++;
+		unsigned l2len = h->tp_net - h->tp_mac;
+		void* data = (void*)h + h->tp_net;
+		unsigned len = h->tp_snaplen - l2len;
+		unsigned origlen = h->tp_len - l2len;
+		unsigned short proto = ntohs(sll->sll_protocol);
+		int fwmark = handlePacket(proto, data, len, origlen);
+		if (fwmark < 0 || len < origlen)
+			continue;			/* Drop (or truncated) */
+		struct Steer* s = findSteer(fwmark);
+		if (s == NULL)
+			continue;
+		struct sockaddr_ll to = s->sll;
+		to.sll_protocol = sll->sll_protocol;
+		cnt->verdictCalls++;
+		if (sendto(
+				txfd, data, len, 0, (struct sockaddr*)&to, sizeof(to)) == len)
+			cnt->verdictMsgs++;
+	}
+}
+
+int tpacketRun(unsigned int queue)
+{
+	if (handlePacket == NULL)
+		exit(EXIT_FAILURE);
+	if (ingress == NULL)
+		die("tpacket; no ingress interface\n");
+
+	struct nfqueueCounters* cnt = &dummyCounters;
+	if (stats != NULL && queue >= first_queue &&
+		(queue - first_queue) < stats->nQueues)
+		cnt = &stats->q[queue - first_queue];
+
+	int fd;
+	struct tpacket_req3 req;
+	void* ring = openRxRing(&fd, &req);
+	/* The L3 packet is sent and the kernel adds a L2 header */
+	int txfd = socket(AF_PACKET, SOCK_DGRAM, 0);
+	if (txfd < 0)
+		die("socket AF_PACKET; %s\n", strerror(errno));
+
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN | POLLERR;
+	unsigned current = 0;
+	for (;;) {
+		struct tpacket_block_desc* bd =
+			ring + current * req.tp_block_size;
+		if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+			pfd.revents = 0;
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		cnt->recvCalls++;
+		handleBlock(bd, txfd, cnt);
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		current = (current + 1) % req.tp_block_nr;
+	}
+
+	/* We will never get here */
+	munmap(ring, req.tp_block_size * req.tp_block_nr);
+	close(txfd);
+	close(fd);
+	return 0;
+}
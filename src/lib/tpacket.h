@@ -0,0 +1,39 @@
+#pragma once
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+#include <nfqueue.h>
+
+/*
+  AF_PACKET TPACKET_V3 backend. Packets are received on an ingress
+  interface through a mmap'ed rx ring. Packets are *copied* to the ring,
+  the kernel still gets the original, so the ingress interface should
+  not have any addresses (or forwarding). With several threads the
+  sockets are joined in a PACKET_FANOUT_HASH group.
+
+  The fwmark returned from the packet handler selects an interface
+  (e.g. a veth or tun per target) and the L3 packet is sent on it.
+  Packets with a negative or unknown fwmark are dropped.
+
+  The counters are used as; packets - received packets, recvCalls -
+  ring blocks, verdictMsgs - sent packets, verdictCalls - sendto() calls.
+ */
+
+void tpacketInit(
+	packetHandleFn_t packetHandleFn, unsigned queue_length, unsigned mtu);
+void tpacketUseStats(
+	struct nfqueueStats* stats, unsigned firstQueue, unsigned nQueues);
+int tpacketRun(unsigned int queue); /* Will not return */
+
+// Set the ingress interface. Must be called before tpacketRun()
+void tpacketSetIngress(char const* ifname);
+
+/*
+  Set steering from a spec "fwmark:ifname[/mac],...". For interfaces
+  with an L2 header the mac is used as destination, default is
+  broadcast. die() on errors.
+  Example; "101:veth1,102:veth2/02:00:00:00:00:02,103:tun3"
+ */
+void tpacketSetSteering(char const* spec);
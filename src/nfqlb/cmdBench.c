@@ -0,0 +1,413 @@
+/*
+  SPDX-License-Identifier: Apache-2.0
+  Copyright (c) 2021-2022 Nordix Foundation
+*/
+
+/*
+  Offline benchmark. Packets from pcap files are fed to the packet
+  handler of the "lb" or "flowlb" command through the "bench" backend,
+  without any kernel queue. Example;
+
+    nfqlb init
+    nfqlb activate 1 2 3
+    nfqlb bench --pcap=udp-ipv4.pcap --threads=4 --multiply=100 -- lb
+
+  A minimal pcap reader is used, so libpcap is not needed.
+
+  The bench may run on a node with a live lb, so it uses own shm's
+  for stats and an own trace address (with the pid), and the lb
+  command never writes the target shm with the bench backend.
+ */
+
+#include <backend.h>
+#include <cmd.h>
+#include <die.h>
+#include <shmem.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+
+struct Packet {
+	unsigned short proto;
+	unsigned len;				/* Captured length (L3) */
+	unsigned origlen;			/* Original length (L3) */
+	void* data;
+};
+static struct Packet* packets = NULL;
+static unsigned nPackets = 0;
+static unsigned maxPackets = 0;
+
+static void addPacket(
+	unsigned short proto, void const* data, unsigned len, unsigned origlen)
+{
+	if (nPackets >= maxPackets) {
+		maxPackets = maxPackets == 0 ? 1024 : maxPackets * 2;
+		packets = realloc(packets, maxPackets * sizeof(struct Packet));
+		if (packets == NULL)
+			die("Out of memory\n");
+	}
+	struct Packet* p = packets + nPackets++;
+	p->proto = proto;
+	p->len = len;
+	p->origlen = origlen;
+	p->data = malloc(len);
+	if (p->data == NULL)
+		die("Out of memory\n");
+	memcpy(p->data, data, len);
+}
+
+/*
+  Pcap file format;
+  https://wiki.wireshark.org/Development/LibpcapFileFormat
+ */
+struct PcapHdr {
+	uint32_t magic;
+	uint16_t version_major, version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs, snaplen, network;
+};
+struct PcapRecHdr {
+	uint32_t ts_sec, ts_usec, incl_len, orig_len;
+};
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+static uint32_t sw32(int swap, uint32_t v)
+{
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static void readPcapOrDie(char const* file)
+{
+	FILE* fp = fopen(file, "r");
+	if (fp == NULL)
+		die("Open [%s]: %s\n", file, strerror(errno));
+	struct PcapHdr h;
+	if (fread(&h, sizeof(h), 1, fp) != 1)
+		die("Read pcap header [%s]\n", file);
+	int swap;
+	if (h.magic == 0xa1b2c3d4 || h.magic == 0xa1b23c4d)
+		swap = 0;
+	else if (h.magic == 0xd4c3b2a1 || h.magic == 0x4d3cb2a1)
+		swap = 1;
+	else
+		die("Not a pcap file [%s]\n", file);
+	uint32_t linktype = sw32(swap, h.network);
+
+	unsigned char buf[65536];
+	struct PcapRecHdr r;
+	while (fread(&r, sizeof(r), 1, fp) == 1) {
+		unsigned len = sw32(swap, r.incl_len);
+		unsigned origlen = sw32(swap, r.orig_len);
+		if (len > sizeof(buf))
+			die("Too large packet in [%s]\n", file);
+		if (fread(buf, len, 1, fp) != 1)
+			die("Truncated pcap file [%s]\n", file);
+		unsigned short proto;
+		unsigned hlen;
+		switch (linktype) {
+		case LINKTYPE_ETHERNET:
+			hlen = sizeof(struct ethhdr);
+			if (len < hlen) continue;
+			proto = ntohs(((struct ethhdr*)buf)->h_proto);
+			break;
+		case LINKTYPE_LINUX_SLL:
+			hlen = 16;
+			if (len < hlen) continue;
+			proto = ntohs(*(uint16_t*)(buf + 14));
+			break;
+		case LINKTYPE_LINUX_SLL2:
+			hlen = 20;
+			if (len < hlen) continue;
+			proto = ntohs(*(uint16_t*)buf);
+			break;
+		case LINKTYPE_RAW:
+			hlen = 0;
+			if (len < 1) continue;
+			proto = (buf[0] >> 4) == 6 ? ETH_P_IPV6 : ETH_P_IP;
+			break;
+		default:
+			die("Unsupported linktype %u [%s]\n", linktype, file);
+		}
+		if (proto != ETH_P_IP && proto != ETH_P_IPV6)
+			continue;
+		addPacket(proto, buf + hlen, len - hlen, origlen - hlen);
+	}
+	fclose(fp);
+}
+
+static void shuffle(struct Packet* packets, unsigned cnt)
+{
+	if (packets == NULL || cnt == 0)
+		return;
+	for (unsigned shuff = 0; shuff < (cnt * 5); shuff++) {
+		unsigned i1 = rand() % cnt;
+		unsigned i2 = rand() % cnt;
+		struct Packet tmp = packets[i1];
+		packets[i1] = packets[i2];
+		packets[i2] = tmp;
+	}
+}
+
+/* ----------------------------------------------------------------------
+   The "bench" backend
+ */
+
+#define HIST_SIZE 10000			/* ns, the last is overflow */
+#define MAX_FWMARKS 64
+struct FwCount {
+	int fwmark;
+	uint64_t count;
+};
+struct BenchThread {
+	uint64_t packets;
+	uint64_t hist[HIST_SIZE];
+	uint64_t maxns;
+	unsigned nfw;
+	struct FwCount fw[MAX_FWMARKS + 1]; /* last is "other" */
+};
+
+static packetHandleFn_t handlePacket = NULL;
+static unsigned repeat = 1;
+static unsigned nThreads = 1;
+static unsigned firstQueue = 0;
+static struct BenchThread* threads = NULL;
+static pthread_barrier_t barrier;
+static struct timespec t0, t1;
+
+static void benchInit(
+	packetHandleFn_t packetHandleFn, unsigned queue_length, unsigned mtu)
+{
+	handlePacket = packetHandleFn;
+}
+static void benchUseStats(
+	struct nfqueueStats* stats, unsigned _firstQueue, unsigned nQueues)
+{
+	firstQueue = _firstQueue;
+	if (nQueues != nThreads)
+		die("Queues %u != threads %u\n", nQueues, nThreads);
+}
+
+static uint64_t nsdiff(struct timespec const* a, struct timespec const* b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000ULL + b->tv_nsec - a->tv_nsec;
+}
+
+static void countFwmark(struct BenchThread* t, int fwmark)
+{
+	for (unsigned i = 0; i < t->nfw; i++) {
+		if (t->fw[i].fwmark == fwmark) {
+			t->fw[i].count++;
+			return;
+		}
+	}
+	if (t->nfw < MAX_FWMARKS) {
+		t->fw[t->nfw].fwmark = fwmark;
+		t->fw[t->nfw++].count = 1;
+	} else {
+		t->fw[MAX_FWMARKS].count++;
+	}
+}
+
+static void printReport(void)
+{
+	struct BenchThread* sum = calloc(1, sizeof(*sum));
+	for (unsigned i = 0; i < nThreads; i++) {
+		struct BenchThread* t = threads + i;
+		sum->packets += t->packets;
+		if (t->maxns > sum->maxns)
+			sum->maxns = t->maxns;
+		for (unsigned n = 0; n < HIST_SIZE; n++)
+			sum->hist[n] += t->hist[n];
+		for (unsigned f = 0; f < t->nfw; f++) {
+			unsigned n;
+			for (n = 0; n < sum->nfw; n++) {
+				if (sum->fw[n].fwmark == t->fw[f].fwmark)
+					break;
+			}
+			if (n == sum->nfw) {
+				if (n == MAX_FWMARKS) {
+					sum->fw[MAX_FWMARKS].count += t->fw[f].count;
+					continue;
+				}
+				sum->fw[n].fwmark = t->fw[f].fwmark;
+				sum->nfw++;
+			}
+			sum->fw[n].count += t->fw[f].count;
+		}
+		sum->fw[MAX_FWMARKS].count += t->fw[MAX_FWMARKS].count;
+	}
+
+	double pc[] = {50.0, 90.0, 99.0, 99.9};
+	unsigned pcns[4];
+	uint64_t acc = 0;
+	unsigned p = 0, n;
+	for (n = 0; n < HIST_SIZE && p < 4; n++) {
+		acc += sum->hist[n];
+		while (p < 4 && acc * 100.0 >= sum->packets * pc[p])
+			pcns[p++] = n;
+	}
+	while (p < 4)
+		pcns[p++] = HIST_SIZE - 1;
+
+	uint64_t ns = nsdiff(&t0, &t1);
+	printf("{\n");
+	printf("  \"threads\": %u,\n", nThreads);
+	printf("  \"packets\": %lu,\n", (unsigned long)sum->packets);
+	printf("  \"seconds\": %.3f,\n", ns / 1e9);
+	printf("  \"pps\": %.0f,\n", ns > 0 ? sum->packets * 1e9 / ns : 0.0);
+	printf(
+		"  \"ns_per_packet\": {\"p50\": %u, \"p90\": %u, \"p99\": %u, "
+		"\"p99.9\": %u, \"max\": %lu},\n",
+		pcns[0], pcns[1], pcns[2], pcns[3], (unsigned long)sum->maxns);
+	printf("  \"fwmarks\": [\n");
+	for (n = 0; n < sum->nfw; n++) {
+		printf(
+			"    {\"fwmark\": %d, \"count\": %lu, \"percent\": %.2f}%s\n",
+			sum->fw[n].fwmark, (unsigned long)sum->fw[n].count,
+			sum->fw[n].count * 100.0 / sum->packets,
+			(n + 1) < sum->nfw ? "," : "");
+	}
+	printf("  ]");
+	if (sum->fw[MAX_FWMARKS].count > 0)
+		printf(
+			",\n  \"other_fwmarks\": %lu",
+			(unsigned long)sum->fw[MAX_FWMARKS].count);
+	printf("\n}\n");
+	free(sum);
+}
+
+static int benchRun(unsigned int queue)
+{
+	struct BenchThread* t = threads + (queue - firstQueue);
+	struct timespec prev, now;
+
+	pthread_barrier_wait(&barrier);
+	if (queue == firstQueue)
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+	clock_gettime(CLOCK_MONOTONIC, &prev);
+	for (unsigned r = 0; r < repeat; r++) {
+		for (unsigned i = 0; i < nPackets; i++) {
+			struct Packet* p = packets + i;
+			int fwmark = handlePacket(p->proto, p->data, p->len, p->origlen);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			uint64_t ns = nsdiff(&prev, &now);
+			prev = now;
+			t->hist[ns < HIST_SIZE ? ns : HIST_SIZE - 1]++;
+			if (ns > t->maxns)
+				t->maxns = ns;
+			countFwmark(t, fwmark);
+		}
+	}
+	t->packets = (uint64_t)repeat * nPackets;
+	pthread_barrier_wait(&barrier);
+
+	/* The last queue is handled by the main thread (see cmdLb) */
+	if (queue != firstQueue + nThreads - 1)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printReport();
+	return 0;
+}
+
+static struct Backend const benchBackend = {
+	"bench", benchInit, benchUseStats, benchRun
+};
+
+static int cmdBench(int argc, char **argv)
+{
+	char const* pcap = NULL;
+	char const* shuffleStr = "no";
+	char const* multiplyStr = "1";
+	char const* repeatStr = "1";
+	char const* threadsStr = "1";
+	struct Option options[] = {
+		{"help", NULL, 0,
+		 "bench [options] -- <lb|flowlb> [lb-options]\n"
+		 "  Benchmark the packet handling with packets from pcap files"},
+		{"pcap", &pcap, REQUIRED, "Pcap files, comma separated"},
+		{"shuffle", &shuffleStr, 0, "Shuffle the packets"},
+		{"multiply", &multiplyStr, 0, "Copy the packets n times"},
+		{"repeat", &repeatStr, 0, "Repeat the packets n times"},
+		{"threads", &threadsStr, 0, "Number of threads"},
+		{0, 0, 0, 0}
+	};
+	int nopt = parseOptionsOrDie(argc, argv, options);
+	argc -= nopt;
+	argv += nopt;
+	if (argc < 1)
+		die("No command, e.g. 'nfqlb bench --pcap=file -- lb'\n");
+
+	char* files = strdup(pcap);
+	char* saveptr = NULL;
+	for (char* f = strtok_r(files, ",", &saveptr); f != NULL;
+		 f = strtok_r(NULL, ",", &saveptr))
+		readPcapOrDie(f);
+	free(files);
+	if (nPackets == 0)
+		die("No IP packets in [%s]\n", pcap);
+	unsigned n = nPackets;
+	for (int m = 1; m < atoi(multiplyStr); m++) {
+		for (unsigned i = 0; i < n; i++)
+			addPacket(
+				packets[i].proto, packets[i].data, packets[i].len,
+				packets[i].origlen);
+	}
+	if (shuffleStr == NULL)
+		shuffle(packets, nPackets);
+	repeat = atoi(repeatStr);
+	nThreads = atoi(threadsStr);
+	if (nThreads < 1)
+		die("Invalid threads [%s]\n", threadsStr);
+	threads = calloc(nThreads, sizeof(struct BenchThread));
+	pthread_barrier_init(&barrier, NULL, nThreads);
+	printf("Bench; packets=%u, repeat=%u, threads=%u\n", nPackets, repeat, nThreads);
+
+	/*
+	  Invoke the lb command with the bench backend and one "queue"
+	  per thread. Later options override earlier ones. Bench-only
+	  shm's and trace address are used, so a running lb on the node
+	  is not disturbed.
+	 */
+	addBackend(&benchBackend);
+	char queue[32];
+	snprintf(queue, sizeof(queue), "--queue=0:%u", nThreads - 1);
+	char ftShm[64], nfqShm[64], trace[64];
+	snprintf(ftShm, sizeof(ftShm), "nfqlb-bench-ft-%d", getpid());
+	snprintf(nfqShm, sizeof(nfqShm), "nfqlb-bench-nfq-%d", getpid());
+	char ftOpt[80], nfqOpt[80];
+	snprintf(ftOpt, sizeof(ftOpt), "--ft_shm=%s", ftShm);
+	snprintf(nfqOpt, sizeof(nfqOpt), "--nfq_shm=%s", nfqShm);
+	snprintf(trace, sizeof(trace), "--trace_address=unix:nfqlb-bench-trace-%d", getpid());
+	setenv("NFQLB_FLOW_ADDRESS", "unix:nfqlb-bench", 0);
+	char* nargv[argc + 7];
+	nargv[0] = "nfqlb";
+	for (int i = 0; i < argc; i++)
+		nargv[i + 1] = argv[i];
+	nargv[argc + 1] = "--backend=bench";
+	nargv[argc + 2] = queue;
+	nargv[argc + 3] = ftOpt;
+	nargv[argc + 4] = nfqOpt;
+	nargv[argc + 5] = trace;
+	nargv[argc + 6] = NULL;
+	optind = 0;					/* Re-initialize getopt */
+	int rc = handleCmd(argc + 6, nargv);
+	deleteSharedData(ftShm);
+	deleteSharedData(nfqShm);
+	return rc;
+}
+
+__attribute__ ((__constructor__)) static void addCommands(void) {
+	addCmd("bench", cmdBench);
+}
@@ -12,42 +12,88 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+/*
+  Activate a target on index i with a weight (0 - keep the weight of
+  an active target, else 1). The tables are copied for edit on the
+  first change. Returns the number of changed slots for incremental
+  updates. A new weight for an active target is an incremental
+  deactivate+activate.
+ */
+static unsigned activateIndex(
+	struct MagDataDyn* m, int i, int fw, unsigned weight, int incr,
+	int* changed)
+{
+	if (weight == 0)
+		weight = m->active[i] >= 0 ? m->weight[i] : 1;
+	int weightChanged = m->active[i] >= 0 && m->weight[i] != weight;
+	if (m->active[i] == fw && !weightChanged)
+		return 0;
+	if (!*changed)
+		magDataDyn_edit(m);
+	*changed = 1;
+	if (!incr) {
+		m->active[i] = fw;
+		m->weight[i] = weight;
+		return 0;
+	}
+	unsigned n = 0;
+	if (weightChanged)
+		n += magDataDyn_deactivate(m, i);
+	m->weight[i] = weight;
+	return n + magDataDyn_activate(m, i, fw);
+}
+
 static int cmdActivate(int argc, char **argv)
 {
 	char const* shm = defaultTargetShm;
 	char const* index = NULL;
+	char const* incremental = "no";
+	char const* weight = NULL;
 	struct Option options[] = {
 		{"help", NULL, 0,
-		 "activate [--shm=] <fwmarks...>\n"
-		 "activate [--shm=] --index=# <fwmark>\n"
+		 "activate [--shm=] [--incremental] [--weight=] <fwmarks...>\n"
+		 "activate [--shm=] [--incremental] [--weight=] --index=# <fwmark>\n"
 		 "  Activate targets."},
 		{"shm", &shm, 0, "Shared memory"},
 		{"index", &index, 0, "Index in the active table (<= N)"},
+		{"incremental", &incremental, 0,
+		 "Update only affected slots and print the number of changed slots.\n"
+		 "        The table depends on the update order, so it's NOT consistent\n"
+		 "        between nodes (see 'nfqlb show')"},
+		{"weight", &weight, 0,
+		 "Target weight. Default 1 for new targets, unchanged for active"},
 		{0, 0, 0, 0}
 	};
 	int nopt = parseOptionsOrDie(argc, argv, options);
 	argc -= nopt;
 	argv += nopt;
+	unsigned w = 0;
+	if (weight != NULL) {
+		w = atoi(weight);
+		if (w < 1 || w > 65535)
+			die("Invalid weight [%s]\n", weight);
+	}
 	struct SharedData* s;
-	s = mapSharedDataOrDie(shm, O_RDWR);
+	s = mapTargetShmOrDie(shm, O_RDWR);
 	struct MagDataDyn magd;
 	magDataDyn_map(&magd, s->mem);
+	if (w > 1 && magd.engine != MAGDYN_MAGLEV)
+		die("Weights are only supported by the maglev engine\n");
 
+	int incr = incremental == NULL;
+	unsigned nchanged = 0;
+	int i, fw, found, changed = 0, first_empty;
 	if (index != NULL) {
 		if (argc == 0)
 			return 0;
-		int i = atoi(index);
+		i = atoi(index);
 		if (i >= magd.N)
 			die("Lookup index too large\n");
-		int fw = atoi(*argv);
-		if (magd.active[i] != fw) {
-			magd.active[i] = atoi(*argv);
-			magDataDyn_populate(&magd);
-		}
-		return 0;
+		fw = atoi(*argv);
+		nchanged = activateIndex(&magd, i, fw, w, incr, &changed);
+		argc = 0;
 	}
 
-	int i, fw, found, changed = 0, first_empty;
 	while (argc-- > 0) {
 		first_empty = -1;
 		fw = atoi(*argv++);		
@@ -60,13 +106,18 @@ static int cmdActivate(int argc, char **argv)
 				break;
 			}
 		}
-		if (!found && first_empty >= 0) {
-			magd.active[first_empty] = fw;
-			changed = 1;
-		}
+		if (found)
+			nchanged += activateIndex(&magd, i, fw, w, incr, &changed);
+		else if (first_empty >= 0)
+			nchanged += activateIndex(&magd, first_empty, fw, w, incr, &changed);
 	}
-	if (changed)
-		magDataDyn_populate(&magd);
+	if (changed) {
+		if (!incr)
+			magDataDyn_populate(&magd);
+		magDataDyn_publish(&magd);
+	}
+	if (incr)
+		printf("Changed slots: %u\n", nchanged);
 
 	return 0;
 }
@@ -75,31 +126,46 @@ static int cmdDeactivate(int argc, char **argv)
 {
 	char const* shm = defaultTargetShm;
 	char const* index = NULL;
+	char const* incremental = "no";
 	struct Option options[] = {
 		{"help", NULL, 0,
-		 "deactivate [--shm=] <fwmarks...>\n"
-		 "deactivate [--shm=] --index=#\n"
+		 "deactivate [--shm=] [--incremental] <fwmarks...>\n"
+		 "deactivate [--shm=] [--incremental] --index=#\n"
 		 "  Deactivate targets"},
 		{"shm", &shm, 0, "Shared memory"},
 		{"index", &index, 0, "Index in the active table (<= N)"},
+		{"incremental", &incremental, 0,
+		 "Update only affected slots and print the number of changed slots.\n"
+		 "        The table depends on the update order, so it's NOT consistent\n"
+		 "        between nodes (see 'nfqlb show')"},
 		{0, 0, 0, 0}
 	};
 	int nopt = parseOptionsOrDie(argc, argv, options);
 	argc -= nopt;
 	argv += nopt;
 	struct SharedData* s;
-	s = mapSharedDataOrDie(shm, O_RDWR);
+	s = mapTargetShmOrDie(shm, O_RDWR);
 	struct MagDataDyn magd;
 	magDataDyn_map(&magd, s->mem);
 
+	int incr = incremental == NULL;
+	unsigned nchanged = 0;
 	if (index != NULL) {
 		int i = atoi(index);
 		if (i >= magd.N)
 			die("Lookup index too large\n");
 		if (magd.active[i] >= 0) {
-			magd.active[i] = -1;
-			magDataDyn_populate(&magd);
+			magDataDyn_edit(&magd);
+			if (incr) {
+				nchanged = magDataDyn_deactivate(&magd, i);
+			} else {
+				magd.active[i] = -1;
+				magDataDyn_populate(&magd);
+			}
+			magDataDyn_publish(&magd);
 		}
+		if (incr)
+			printf("Changed slots: %u\n", nchanged);
 		return 0;
 	}
 
@@ -108,14 +174,24 @@ static int cmdDeactivate(int argc, char **argv)
 		int fw = atoi(*argv++);		
 		for (int i = 0; i < magd.N; i++) {
 			if (magd.active[i] == fw) {
-				magd.active[i] = -1;
+				if (!changed)
+					magDataDyn_edit(&magd);
+				if (incr)
+					nchanged += magDataDyn_deactivate(&magd, i);
+				else
+					magd.active[i] = -1;
 				changed = 1;
 				break;
 			}
 		}
 	}
-	if (changed)
-		magDataDyn_populate(&magd);
+	if (changed) {
+		if (!incr)
+			magDataDyn_populate(&magd);
+		magDataDyn_publish(&magd);
+	}
+	if (incr)
+		printf("Changed slots: %u\n", nchanged);
 
 	return 0;
 }
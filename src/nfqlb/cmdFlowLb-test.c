@@ -5,11 +5,16 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <string.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <linux/if_ether.h>
 
 #include <flow.h>
 #include <maglevdyn.h>
 #include <shmem.h>
 #include <nfqueue.h>
+#include <hash.h>
+#include <affinity.h>
 #include "nfqlb.h"
 
 extern struct FlowSet* fset;
@@ -19,6 +24,9 @@ extern void loadbalancerRelease(struct LoadBalancer* lb);
 extern struct LoadBalancer* loadbalancerFindOrCreate(char const* target);
 extern void cmd_set(struct FlowCmd* cmd, int cd);
 extern void cmd_delete(struct FlowCmd* cmd, int cd);
+extern struct Affinity* aff;
+extern int packetHandleFn(
+	unsigned short proto, void* data, unsigned len, unsigned origlen);
 
 // COPIED FROM cmdFlowLb.c. KEEP IN SYNC!
 struct LoadBalancer {
@@ -33,6 +41,7 @@ struct LoadBalancer {
 static void initShm(char const* name, int ownFw, unsigned m, unsigned n);
 static int countLb(void);
 static int readResult(int fd);
+static void testAffinity(int* pipe);
 
 int main(int argc, char* argv[])
 {
@@ -44,6 +53,7 @@ int main(int argc, char* argv[])
 	// Init
 	shm_unlink("lb100");
 	shm_unlink("lb200");
+	shm_unlink("lb300");
 	assert(pipe2(pipe, O_NONBLOCK) == 0);
 	fset = flowSetCreate(loadbalancerLock);
 
@@ -67,6 +77,29 @@ int main(int argc, char* argv[])
 	loadbalancerRelease(lb);
 	assert(countLb() == 0);
 
+	// A target shm with another hash or seed than flowlb is refused
+	initShm("lb300", 0, 17, 2);
+	struct SharedData* st = mapSharedDataOrDie("lb300", O_RDWR);
+	lb = loadbalancerFindOrCreate("lb300");
+	assert(lb != NULL);
+	loadbalancerRelease(lb);
+	st->hashSeed = 4711;
+	assert(loadbalancerFindOrCreate("lb300") == NULL);
+	st->hashSeed = 0;
+	st->hashFn = HASH_WYHASH;
+	assert(loadbalancerFindOrCreate("lb300") == NULL);
+	st->hashFn = HASH_DJB2;
+
+	// An old (or unknown) format is refused, flowlb must not die
+	unsigned* magic = (unsigned*)st->mem;
+	*magic ^= 1;
+	assert(loadbalancerFindOrCreate("lb300") == NULL);
+	*magic ^= 1;
+	st->magic ^= 1;
+	assert(loadbalancerFindOrCreate("lb300") == NULL);
+	st->magic ^= 1;
+	assert(countLb() == 0);
+
 	// Flows
 	memset(&cmd, 0, sizeof(cmd));
 	cmd.name = "lb100";
@@ -187,13 +220,102 @@ int main(int argc, char* argv[])
 	assert(lblist == NULL);
 	assert(flowSetSize(fset) == 0);
 
+	testAffinity(pipe);
+
 	// Clean-up
 	assert(shm_unlink("lb100") == 0);
 	assert(shm_unlink("lb200") == 0);
+	assert(shm_unlink("lb300") == 0);
 	printf("=== cmdFlowLb-test; OK\n");
 	return 0;
 }
 
+/*
+  A connection stays on its target when a target is added, but not
+  when its target is deactivated or the flow is moved to another
+  target shm.
+ */
+#define NCONN 100
+static int sendTcp(unsigned port)
+{
+	struct {
+		struct iphdr ip;
+		struct tcphdr tcp;
+	} pkt;
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.ip.version = 4;
+	pkt.ip.ihl = 5;
+	pkt.ip.tot_len = htons(sizeof(pkt));
+	pkt.ip.protocol = IPPROTO_TCP;
+	pkt.ip.saddr = htonl(0x0a000001);
+	pkt.ip.daddr = htonl(0x0a0000ff);
+	pkt.tcp.source = htons(port);
+	pkt.tcp.dest = htons(80);
+	return packetHandleFn(ETH_P_IP, &pkt, sizeof(pkt), sizeof(pkt));
+}
+static void testAffinity(int* pipe)
+{
+	struct FlowCmd cmd;
+	struct MagDataDyn m100, m200;
+	struct SharedData* st;
+	unsigned i, moved;
+	st = mapSharedDataOrDie("lb100", O_RDWR);
+	magDataDyn_map(&m100, st->mem);
+	m100.active[0] = 100;
+	magDataDyn_populate(&m100);
+	st = mapSharedDataOrDie("lb200", O_RDWR);
+	magDataDyn_map(&m200, st->mem);
+	m200.active[0] = 200;
+	magDataDyn_populate(&m200);
+
+	aff = affinityCreate(NCONN, 60000, 1);
+	assert(aff != NULL);
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.name = "lb100";
+	cmd.target = "lb100";
+	cmd_set(&cmd, pipe[1]);
+	assert(readResult(pipe[0]) == 0);
+	for (i = 0; i < NCONN; i++)
+		assert(sendTcp(10000 + i) == 100);
+
+	// Add a target. The connections stay on 100, but some would
+	// move without affinity
+	m100.active[1] = 101;
+	magDataDyn_populate(&m100);
+	for (i = 0; i < NCONN; i++)
+		assert(sendTcp(10000 + i) == 100);
+	struct Affinity* a = aff;
+	aff = NULL;
+	moved = 0;
+	for (i = 0; i < NCONN; i++) {
+		if (sendTcp(10000 + i) == 101)
+			moved++;
+	}
+	aff = a;
+	assert(moved > 0 && moved < NCONN);
+
+	// Deactivate 100. All connections are load-balanced again
+	m100.active[0] = -1;
+	magDataDyn_populate(&m100);
+	for (i = 0; i < NCONN; i++)
+		assert(sendTcp(10000 + i) == 101);
+
+	// Move the flow to lb200
+	cmd.target = "lb200";
+	cmd_set(&cmd, pipe[1]);
+	assert(readResult(pipe[0]) == 0);
+	for (i = 0; i < NCONN; i++)
+		assert(sendTcp(10000 + i) == 200);
+
+	cmd_delete(&cmd, pipe[1]);
+	assert(readResult(pipe[0]) == 0);
+	assert(countLb() == 0);
+	affinityDestroy(aff);
+	aff = NULL;
+	magDataDyn_free(&m100);
+	magDataDyn_free(&m200);
+}
+
 static int readResult(int fd)
 {
 	char buff[64];
@@ -217,13 +339,14 @@ static int countLb(void)
 static void initShm(
 	char const* name, int ownFw, unsigned m, unsigned n)
 {
-	unsigned len = magDataDyn_len(m, n);
-	struct SharedData* s = malloc(sizeof(struct SharedData) + len);
+	unsigned len = magDataDyn_len(m, n, 0);
+	struct SharedData* s = calloc(1, sizeof(struct SharedData) + len);
 	s->ownFwmark = ownFw;
+	s->magic = SHARED_DATA_MAGIC;
 	createSharedDataOrDie(name, s, sizeof(struct SharedData) + len);
 	free(s);
 	s = mapSharedDataOrDie(name, O_RDWR);
-	magDataDyn_init(m, n, s->mem, len);
+	magDataDyn_init(m, n, 0, MAGDYN_MAGLEV, 0, s->mem, len);
 }
 
 void freeFlowCmd(struct FlowCmd* cmd){}
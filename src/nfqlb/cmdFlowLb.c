@@ -6,13 +6,18 @@
 #include "nfqlb.h"
 
 #include <nfqueue.h>
+#include <backend.h>
+#include <tpacket.h>
 #include <shmem.h>
 #include <cmd.h>
 #include <tuntap.h>
 #include <maglevdyn.h>
 #include <reassembler.h>
 #include <flow.h>
+#include <affinity.h>
 #include <log.h>
+#include <hash.h>
+#include <threadstats.h>
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -65,8 +70,11 @@ STATIC void loadbalancerRelease(struct LoadBalancer* lb);
 static void traceHandleFlowCmd(struct FlowCmd* cmd, FILE* out, int cd);
 
 // Statics
-static struct FragTable* ft;
+static struct FragTable** fts;	/* Per queue. Shared if not sharded */
+static __thread struct FragTable* ft;
+static unsigned firstQueue;
 static int tun_fd = -1;
+static struct Backend const* backend;
 static struct fragStats* sft;
 static struct SharedData* slb;
 static struct MagDataDyn magdlb;
@@ -77,6 +85,7 @@ static pthread_mutex_t lblistLock = PTHREAD_MUTEX_INITIALIZER;
 static int notargets_fw = -1;
 static int nolb_fw = -1;
 static unsigned hash_mode;
+STATIC struct Affinity* aff;
 
 static void injectFrag(void const* data, unsigned len)
 {
@@ -90,26 +99,48 @@ static void injectFrag(void const* data, unsigned len)
 	}
 }
 
-static int packetHandleFn(
-	unsigned short proto, void* data, unsigned len)
+/*
+  Connection affinity is used for non-fragmented packets. SCTP with
+  hash_mode=1 is excluded since all paths of a multihomed association
+  must get the same fwmark.
+ */
+static int useAffinity(struct ctKey const* key, int rc)
+{
+	if (aff == NULL || rc != 0)
+		return 0;
+	return key->ports.proto != IPPROTO_SCTP || hash_mode != 1;
+}
+
+STATIC int packetHandleFn(
+	unsigned short proto, void* data, unsigned len, unsigned origlen)
 {
 	struct ctKey key;
 	uint64_t fragid;
 	int rc = getHashKey(&key, 0, &fragid, proto, data, len, hash_mode);
+	if (rc < 0 && len < origlen) {
+		// The L4 header is beyond the copy range. Use the addresses
+		rc = getHashKeyAddresses(&key, &fragid, proto, data, len);
+		trace(TRACE_PACKET, "Truncated packet, len=%u(%u)\n", len, origlen);
+	}
 	if (rc < 0) {
-		warning("getHashKey rc=%d. proto=%u, len=%u\n", rc, proto, len);
+		warning("getHashKey rc=%d. proto=%u, len=%u\n", rc, proto, origlen);
 		return -1;
 	}
 
 	unsigned hash;
+	unsigned index;
 	int fw;
+	struct timespec now;
+	struct ctKey akey;
+	int affinity = useAffinity(&key, rc);
+	if (affinity)
+		akey = key;				/* The key may be re-computed for udpencap */
+
 	if (rc & 3) {
 		// Fragment. Check if we shall forward to the lb-tier
 		if (slb != NULL) {
 			hash = hashKeyAddresses(&key);
-			fw = magdlb.lookup[hash % magdlb.M];
-			if (fw >= 0)
-				fw = magdlb.active[fw];
+			fw = magDataDyn_lookup(&magdlb, hash);
 			if (fw >= 0 && fw != slb->ownFwmark) {
 				trace(TRACE_FRAG, "Fragment to LB tier. fw=%d\n", fw);
 				return fw; /* To the LB tier */
@@ -118,7 +149,6 @@ static int packetHandleFn(
 		// We shall handle the fragment here
 		if ((rc & 1) == 0) {
 			// Not first-fragment
-			struct timespec now;
 			clock_gettime(CLOCK_MONOTONIC, &now);
 			rc = fragGetValueOrStore(ft, &now, &key, &fw, data, len);
 			if (rc != 0) {
@@ -145,7 +175,7 @@ static int packetHandleFn(
 			char dst[INET6_ADDRSTRLEN];
 			tracef(
 				"proto=%s, len=%u, %s %u -> %s %u\n",
-				protostr(key.ports.proto, NULL), len,
+				protostr(key.ports.proto, NULL), origlen,
 				inet_ntop(AF_INET6, &key.src, src, sizeof(src)),
 				ntohs(key.ports.src),
 				inet_ntop(AF_INET6, &key.dst, dst, sizeof(dst)),
@@ -182,11 +212,30 @@ static int packetHandleFn(
 		return nolb_fw;
 	}
 
+	if (affinity) {
+		/*
+		  A hit is valid if the target is still active on the index
+		  in the matched lb. A flow update may match another lb, or a
+		  target may be deactivated, and the packet is then
+		  load-balanced again.
+		 */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		fw = affinityLookup(aff, &now, &akey, &index);
+		if (fw >= 0) {
+			if (magDataDyn_activeAt(&lb->magd, index) == fw) {
+				loadbalancerRelease(lb);
+				trace(TRACE_PACKET, "Affinity hit. fw=%d\n", fw);
+				if (tflow != NULL)
+					tracef("affinity, fwmark=%d\n", fw);
+				return fw;
+			}
+			affinityRemove(aff, &now, &akey);
+		}
+	}
+
 	// Compute the fwmark
 	hash = hashKey(&key, hash_mode);
-	fw = lb->magd.lookup[hash % lb->magd.M];
-	if (fw >= 0)
-		fw = lb->magd.active[fw];
+	fw = magDataDyn_lookupIndex(&lb->magd, hash, &index);
 	loadbalancerRelease(lb);
 	if (fw < 0) {
 		if (tflow != NULL)
@@ -197,11 +246,12 @@ static int packetHandleFn(
 	if (tflow != NULL) {
 		tracef("target=%s, fwmark=%d\n", lb->target, fw);
 	}
+	if (affinity)
+		(void)affinityInsert(aff, &now, &akey, fw, index);
 
 	if (rc & 1) {
 		// First fragment
 		trace(TRACE_FRAG, "First fragment\n");
-		struct timespec now;
 		clock_gettime(CLOCK_MONOTONIC, &now);
 		key.id = fragid;
 		if (handleFirstFragment(ft, &now, &key, fw, data, len) != 0) {
@@ -217,22 +267,30 @@ static int packetHandleFn(
 			tracef("Using LB; %s\n", lb->target);
 			tracef(
 				"Packet; proto=%u, len=%u, fwmark=%u\n",
-				key.ports.proto, len, fw);
+				key.ports.proto, origlen, fw);
 		} else {
 			if (key.ports.proto == IPPROTO_SCTP) {
 				tracef("Using LB; %s\n", lb->target);
 				tracef(
 					"Packet; proto=%u, len=%u, fwmark=%u\n",
-					key.ports.proto, len, fw);
+					key.ports.proto, origlen, fw);
 			}
 		}
 	}
 	return fw;
 }
 
+// Divide a size option between the shards
+static unsigned share(char const* opt, unsigned nShards)
+{
+	return (atoi(opt) + nShards - 1) / nShards;
+}
+
 static void* packetHandleThread(void* Q)
 {
-	nfqueueRun((intptr_t)Q);
+	ft = fts[(intptr_t)Q - firstQueue];
+	threadStatsSetIndex((intptr_t)Q - firstQueue + 1);
+	backend->run((intptr_t)Q);
 	return NULL;
 }
 
@@ -246,6 +304,9 @@ static int cmdFlowLb(int argc, char **argv)
 	char const* ft_buckets = "500";
 	char const* ft_frag = "100";
 	char const* ft_ttl = "200";
+	char const* ft_expire = "0";
+	char const* ft_max_size = "0";
+	char const* ft_shards = "no";
 	char const* mtuOpt = "1500";
 	char const* tun = NULL;
 	char const* reassembler = "0";
@@ -254,6 +315,17 @@ static int cmdFlowLb(int argc, char **argv)
 	char const* nolb_fwmark = "-1";
 	char const* lb_hash_mode = "1";
 	char const* trace_address = DEFAULT_TRACE_ADDRESS;
+	char const* nfqShm = "nfqshm";
+	char const* verdictBatch = "0";
+	char const* recvBatch = "0";
+	char const* copyRange = "128";
+	char const* ctMark = "no";
+	char const* backendName = "nfqueue";
+	char const* hashName = "djb2";
+	char const* hashSeed = "0";
+	char const* ingress = NULL;
+	char const* steering = NULL;
+	char const* affinity = NULL;
 	struct Option options[] = {
 		{"help", NULL, 0,
 		 "flowlb [options]\n"
@@ -269,20 +341,40 @@ static int cmdFlowLb(int argc, char **argv)
 		{"hash_mode", &lb_hash_mode, 0, "Load balance with a different hash mode. 0: Tuple-5, 1: SCTP Ports only. default=1"},
 		{"queue", &qnum, 0, "NF-queues to listen to (default 2)"},
 		{"qlength", &qlen, 0, "Lenght of queues (default 1024)"},
+		{"verdict_batch", &verdictBatch, 0, "Max packets per verdict system call. 0 - no batching (default)"},
+		{"recv_batch", &recvBatch, 0, "Max packets per receive system call (recvmmsg). 0 - no recvmmsg (default)"},
+		{"copy_range", &copyRange, 0, "Bytes copied to user-space if fragments are not stored. 0 - mtu. default=128"},
+		{"ct_mark", &ctMark, 0, "Set the conntrack mark to the fwmark (offload)"},
+		{"hash", &hashName, 0,
+		 "Hash function; djb2 (default), wyhash. Must match the target shm's"},
+		{"hash_seed", &hashSeed, 0, "Hash seed. Must match the target shm's"},
+		{"backend", &backendName, 0, "Packet I/O; nfqueue (default), tpacket"},
+		{"ingress", &ingress, 0, "tpacket; ingress interface"},
+		{"steer", &steering, 0, "tpacket; fwmark:ifname[/mac],..."},
+		{"nfq_shm", &nfqShm, 0, "Queue stats; shared memory"},
 		{"ft_shm", &ftShm, 0, "Frag table; shared memory stats"},
 		{"ft_size", &ft_size, 0, "Frag table; size"},
 		{"ft_buckets", &ft_buckets, 0, "Frag table; extra buckets"},
 		{"ft_frag", &ft_frag, 0, "Frag table; stored frags"},
 		{"ft_ttl", &ft_ttl, 0, "Frag table; ttl milliS"},
+		{"ft_expire", &ft_expire, 0,
+		 "Frag table; expiry thread interval milliS. 0 - GC on use (default)"},
+		{"ft_max_size", &ft_max_size, 0,
+		 "Frag table; grow online up to this size. 0 - fixed size (default)"},
+		{"ft_shards", &ft_shards, 0,
+		 "Frag table; one per queue. Requires address-hash queue steering"},
+		{"affinity", &affinity, 0,
+		 "Connection affinity; size[:ttl milliS]. default off, ttl=60000"},
 		{"trace_address",  &trace_address, 0, "Trace server address"},
 		{0, 0, 0, 0}
 	};
+	OPTIONS_CHECK(options);
 	(void)parseOptionsOrDie(argc, argv, options);
 	logConfigShm(TRACE_SHM);
 	logTraceServer(trace_address);
 
 	if (lbShm != NULL) {
-		slb = mapSharedDataOrDie(lbShm, O_RDONLY);
+		slb = mapTargetShmOrDie(lbShm, O_RDONLY);
 		magDataDyn_map(&magdlb, slb->mem);
 	}
 
@@ -294,11 +386,43 @@ static int cmdFlowLb(int argc, char **argv)
 		flowSetPromiscuousPing(fset, 1);
 	notargets_fw = atoi(notargets_fwmark);
 	nolb_fw = atoi(nolb_fwmark);
+	/*
+	  All target shm's must have the same hash as flowlb, or "nfqlb
+	  fwmark" gives other results. The hash is set here, before any
+	  packet thread is started, and targets with another hash are
+	  refused.
+	 */
+	int hashFn = hashParseFunction(hashName);
+	if (hashFn < 0)
+		die("Unknown hash function [%s]\n", hashName);
+	hashSetFunction(hashFn, strtoul(hashSeed, NULL, 0));
 	hash_mode = atoi(lb_hash_mode);
 
-	// Create and re-map the stats struct
-	sft = calloc(1, sizeof(*sft));
-	createSharedDataOrDie(ftShm, sft, sizeof(*sft));
+	/*
+	  The qnum may be a range like "0:3" in which case we go
+	  multi-threading and listen to all queues in the range;
+	 */
+	unsigned first, last;
+	first = last = atoi(qnum);
+	if (strchr(qnum, ':') != NULL) {
+		if (sscanf(qnum, "%u:%u", &first, &last) != 2)
+			die("queue invalid [%s]\n", qnum);
+		if (first > last)
+			die("queue invalid [%s]\n", qnum);
+	}
+
+	/*
+	  In sharded mode each queue thread has an own FragTable. The
+	  sizes are divided between the shards. Otherwise the FragTable
+	  has per-thread stats; one block for each queue thread and block
+	  0 for other threads. Create and re-map the stats.
+	 */
+	unsigned nQueues = last - first + 1;
+	unsigned nShards = ft_shards == NULL ? nQueues : 1;
+	unsigned nThreads = nShards > 1 ? 1 : nQueues + 1;
+	flowSetThreadStats(fset, nQueues + 1);
+	sft = calloc(nShards * nThreads, sizeof(*sft));
+	createSharedDataOrDie(ftShm, sft, nShards * nThreads * sizeof(*sft));
 	free(sft);
 	sft = mapSharedDataOrDie(ftShm, O_RDWR);
 
@@ -320,51 +444,83 @@ static int cmdFlowLb(int argc, char **argv)
 	} else {
 		/*
 		  We can't inject stored fragments. Disable storing of
-		  fragments. The MTU *may* be set to to 1280 to avoid copy unnecessary
-		  data to user-space, but then reassembly will not work since the
-		  original packet lenght is lost.
+		  fragments. If reassembly isn't used either we only need the
+		  headers, so copy only the start of packets to user-space.
 		 */
 		ft_frag = "0";
+		if (atoi(reassembler) == 0)
+			nfqueueSetCopyRange(atoi(copyRange));
 	}
 
-	ft = fragTableCreate(
-		atoi(ft_size),		/* table size */
-		atoi(ft_buckets),	/* Extra buckets for hash collisions */
-		atoi(ft_frag),		/* Max stored fragments */
-		mtu,				/* MTU. Only used for stored fragments */
-		atoi(ft_ttl));		/* Fragment TTL in milli seconds */
-	fragUseStats(ft, sft);
-	if (atoi(reassembler) > 0)
-		fragRegisterFragReassembler(ft, createReassembler(atoi(reassembler)));
+	fts = calloc(nQueues, sizeof(*fts));
+	for (unsigned i = 0; i < nShards; i++) {
+		fts[i] = fragTableCreate(
+			share(ft_size, nShards),	/* table size */
+			share(ft_buckets, nShards),	/* Extra buckets for hash collisions */
+			share(ft_frag, nShards),	/* Max stored fragments */
+			mtu,				/* MTU. Only used for stored fragments */
+			atoi(ft_ttl));		/* Fragment TTL in milli seconds */
+		if (atoi(ft_max_size) > 0 &&
+			fragSetMaxSize(fts[i], share(ft_max_size, nShards)) != 0)
+			die("Invalid ft_max_size %s\n", ft_max_size);
+		fragUseThreadStats(fts[i], sft + i * nThreads, nThreads);
+		if (atoi(ft_expire) > 0 && fragStartExpiry(fts[i], atoi(ft_expire)) != 0)
+			die("Failed to start the frag table expiry\n");
+		if (atoi(reassembler) > 0)
+			fragRegisterFragReassembler(
+				fts[i], createReassembler(share(reassembler, nShards)));
+	}
+	for (unsigned i = nShards; i < nQueues; i++)
+		fts[i] = fts[0];
+	for (unsigned i = 0; i < nShards * nThreads; i++) {
+		sft[i].nShards = nShards;
+		sft[i].nThreads = nThreads;
+	}
+	firstQueue = first;
 	printf(
-		"FragTable; size=%d, buckets=%d, frag=%d, mtu=%d, ttl=%d\n",
-		atoi(ft_size),atoi(ft_buckets),atoi(ft_frag),mtu,atoi(ft_ttl));
+		"FragTable; size=%d, buckets=%d, frag=%d, mtu=%d, ttl=%d, shards=%u\n",
+		atoi(ft_size),atoi(ft_buckets),atoi(ft_frag),mtu,atoi(ft_ttl),nShards);
+
+	if (affinity != NULL) {
+		unsigned size, ttl = 60000;
+		if (sscanf(affinity, "%u:%u", &size, &ttl) < 1 || size == 0)
+			die("affinity invalid [%s]\n", affinity);
+		aff = affinityCreate(size, ttl, nQueues + 1);
+		if (aff == NULL)
+			die("Failed to create the affinity table\n");
+		printf("Affinity; size=%u, ttl=%u\n", size, ttl);
+	}
 
-	nfqueueInit(packetHandleFn, atoi(qlen), mtu);
+	backend = backendGetOrDie(backendName);
+	if (ingress != NULL)
+		tpacketSetIngress(ingress);
+	if (steering != NULL)
+		tpacketSetSteering(steering);
+	backend->init(packetHandleFn, atoi(qlen), mtu);
+	nfqueueSetVerdictBatch(atoi(verdictBatch));
+	nfqueueSetRecvBatch(atoi(recvBatch));
+	nfqueueSetConntrackMark(ctMark == NULL);
 
 	pthread_t tid;
 	if (pthread_create(&tid, NULL, flowThread, NULL) != 0)
 		die("Failed pthread_create for flow\n");
 	
 	
-	/*
-	  The qnum may be a range like "0:3" in which case we go
-	  multi-threading and listen to all queues in the range;
-	 */
-	unsigned Q = atoi(qnum);
-	if (strchr(qnum, ':') != NULL) {
-		unsigned first, last;
-		if (sscanf(qnum, "%u:%u", &first, &last) != 2)
-			die("queue invalid [%s]\n", qnum);
-		if (first > last)
-			die("queue invalid [%s]\n", qnum);
-		for (Q = first; Q < last; Q++) {
-			if (pthread_create(&tid, NULL, packetHandleThread, (void*)(intptr_t)Q) != 0)
-				die("Failed pthread_create for Q=%u\n", Q);
-		}
-		Q = last;				/* Last will go to the main thread */
+	// Create and re-map the queue stats
+	struct nfqueueStats* sq = calloc(1, NFQUEUE_STATS_LEN(nQueues));
+	createSharedDataOrDie(nfqShm, sq, NFQUEUE_STATS_LEN(nQueues));
+	free(sq);
+	sq = mapSharedDataOrDie(nfqShm, O_RDWR);
+	backend->useStats(sq, first, nQueues);
+
+	unsigned Q;
+	for (Q = first; Q < last; Q++) {
+		if (pthread_create(&tid, NULL, packetHandleThread, (void*)(intptr_t)Q) != 0)
+			die("Failed pthread_create for Q=%u\n", Q);
 	}
-	return nfqueueRun(Q);
+	ft = fts[last - first];
+	threadStatsSetIndex(last - first + 1);
+	return backend->run(last);	/* Last will go to the main thread */
 }
 
 __attribute__ ((__constructor__)) static void addCommands(void) {
@@ -444,19 +600,49 @@ STATIC struct LoadBalancer* loadbalancerFindOrCreate(char const* target)
 		return NULL;
 	}
 
+	/*
+	  A target shm with an old format or another hash is refused. It
+	  must not take down flowlb and the other flows.
+	 */
+	struct MagDataDyn magd;
+	if (st->magic != SHARED_DATA_MAGIC || magDataDyn_tryMap(&magd, st->mem) != 0) {
+		warning(
+			"Incompatible shm format in %s. Convert with 'nfqlb init --convert'\n",
+			target);
+		goto reject;
+	}
+	if (st->hashFn != hashFunction() || st->hashSeed != hashSeed()) {
+		warning(
+			"Hash in %s (%s,%u) differs from flowlb (%s,%u)\n", target,
+			hashFunctionName(st->hashFn), st->hashSeed,
+			hashFunctionName(hashFunction()), hashSeed());
+		magDataDyn_free(&magd);
+		goto reject;
+	}
+
 	lb = MALLOC(lb);
 	lb->target = strdup(target);
 	if (lb->target == NULL) die("OOM");
 	lb->refCounter = 1;
 	lb->fd = fd;
 	lb->st = st;
-	magDataDyn_map(&lb->magd, st->mem);
+	lb->magd = magd;
 
 	lb->next = lblist;
 	lblist = lb;
 
 	UNLOCK(lblistLock);
 	return lb;
+
+reject:;
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) != 0)
+		die("fstat shared mem; %s\n", target);
+	munmap(st, statbuf.st_size);
+	close(fd);
+	UNLOCK(lblistLock);
+	trace(TRACE_TARGET, "Target refused; %s\n", target);
+	return NULL;
 }
 
 
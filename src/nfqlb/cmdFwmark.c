@@ -10,6 +10,7 @@
 #include <maglevdyn.h>
 #include <iputils.h>
 #include <conntrack.h>
+#include <hash.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -23,6 +24,8 @@ static int cmdFwmark(int argc, char **argv)
 	char const* dst = NULL;
 	char const* proto = NULL;
 	char const* lb_hash_mode = "1";
+	char const* hashName = "djb2";
+	char const* hashSeed = "0";
 	struct Option options[] = {
 		{"help", NULL, 0,
 		 "fwmark [--shm=] [--proto=tcp|udp|sctp] --src=addr:port --dst=addr:port\n"
@@ -33,6 +36,8 @@ static int cmdFwmark(int argc, char **argv)
 		{"src", &src, 1, "Source addr:port, e.g \"[1000::80]:80\"" },
 		{"dst", &dst, 1, "Destination addr:port"},
 		{"hash_mode", &lb_hash_mode, 0, "Load balance with a different hash mode. 0: Tuple-5, 1: SCTP Ports only. default=1"},
+		{"hash", &hashName, 0, "Hash function if no shm; djb2 (default), wyhash"},
+		{"hash_seed", &hashSeed, 0, "Hash seed if no shm"},
 		{0, 0, 0, 0}
 	};
 	int nopt = parseOptionsOrDie(argc, argv, options);
@@ -52,6 +57,18 @@ static int cmdFwmark(int argc, char **argv)
 
 	unsigned hash_mode = atoi(lb_hash_mode);
 
+	// Use the hash function from the shm if specified
+	struct SharedData* s = NULL;
+	if (shm != NULL) {
+		s = mapTargetShmOrDie(shm, O_RDONLY);
+		hashSetFunction(s->hashFn, s->hashSeed);
+	} else {
+		int fn = hashParseFunction(hashName);
+		if (fn < 0)
+			die("Unknown hash function [%s]\n", hashName);
+		hashSetFunction(fn, strtoul(hashSeed, NULL, 0));
+	}
+
 	unsigned hash;
 	if (proto != NULL) {
 		key.ports.proto = parseProto(proto);
@@ -62,13 +79,11 @@ static int cmdFwmark(int argc, char **argv)
 		hash = hashKeyAddresses(&key);
 	}
 
-	if (shm != NULL) {
-		struct SharedData* s = NULL;
-		s = mapSharedDataOrDie(shm, O_RDWR);
+	if (s != NULL) {
 		struct MagDataDyn magd;
 		magDataDyn_map(&magd, s->mem);
 		unsigned index = hash % magd.M;
-		int activeindex = magd.lookup[index];
+		int activeindex = magDataDyn_slot(&magd, index); /* (current generation) */
 		int fwmark = -1;
 		if (activeindex >= 0)
 			fwmark = magd.active[activeindex];
@@ -6,28 +6,37 @@
 #include "nfqlb.h"
 
 #include <nfqueue.h>
+#include <backend.h>
+#include <tpacket.h>
 #include <shmem.h>
 #include <cmd.h>
 #include <tuntap.h>
 #include <maglevdyn.h>
+#include <affinity.h>
 #include <reassembler.h>
 #include <log.h>
+#include <hash.h>
+#include <threadstats.h>
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
 
-static struct FragTable* ft;
+static struct FragTable** fts;	/* Per queue. Shared if not sharded */
+static __thread struct FragTable* ft;
+static unsigned firstQueue;
 static struct SharedData* st;
 static struct SharedData* slb = NULL;
 static int tun_fd = -1;
+static struct Backend const* backend;
 static struct fragStats* sft;
 static struct MagDataDyn magd;
 static struct MagDataDyn magdlb;
 static unsigned udpEncap;
 static unsigned hash_mode;
 static int notargets_fw = -1;
+static struct Affinity* aff;
 
 #ifdef VERBOSE
 #define D(x)
@@ -49,25 +58,55 @@ static void injectFrag(void const* data, unsigned len)
 	}
 }
 
+/*
+  Connection affinity is used for non-fragmented packets. SCTP with
+  hash_mode=1 is excluded since all paths of a multihomed association
+  must get the same fwmark.
+ */
+static int useAffinity(struct ctKey const* key, int rc)
+{
+	if (aff == NULL || rc != 0)
+		return 0;
+	return key->ports.proto != IPPROTO_SCTP || hash_mode != 1;
+}
 
 static int packetHandleFn(
-	unsigned short proto, void* data, unsigned len)
+	unsigned short proto, void* data, unsigned len, unsigned origlen)
 {
 	struct ctKey key;
 	uint64_t fragid;
 	int rc = getHashKey(&key, udpEncap, &fragid, proto, data, len, hash_mode);
+	if (rc < 0 && len < origlen) {
+		// The L4 header is beyond the copy range. Use the addresses
+		rc = getHashKeyAddresses(&key, &fragid, proto, data, len);
+		trace(TRACE_PACKET, "Truncated packet, len=%u(%u)\n", len, origlen);
+	}
 	if (rc < 0)
 		return -1;
 
 	unsigned hash;
+	unsigned index;
 	int fw;
+	struct timespec now;
+	int affinity = useAffinity(&key, rc);
+	if (affinity) {
+		// A hit is valid if the target is still active on the index
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		fw = affinityLookup(aff, &now, &key, &index);
+		if (fw >= 0) {
+			if (magDataDyn_activeAt(&magd, index) == fw) {
+				trace(TRACE_PACKET, "Affinity hit. fw=%d\n", fw);
+				return fw;
+			}
+			affinityRemove(aff, &now, &key);
+		}
+	}
+
 	if (rc & 3) {
 		// Fragment. Check if we shall forward to the lb-tier
 		if (slb != NULL) {
 			hash = hashKeyAddresses(&key);
-			fw = magdlb.lookup[hash % magdlb.M];
-			if (fw >= 0)
-				fw = magdlb.active[fw];
+			fw = magDataDyn_lookup(&magdlb, hash);
 			if (fw >= 0 && fw != slb->ownFwmark) {
 				trace(TRACE_FRAG, "Fragment to LB tier. fw=%d\n", fw);
 				return fw; /* To the LB tier */
@@ -77,7 +116,6 @@ static int packetHandleFn(
 		// We shall handle the fragment here
 		if ((rc & 1) == 0) {
 			// Not first-fragment
-			struct timespec now;
 			clock_gettime(CLOCK_MONOTONIC, &now);
 			rc = fragGetValueOrStore(ft, &now, &key, &fw, data, len);
 			if (rc != 0) {
@@ -90,16 +128,15 @@ static int packetHandleFn(
 	}
 
 	hash = hashKey(&key, hash_mode);
-	fw = magd.lookup[hash % magd.M];
-	if (fw >= 0)
-		fw = magd.active[fw];
+	fw = magDataDyn_lookupIndex(&magd, hash, &index);
 	if (fw < 0)
 		return notargets_fw;
+	if (affinity)
+		(void)affinityInsert(aff, &now, &key, fw, index);
 
 	if (rc & 1) {
 		// First fragment
 		trace(TRACE_FRAG, "First fragment\n");
-		struct timespec now;
 		clock_gettime(CLOCK_MONOTONIC, &now);
 		key.id = fragid;
 		if (handleFirstFragment(ft, &now, &key, fw, data, len) != 0) {
@@ -114,9 +151,17 @@ static int packetHandleFn(
 	return fw;
 }
 
+// Divide a size option between the shards
+static unsigned share(char const* opt, unsigned nShards)
+{
+	return (atoi(opt) + nShards - 1) / nShards;
+}
+
 static void *packetHandleThread(void* Q)
 {
-	nfqueueRun((intptr_t)Q);
+	ft = fts[(intptr_t)Q - firstQueue];
+	threadStatsSetIndex((intptr_t)Q - firstQueue + 1);
+	backend->run((intptr_t)Q);
 	return NULL;
 }
 
@@ -131,6 +176,9 @@ static int cmdLb(int argc, char **argv)
 	char const* ft_buckets = "500";
 	char const* ft_frag = "100";
 	char const* ft_ttl = "200";
+	char const* ft_expire = "0";
+	char const* ft_max_size = "0";
+	char const* ft_shards = "no";
 	char const* mtuOpt = "1500";
 	char const* tun = NULL;
 	char const* reassembler = "0";
@@ -138,6 +186,17 @@ static int cmdLb(int argc, char **argv)
 	char const* notargets_fwmark = "-1";
 	char const* lb_hash_mode = "1";
 	char const* trace_address = DEFAULT_TRACE_ADDRESS;
+	char const* nfqShm = "nfqshm";
+	char const* verdictBatch = "0";
+	char const* recvBatch = "0";
+	char const* copyRange = "128";
+	char const* ctMark = "no";
+	char const* backendName = "nfqueue";
+	char const* hashName = NULL;
+	char const* hashSeed = NULL;
+	char const* ingress = NULL;
+	char const* steering = NULL;
+	char const* affinity = NULL;
 	struct Option options[] = {
 		{"help", NULL, 0,
 		 "lb [options]\n"
@@ -152,29 +211,91 @@ static int cmdLb(int argc, char **argv)
 		{"hash_mode", &lb_hash_mode, 0, "Load balance with a different hash mode. 0: Tuple-5, 1: SCTP Ports only. default=1"},
 		{"queue", &qnum, 0, "NF-queues to listen to (default 2)"},
 		{"qlength", &qlen, 0, "Lenght of queues (default 1024)"},
+		{"verdict_batch", &verdictBatch, 0, "Max packets per verdict system call. 0 - no batching (default)"},
+		{"recv_batch", &recvBatch, 0, "Max packets per receive system call (recvmmsg). 0 - no recvmmsg (default)"},
+		{"copy_range", &copyRange, 0, "Bytes copied to user-space if fragments are not stored. 0 - mtu. default=128"},
+		{"ct_mark", &ctMark, 0, "Set the conntrack mark to the fwmark (offload)"},
+		{"hash", &hashName, 0, "Hash function; djb2, wyhash. Recorded in the tshm"},
+		{"hash_seed", &hashSeed, 0, "Hash seed. Recorded in the tshm"},
+		{"backend", &backendName, 0, "Packet I/O; nfqueue (default), tpacket"},
+		{"ingress", &ingress, 0, "tpacket; ingress interface"},
+		{"steer", &steering, 0, "tpacket; fwmark:ifname[/mac],..."},
+		{"nfq_shm", &nfqShm, 0, "Queue stats; shared memory"},
 		{"ft_shm", &ftShm, 0, "Frag table; shared memory stats"},
 		{"ft_size", &ft_size, 0, "Frag table; size"},
 		{"ft_buckets", &ft_buckets, 0, "Frag table; extra buckets"},
 		{"ft_frag", &ft_frag, 0, "Frag table; stored frags"},
 		{"ft_ttl", &ft_ttl, 0, "Frag table; ttl milliS"},
+		{"ft_expire", &ft_expire, 0,
+		 "Frag table; expiry thread interval milliS. 0 - GC on use (default)"},
+		{"ft_max_size", &ft_max_size, 0,
+		 "Frag table; grow online up to this size. 0 - fixed size (default)"},
+		{"ft_shards", &ft_shards, 0,
+		 "Frag table; one per queue. Requires address-hash queue steering"},
+		{"affinity", &affinity, 0,
+		 "Connection affinity; size[:ttl milliS]. default off, ttl=60000"},
 		{"trace_address",  &trace_address, 0, "Trace server address"},
 		{0, 0, 0, 0}
 	};
+	OPTIONS_CHECK(options);
 	(void)parseOptionsOrDie(argc, argv, options);
 	logConfigShm(TRACE_SHM);
 	logTraceServer(trace_address);
 
-	st = mapSharedDataOrDie(targetShm, O_RDONLY);
+	/*
+	  The hash function is taken from the target shm. If specified it
+	  is recorded in the shm to keep "nfqlb fwmark" consistent. An
+	  offline benchmark ("nfqlb bench") never writes the target shm.
+	 */
+	int record = (hashName != NULL || hashSeed != NULL) &&
+		strcmp(backendName, "bench") != 0;
+	st = mapTargetShmOrDie(targetShm, record ? O_RDWR : O_RDONLY);
+	unsigned hashFn = st->hashFn;
+	uint32_t hashSeedVal = st->hashSeed;
+	if (hashName != NULL) {
+		int fn = hashParseFunction(hashName);
+		if (fn < 0)
+			die("Unknown hash function [%s]\n", hashName);
+		hashFn = fn;
+	}
+	if (hashSeed != NULL)
+		hashSeedVal = strtoul(hashSeed, NULL, 0);
+	if (record) {
+		st->hashFn = hashFn;
+		st->hashSeed = hashSeedVal;
+	}
+	hashSetFunction(hashFn, hashSeedVal);
 	magDataDyn_map(&magd, st->mem);
 	if (lbShm != NULL) {
-		slb = mapSharedDataOrDie(lbShm, O_RDONLY);
+		slb = mapTargetShmOrDie(lbShm, O_RDONLY);
 		magDataDyn_map(&magdlb, slb->mem);
 	}
 	notargets_fw = atoi(notargets_fwmark);
 
-	// Create and re-map the stats struct
-	sft = calloc(1, sizeof(*sft));
-	createSharedDataOrDie(ftShm, sft, sizeof(*sft));
+	/*
+	  The qnum may be a range like "0:3" in which case we go
+	  multi-threading and listen to all queues in the range;
+	 */
+	unsigned first, last;
+	first = last = atoi(qnum);
+	if (strchr(qnum, ':') != NULL) {
+		if (sscanf(qnum, "%u:%u", &first, &last) != 2)
+			die("queue invalid [%s]\n", qnum);
+		if (first > last)
+			die("queue invalid [%s]\n", qnum);
+	}
+
+	/*
+	  In sharded mode each queue thread has an own FragTable. The
+	  sizes are divided between the shards. Otherwise the FragTable
+	  has per-thread stats; one block for each queue thread and block
+	  0 for other threads. Create and re-map the stats.
+	 */
+	unsigned nQueues = last - first + 1;
+	unsigned nShards = ft_shards == NULL ? nQueues : 1;
+	unsigned nThreads = nShards > 1 ? 1 : nQueues + 1;
+	sft = calloc(nShards * nThreads, sizeof(*sft));
+	createSharedDataOrDie(ftShm, sft, nShards * nThreads * sizeof(*sft));
 	free(sft);
 	sft = mapSharedDataOrDie(ftShm, O_RDWR);
 
@@ -201,47 +322,79 @@ static int cmdLb(int argc, char **argv)
 	} else {
 		/*
 		  We can't inject stored fragments. Disable storing of
-		  fragments. The MTU *may* be set to to 1280 to avoid copy unnecessary
-		  data to user-space, but then reassembly will not work since the
-		  original packet lenght is lost.
+		  fragments. If reassembly isn't used either we only need the
+		  headers, so copy only the start of packets to user-space.
 		 */
 		ft_frag = "0";
+		if (atoi(reassembler) == 0)
+			nfqueueSetCopyRange(atoi(copyRange));
 	}
 
-	ft = fragTableCreate(
-		atoi(ft_size),		/* table size */
-		atoi(ft_buckets),	/* Extra buckets for hash collisions */
-		atoi(ft_frag),		/* Max stored fragments */
-		mtu,				/* MTU. Only used for stored fragments */
-		atoi(ft_ttl));		/* Fragment TTL in milli seconds */
-	fragUseStats(ft, sft);
-	if (atoi(reassembler) > 0)
-		fragRegisterFragReassembler(ft, createReassembler(atoi(reassembler)));
+	fts = calloc(nQueues, sizeof(*fts));
+	for (unsigned i = 0; i < nShards; i++) {
+		fts[i] = fragTableCreate(
+			share(ft_size, nShards),	/* table size */
+			share(ft_buckets, nShards),	/* Extra buckets for hash collisions */
+			share(ft_frag, nShards),	/* Max stored fragments */
+			mtu,				/* MTU. Only used for stored fragments */
+			atoi(ft_ttl));		/* Fragment TTL in milli seconds */
+		if (atoi(ft_max_size) > 0 &&
+			fragSetMaxSize(fts[i], share(ft_max_size, nShards)) != 0)
+			die("Invalid ft_max_size %s\n", ft_max_size);
+		fragUseThreadStats(fts[i], sft + i * nThreads, nThreads);
+		if (atoi(ft_expire) > 0 && fragStartExpiry(fts[i], atoi(ft_expire)) != 0)
+			die("Failed to start the frag table expiry\n");
+		if (atoi(reassembler) > 0)
+			fragRegisterFragReassembler(
+				fts[i], createReassembler(share(reassembler, nShards)));
+	}
+	for (unsigned i = nShards; i < nQueues; i++)
+		fts[i] = fts[0];
+	for (unsigned i = 0; i < nShards * nThreads; i++) {
+		sft[i].nShards = nShards;
+		sft[i].nThreads = nThreads;
+	}
+	firstQueue = first;
 	printf(
-		"FragTable; size=%d, buckets=%d, frag=%d, mtu=%d, ttl=%d\n",
-		atoi(ft_size),atoi(ft_buckets),atoi(ft_frag),mtu,atoi(ft_ttl));
+		"FragTable; size=%d, buckets=%d, frag=%d, mtu=%d, ttl=%d, shards=%u\n",
+		atoi(ft_size),atoi(ft_buckets),atoi(ft_frag),mtu,atoi(ft_ttl),nShards);
 
-	nfqueueInit(packetHandleFn, atoi(qlen), mtu);
+	if (affinity != NULL) {
+		unsigned size, ttl = 60000;
+		if (sscanf(affinity, "%u:%u", &size, &ttl) < 1 || size == 0)
+			die("affinity invalid [%s]\n", affinity);
+		aff = affinityCreate(size, ttl, nQueues + 1);
+		if (aff == NULL)
+			die("Failed to create the affinity table\n");
+		printf("Affinity; size=%u, ttl=%u\n", size, ttl);
+	}
 
-	/*
-	  The qnum may be a range like "0:3" in which case we go
-	  multi-threading and listen to all queues in the range;
-	 */
-	unsigned Q = atoi(qnum);
-	if (strchr(qnum, ':') != NULL) {
-		unsigned first, last;
-		if (sscanf(qnum, "%u:%u", &first, &last) != 2)
-			die("queue invalid [%s]\n", qnum);
-		if (first > last)
-			die("queue invalid [%s]\n", qnum);
-		for (Q = first; Q < last; Q++) {
-			pthread_t tid;
-			if (pthread_create(&tid, NULL, packetHandleThread, (void*)(intptr_t)Q) != 0)
-				die("Failed pthread_create for Q=%u\n", Q);
-		}
-		Q = last;				/* Last will go to the main thread */
+	backend = backendGetOrDie(backendName);
+	if (ingress != NULL)
+		tpacketSetIngress(ingress);
+	if (steering != NULL)
+		tpacketSetSteering(steering);
+	backend->init(packetHandleFn, atoi(qlen), mtu);
+	nfqueueSetVerdictBatch(atoi(verdictBatch));
+	nfqueueSetRecvBatch(atoi(recvBatch));
+	nfqueueSetConntrackMark(ctMark == NULL);
+
+	// Create and re-map the queue stats
+	struct nfqueueStats* sq = calloc(1, NFQUEUE_STATS_LEN(nQueues));
+	createSharedDataOrDie(nfqShm, sq, NFQUEUE_STATS_LEN(nQueues));
+	free(sq);
+	sq = mapSharedDataOrDie(nfqShm, O_RDWR);
+	backend->useStats(sq, first, nQueues);
+
+	unsigned Q;
+	for (Q = first; Q < last; Q++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, packetHandleThread, (void*)(intptr_t)Q) != 0)
+			die("Failed pthread_create for Q=%u\n", Q);
 	}
-	return nfqueueRun(Q);
+	ft = fts[last - first];
+	threadStatsSetIndex(last - first + 1);
+	return backend->run(last);	/* Last will go to the main thread */
 }
 
 __attribute__ ((__constructor__)) static void addCommands(void) {
@@ -10,25 +10,96 @@
 #include <prime.h>
 #include <fragutils.h>
 #include <maglevdyn.h>
+#include <hash.h>
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 char const* const defaultTargetShm = "nfqlb";
 
+static char const* const hugepagesName[] = {"no", "thp", "hugetlb"};
+
 static void initShm(
-	char const* name, int ownFw, unsigned m, unsigned n)
+	char const* name, int ownFw, unsigned m, unsigned n, unsigned width,
+	unsigned hashFn, uint32_t hashSeed, unsigned engine, uint32_t maglevSeed,
+	int huge)
 {
-	unsigned len = magDataDyn_len(m, n);
+	unsigned len = magDataDyn_len(m, n, width);
 	struct SharedData* s = malloc(sizeof(struct SharedData) + len);
 	s->ownFwmark = ownFw;
-	createSharedDataOrDie(name, s, sizeof(struct SharedData) + len);
+	s->magic = SHARED_DATA_MAGIC;
+	s->hashFn = hashFn;
+	s->hashSeed = hashSeed;
+	s->hugepages = SHM_HUGE_NO;
+	if (huge != SHM_HUGE_NO) {
+		int rc = createSharedDataHuge(name, s, sizeof(struct SharedData) + len, huge);
+		if (rc < 0)
+			die("createSharedDataHuge: %s\n", strerror(errno));
+		if (rc != huge)
+			printf("Hugepages %s not available, using %s\n",
+				   hugepagesName[huge], hugepagesName[rc]);
+		huge = rc;
+	} else {
+		createSharedDataOrDie(name, s, sizeof(struct SharedData) + len);
+	}
 	free(s);
-	s = mapSharedDataOrDie(name, O_RDWR);
-	magDataDyn_init(m, n, s->mem, len);
+	s = mapTargetShmOrDie(name, O_RDWR);
+	s->hugepages = huge;
+	magDataDyn_init(m, n, width, engine, maglevSeed, s->mem, len);
+}
+
+/*
+  Convert a target shm created by nfqlb before the format was versioned
+  (format 1). The SharedData had only the ownFwmark then. The shm is
+  re-created with the M and N from the old shm and the active targets
+  and the lookup table are copied, so no traffic moves. Processes that
+  have the old shm mapped keep it (it's unlinked, not truncated).
+ */
+struct SharedDataV1 {
+	int ownFwmark;
+	unsigned char mem[];
+};
+static void convertShm(
+	char const* name, unsigned width, unsigned hashFn, uint32_t hashSeed,
+	unsigned engine, uint32_t maglevSeed, int huge)
+{
+	int fd;
+	struct SharedDataV1* old = mapSharedDataRead(name, &fd);
+	if (old == NULL)
+		die("Failed to map shm [%s]\n", name);
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) != 0)
+		die("fstat shared mem; %s\n", name);
+	unsigned m, n;
+	if (statbuf.st_size < sizeof(*old) || !magDataDyn_isV1(
+			old->mem, statbuf.st_size - sizeof(*old), &m, &n))
+		die("Not an old format shm [%s]\n", name);
+	struct SharedDataV1* copy = malloc(statbuf.st_size);
+	if (copy == NULL)
+		die("Out of mem\n");
+	memcpy(copy, old, statbuf.st_size);
+	munmap(old, statbuf.st_size);
+	close(fd);
+
+	if (deleteSharedData(name) != 0)
+		die("Delete shm [%s]: %s\n", name, strerror(errno));
+	initShm(
+		name, copy->ownFwmark, m, n, width, hashFn, hashSeed, engine,
+		maglevSeed, huge);
+	struct SharedData* s = mapTargetShmOrDie(name, O_RDWR);
+	struct MagDataDyn magd;
+	magDataDyn_map(&magd, s->mem);
+	magDataDyn_convertV1(&magd, copy->mem);
+	printf("Converted %s; M=%u, N=%u, checksum=%08x\n",
+		   name, m, n, magDataDyn_checksum(&magd));
+	magDataDyn_free(&magd);
+	free(copy);
 }
 
 static int cmdInit(int argc, char **argv)
@@ -37,6 +108,13 @@ static int cmdInit(int argc, char **argv)
 	char const* M = "997";
 	char const* N = "32";
 	char const* ownFw = "0";
+	char const* hashName = "djb2";
+	char const* hashSeed = "0";
+	char const* width = "0";
+	char const* maglevSeed = "0";
+	char const* engineName = "maglev";
+	char const* hugepages = NULL;
+	char const* convert = "no";
 	struct Option options[] = {
 		{"help", NULL, 0,
 		 "init [options]\n"
@@ -45,9 +123,39 @@ static int cmdInit(int argc, char **argv)
 		{"shm", &shm, 0, "Target shared memory"},
 		{"N", &N, 0, "Maglev max targets"},
 		{"M", &M, 0, "Maglev lookup table size"},
+		{"hash", &hashName, 0, "Hash function; djb2 (default), wyhash"},
+		{"hash_seed", &hashSeed, 0, "Hash seed (not used by djb2)"},
+		{"lookup_width", &width, 0,
+		 "Lookup entry size 1,2,4 bytes. Default the smallest for N"},
+		{"engine", &engineName, 0, "Consistent hash; maglev (default), hrw, jump"},
+		{"hugepages", &hugepages, 0,
+		 "Back the shm with huge pages; no (default), thp, hugetlb"},
+		{"maglev_seed", &maglevSeed, 0,
+		 "Seed for the Maglev permutations. Use the same on all nodes"},
+		{"convert", &convert, 0,
+		 "Convert a shm from an older nfqlb. Keeps M, N and the targets"},
 		{0, 0, 0, 0}
 	};
 	(void)parseOptionsOrDie(argc, argv, options);
+	int hashFn = hashParseFunction(hashName);
+	if (hashFn < 0)
+		die("Unknown hash function [%s]\n", hashName);
+	int engine = magDataDyn_parseEngine(engineName);
+	if (engine < 0)
+		die("Unknown engine [%s]\n", engineName);
+	int huge = hugepages == NULL ? SHM_HUGE_NO : -1;
+	for (int i = 0; hugepages != NULL && i < 3; i++) {
+		if (strcmp(hugepages, hugepagesName[i]) == 0)
+			huge = i;
+	}
+	if (huge < 0)
+		die("Unknown hugepages [%s]\n", hugepages);
+	if (convert == NULL) {
+		convertShm(
+			shm, atoi(width), hashFn, strtoul(hashSeed, NULL, 0), engine,
+			strtoul(maglevSeed, NULL, 0), huge);
+		return 0;
+	}
 	unsigned m, n, p;
 	m = atoi(M);
 	if (m < 3)
@@ -61,7 +169,10 @@ static int cmdInit(int argc, char **argv)
 	n = atoi(N);
 	if (n > m)
 		die("N can't be larger than M\n");
-	initShm(shm, atoi(ownFw), m, n);
+	initShm(
+		shm, atoi(ownFw), m, n, atoi(width), hashFn,
+		strtoul(hashSeed, NULL, 0), engine, strtoul(maglevSeed, NULL, 0),
+		huge);
 
 	return 0;
 }
@@ -76,7 +187,7 @@ static int cmdDelete(int argc, char **argv)
 		{0, 0, 0, 0}
 	};
 	(void)parseOptionsOrDie(argc, argv, options);
-	if (shm_unlink(shm) != 0 && errno != ENOENT)
+	if (deleteSharedData(shm) != 0 && errno != ENOENT)
 		die("%s\n", strerror(errno));
 	return 0;
 }
@@ -100,31 +211,60 @@ static int cmdPrimeBelow(int argc, char **argv)
 static int cmdShow(int argc, char **argv)
 {
 	char const* shm = defaultTargetShm;
+	char const* stats = "no";
 	struct Option options[] = {
 		{"help", NULL, 0,
 		 "show [options]\n"
 		 "  Show shared mem structures"},
 		{"shm", &shm, 0, "Shared memory"},
+		{"stats", &stats, 0, "Show statistics for the last lookup update"},
 		{0, 0, 0, 0}
 	};
 	(void)parseOptionsOrDie(argc, argv, options);
 	struct SharedData* s;
-	s = mapSharedDataOrDie(shm, O_RDONLY);
+	s = mapTargetShmOrDie(shm, O_RDONLY);
 	if (s == NULL)
 		die("Failed to open shared mem; %s\n", shm);
 	printf("Shm: %s\n", shm);
 	printf("  Fw: own=%d\n", s->ownFwmark);
+	printf("  Hash: %s, seed=%u\n", hashFunctionName(s->hashFn), s->hashSeed);
+	if (s->hugepages != SHM_HUGE_NO && s->hugepages <= SHM_HUGE_TLB)
+		printf("  Hugepages: %s\n", hugepagesName[s->hugepages]);
 
 	struct MagDataDyn magd;
 	magDataDyn_map(&magd, s->mem);
-	printf("  Maglev: M=%d, N=%d\n", magd.M, magd.N);
+	printf(
+		"  Maglev: M=%d, N=%d, width=%u, engine=%s, seed=%u, generation=%u\n",
+		magd.M, magd.N, magd.width, magDataDyn_engineName(magd.engine),
+		magd.seed, magDataDyn_generation(&magd));
+	uint32_t sum = magDataDyn_checksum(&magd);
+	uint32_t full = magDataDyn_populateChecksum(&magd);
+	if (sum == full)
+		printf("   Checksum: %08x\n", sum);
+	else
+		printf(
+			"   Checksum: %08x (differs from a full populate: %08x, "
+			"not consistent with other nodes)\n", sum, full);
+	if (stats == NULL) {
+		struct MagDataDynStats const* st = magd.stats;
+		printf(
+			"   Stats: changed=%u (%.2f%%), duration=%.3f ms\n",
+			st->changed, 100.0 * st->changed / magd.M, st->duration / 1000000.0);
+		printf(
+			"   Slots: active=%u, min=%u, max=%u, stddev=%.1f\n",
+			st->active, st->min, st->max, st->stddev);
+	}
 	printf("   Lookup:");
 	for (int i = 0; i < 25 && i < magd.M; i++)
-		printf(" %d", magd.lookup[i]);
+		printf(" %d", magDataDyn_slot(&magd, i));
 	printf("...\n");
 	printf("   Active:");
 	for (int i = 0; i < magd.N; i++) {
-		if (magd.active[i] >= 0)
+		if (magd.active[i] < 0)
+			continue;
+		if (magd.weight[i] != 1)
+			printf(" %d(%d,w=%u)", magd.active[i], i, magd.weight[i]);
+		else
 			printf(" %d(%d)", magd.active[i], i);
 	}
 	printf("\n");
@@ -136,16 +276,64 @@ static int cmdShow(int argc, char **argv)
 static int cmdStats(int argc, char **argv)
 {
 	char const* ftShm = "ftshm";
+	char const* deep = "no";
 	struct Option options[] = {
 		{"help", NULL, 0,
 		 "stats [options]\n"
 		 "  Show frag table stats"},
 		{"ft_shm", &ftShm, 0, "Frag table; shared memory stats"},
+		{"deep", &deep, 0,
+		 "Full GC before showing stats. Requires \"lb --ft_expire\""},
+		{0, 0, 0, 0}
+	};
+	(void)parseOptionsOrDie(argc, argv, options);
+	struct fragStats* sft;
+	if (deep == NULL) {
+		// Request a full GC in all shards (the first block in each)
+		sft = mapSharedDataOrDie(ftShm, O_RDWR);
+		unsigned n = sft->nShards > 0 ? sft->nShards : 1;
+		unsigned stride = sft->nThreads > 0 ? sft->nThreads : 1;
+		unsigned req[n];
+		for (unsigned s = 0; s < n; s++)
+			req[s] = __atomic_add_fetch(
+				&sft[s * stride].deepRequest, 1, __ATOMIC_RELAXED);
+		struct timespec t = {0, 10000000};
+		unsigned s = 0;
+		int i;
+		for (i = 0; i < 100; i++) {
+			while (s < n &&
+				   __atomic_load_n(
+					   &sft[s * stride].deepDone, __ATOMIC_RELAXED) == req[s])
+				s++;
+			if (s == n)
+				break;
+			nanosleep(&t, NULL);
+		}
+		if (i == 100)
+			fprintf(stderr, "Deep scan not done. Is \"--ft_expire\" used?\n");
+	} else {
+		sft = mapSharedDataOrDie(ftShm, O_RDONLY);
+	}
+	// Sum the shards and per-thread blocks
+	struct fragStats sum;
+	fragSumStats(sft, &sum);
+	fragPrintStats(&sum);
+	return 0;
+}
+
+static int cmdQstats(int argc, char **argv)
+{
+	char const* nfqShm = "nfqshm";
+	struct Option options[] = {
+		{"help", NULL, 0,
+		 "qstats [options]\n"
+		 "  Show per-queue stats"},
+		{"nfq_shm", &nfqShm, 0, "Queue stats; shared memory"},
 		{0, 0, 0, 0}
 	};
 	(void)parseOptionsOrDie(argc, argv, options);
-	struct fragStats* sft = mapSharedDataOrDie(ftShm, O_RDONLY);
-	fragPrintStats(sft);
+	struct nfqueueStats* sq = mapSharedDataOrDie(nfqShm, O_RDONLY);
+	nfqueuePrintStats(sq);
 	return 0;
 }
 
@@ -154,5 +342,6 @@ __attribute__ ((__constructor__)) static void addCommands(void) {
 	addCmd("delete", cmdDelete);
 	addCmd("show", cmdShow);
 	addCmd("stats", cmdStats);
+	addCmd("qstats", cmdQstats);
 	addCmd("primebelow", cmdPrimeBelow);
 }